@@ -0,0 +1,227 @@
+/*
+
+Binary access log
+
+Workers fill in a fixed-layout struct access_record per request and queue
+it on their log ring (see log.c); nothing is formatted on the request path,
+and a full ring makes the worker wait rather than lose the record.
+The log writer thread hands the records to access_sink(), which appends
+them to a file mmap'd at its full ACCESS_LOG_FILE_SIZE and bumps the
+record count in the file header, so a reader always sees whole records.
+
+When the file is full it is truncated to what was written and rotated to
+path.1, path.1 to path.2 and so on up to ACCESS_LOG_KEEP, and a fresh file
+is started. A file already at path when the log is opened is rotated the
+same way rather than truncated: it may be the previous run's, or still
+being written by the process a hot upgrade is replacing.
+
+Use logdecode to turn the files into text or JSON.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "accesslog.h"
+#include "log.h"
+
+// Only touched at open/close and by the log writer
+static char *log_path;
+static int log_file = -1;
+static unsigned char *map;
+static struct access_log_header *header;
+
+/**
+ * Create a fresh log file at log_path and map it
+ *
+ * Return 0 on success, -1 on error.
+ */
+static int start_file(void)
+{
+    log_file = open(log_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (log_file == -1) {
+        perror(log_path);
+        return -1;
+    }
+
+    if (ftruncate(log_file, ACCESS_LOG_FILE_SIZE) == -1) {
+        perror("ftruncate access log");
+        close(log_file);
+        log_file = -1;
+        return -1;
+    }
+
+    map = mmap(NULL, ACCESS_LOG_FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, log_file, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap access log");
+        close(log_file);
+        log_file = -1;
+        map = NULL;
+        return -1;
+    }
+
+    header = (struct access_log_header *)map;
+    header->magic = ACCESS_LOG_MAGIC;
+    header->version = ACCESS_LOG_VERSION;
+    header->record_size = sizeof(struct access_record);
+    header->count = 0;
+
+    return 0;
+}
+
+/**
+ * Unmap the current file and cut it down to the records it holds
+ */
+static void finish_file(void)
+{
+    if (map == NULL) {
+        return;
+    }
+
+    off_t length = sizeof *header + header->count * sizeof(struct access_record);
+
+    munmap(map, ACCESS_LOG_FILE_SIZE);
+    if (ftruncate(log_file, length) == -1) {
+        perror("ftruncate access log");
+    }
+    close(log_file);
+
+    map = NULL;
+    header = NULL;
+    log_file = -1;
+}
+
+/**
+ * Shift path.N to path.N+1, dropping the oldest, then path to path.1
+ */
+static void shift_files(void)
+{
+    int size = strlen(log_path) + 16;
+    char from[size], to[size];
+
+    for (int i = ACCESS_LOG_KEEP - 1; i >= 1; i--) {
+        snprintf(from, size, "%s.%d", log_path, i);
+        snprintf(to, size, "%s.%d", log_path, i + 1);
+        (void)rename(from, to);
+    }
+    snprintf(to, size, "%s.1", log_path);
+    if (rename(log_path, to) == -1) {
+        perror("rename access log");
+    }
+}
+
+/**
+ * Close the full file, shift the old ones along and start a fresh one
+ */
+static void rotate(void)
+{
+    finish_file();
+    shift_files();
+    (void)start_file();
+}
+
+/**
+ * Log writer callback: append one record
+ */
+static void access_sink(const void *data, int length)
+{
+    if (map == NULL || length != sizeof(struct access_record)) {
+        return;
+    }
+
+    size_t offset = sizeof *header + header->count * sizeof(struct access_record);
+
+    if (offset + sizeof(struct access_record) > ACCESS_LOG_FILE_SIZE) {
+        rotate();
+        if (map == NULL) {
+            return;
+        }
+        offset = sizeof *header;
+    }
+
+    memcpy(map + offset, data, length);
+    header->count++;
+}
+
+/**
+ * Fill in a record's phase timings from access_clock_ns() timestamps
+ *
+ * Timestamps are 0 for points the request never reached. A request that
+ * was never parsed (a timeout, or turned away by admission control) spent
+ * everything up to its response reading; without a response, nothing.
+ */
+void access_set_phases(struct access_record *rec, uint64_t accepted_ns, uint64_t started_ns,
+                       uint64_t parsed_ns, uint64_t sent_ns, uint64_t done_ns)
+{
+    uint64_t read_end = parsed_ns != 0 ? parsed_ns : sent_ns != 0 ? sent_ns : started_ns;
+
+    rec->phase_us[ACCESS_PHASE_QUEUE] = access_interval_us(accepted_ns, started_ns);
+    rec->phase_us[ACCESS_PHASE_READ] = access_interval_us(started_ns, read_end);
+    if (sent_ns != 0) {
+        rec->phase_us[ACCESS_PHASE_HANDLE] = access_interval_us(read_end, sent_ns);
+        rec->phase_us[ACCESS_PHASE_SEND] = access_interval_us(sent_ns, done_ns);
+    }
+}
+
+/**
+ * Start logging requests to path
+ *
+ * Return 0 on success, -1 on error.
+ */
+int access_log_open(char *path)
+{
+    log_path = strdup(path);
+    if (log_path == NULL) {
+        perror("strdup");
+        return -1;
+    }
+
+    // Renaming a file that's still mapped elsewhere is safe; truncating isn't
+    if (access(log_path, F_OK) == 0) {
+        shift_files();
+    }
+    if (start_file() == -1) {
+        free(log_path);
+        log_path = NULL;
+        return -1;
+    }
+
+    log_set_sink(LOG_CHANNEL_ACCESS, access_sink);
+
+    return 0;
+}
+
+/**
+ * Queue a request's record
+ *
+ * Only blocks if the log writer has fallen a whole ring behind this thread;
+ * records aren't dropped.
+ * Stamps time_ns. Does nothing if the access log isn't open.
+ */
+void access_log_write(struct access_record *rec)
+{
+    struct timespec ts;
+
+    if (log_path == NULL) {
+        return;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    rec->time_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+
+    (void)log_write_record_wait(LOG_CHANNEL_ACCESS, rec, sizeof *rec);
+}
+
+/**
+ * Write out queued records and close the file
+ */
+void access_log_close(void)
+{
+    log_flush();
+    log_set_sink(LOG_CHANNEL_ACCESS, NULL);
+    finish_file();
+}
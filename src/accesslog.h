@@ -0,0 +1,85 @@
+#ifndef _ACCESSLOG_H_
+#define _ACCESSLOG_H_
+
+#include <stdint.h>
+#include <time.h>
+
+#define ACCESS_LOG_MAGIC 0x474c4341 // "ACLG"
+#define ACCESS_LOG_VERSION 1
+#define ACCESS_LOG_FILE_SIZE (64 * 1024 * 1024) // Rotate when a file is this full
+#define ACCESS_LOG_KEEP 4 // Rotated files kept: path.1 (newest) .. path.4
+
+#define ACCESS_PATH_SIZE 176 // Longer paths are truncated
+
+// Request methods
+#define ACCESS_METHOD_OTHER 0
+#define ACCESS_METHOD_GET 1
+#define ACCESS_METHOD_POST 2
+#define ACCESS_METHOD_HEAD 3
+
+// Flags
+#define ACCESS_CACHE_HIT 0x01
+#define ACCESS_CACHE_MISS 0x02
+#define ACCESS_BUNDLE 0x04 // Served from the asset bundle
+
+// Phase timings, in microseconds
+#define ACCESS_PHASE_QUEUE 0  // Accepted until a worker picked it up
+#define ACCESS_PHASE_READ 1   // Receiving and parsing the request
+#define ACCESS_PHASE_HANDLE 2 // Until the response header went out
+#define ACCESS_PHASE_SEND 3   // Sending the rest of the response
+#define ACCESS_NUM_PHASES 4
+
+// File header, at offset 0 of every log file
+struct access_log_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+    uint64_t count; // Complete records that follow
+};
+
+// One request; fixed layout, little-endian, no implicit padding
+struct access_record {
+    uint64_t time_ns; // CLOCK_REALTIME when the request finished
+    uint64_t bytes; // Response bytes sent, header included
+    uint32_t phase_us[ACCESS_NUM_PHASES];
+    int32_t fd;
+    uint16_t status; // 0 if no response was sent
+    uint8_t method;
+    uint8_t flags;
+    uint8_t family; // AF_INET or AF_INET6
+    uint8_t reserved[7];
+    uint8_t addr[16]; // Client address, the first 4 bytes for IPv4
+    char path[ACCESS_PATH_SIZE]; // NUL padded
+};
+
+_Static_assert(sizeof(struct access_record) == 240, "access_record layout changed");
+
+/**
+ * Monotonic clock in nanoseconds, for phase timings
+ */
+static inline uint64_t access_clock_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Microseconds from from_ns to to_ns, 0 if from_ns wasn't reached or the
+ * two are out of order
+ */
+static inline uint32_t access_interval_us(uint64_t from_ns, uint64_t to_ns)
+{
+    return from_ns != 0 && to_ns > from_ns ? (to_ns - from_ns) / 1000 : 0;
+}
+
+extern void access_set_phases(struct access_record *rec, uint64_t accepted_ns,
+                              uint64_t started_ns, uint64_t parsed_ns, uint64_t sent_ns,
+                              uint64_t done_ns);
+extern int access_log_open(char *path);
+extern void access_log_write(struct access_record *rec);
+extern void access_log_close(void);
+
+#endif
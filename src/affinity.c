@@ -0,0 +1,176 @@
+/*
+
+CPU and NUMA placement
+
+Thin wrappers over sched affinity and the kernel's topology in sysfs, so
+the server can pin threads and find out which NUMA node a CPU is on
+without depending on libnuma. Everything degrades to "one node, no
+pinning" where the information isn't available.
+
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include "affinity.h"
+
+/**
+ * Parse a CPU list like "0-3,8,10-11" into cpus
+ *
+ * Return the number of CPUs stored (at most max), or -1 if the list is
+ * malformed.
+ */
+int affinity_parse_cpus(const char *list, int *cpus, int max)
+{
+    const char *p = list;
+    int count = 0;
+
+    while (*p != '\0' && *p != '\n') {
+        char *end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+
+        if (end == p || first < 0 || first > INT_MAX) {
+            return -1;
+        }
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1 || last < first || last > INT_MAX) {
+                return -1;
+            }
+            p = end;
+        }
+        for (long cpu = first; cpu <= last && count < max; cpu++) {
+            cpus[count++] = cpu;
+        }
+        if (*p == ',') {
+            p++;
+        } else if (*p != '\0' && *p != '\n') {
+            return -1;
+        }
+    }
+
+    return count;
+}
+
+/**
+ * Pin the calling thread to one CPU
+ *
+ * Return 0 on success, -1 on error.
+ */
+int affinity_pin_self(int cpu)
+{
+    cpu_set_t set;
+    int rv;
+
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+        return -1;
+    }
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    rv = pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+    if (rv != 0) {
+        fprintf(stderr, "pin to cpu %d: %s\n", cpu, strerror(rv));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * NUMA node a CPU belongs to, 0 if unknown
+ */
+int affinity_cpu_node(int cpu)
+{
+    char path[64];
+    struct dirent *ent;
+    int node = 0;
+
+    // The CPU's sysfs directory holds a nodeN link to its node
+    snprintf(path, sizeof path, "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        return 0;
+    }
+    while ((ent = readdir(dir)) != NULL) {
+        if (sscanf(ent->d_name, "node%d", &node) == 1) {
+            break;
+        }
+        node = 0;
+    }
+    closedir(dir);
+
+    return node;
+}
+
+/**
+ * Read a sysfs CPU or node list file into ids
+ *
+ * Return the number of ids, or -1 if it can't be read.
+ */
+static int read_list(const char *path, int *ids, int max)
+{
+    char buf[4096];
+    FILE *f = fopen(path, "r");
+
+    if (f == NULL) {
+        return -1;
+    }
+    if (fgets(buf, sizeof buf, f) == NULL) {
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+
+    return affinity_parse_cpus(buf, ids, max);
+}
+
+/**
+ * Number of NUMA nodes, counting up to the highest online one
+ */
+int affinity_num_nodes(void)
+{
+    int nodes[AFFINITY_MAX_CPUS];
+    int n = read_list("/sys/devices/system/node/online", nodes, AFFINITY_MAX_CPUS);
+
+    return n > 0 ? nodes[n - 1] + 1 : 1;
+}
+
+/**
+ * The CPUs of a NUMA node
+ *
+ * Return the number of CPUs stored, or -1 if the node doesn't exist.
+ */
+int affinity_node_cpus(int node, int *cpus, int max)
+{
+    char path[64];
+
+    snprintf(path, sizeof path, "/sys/devices/system/node/node%d/cpulist", node);
+    return read_list(path, cpus, max);
+}
+
+/**
+ * CPU that processed the packets of an accepted connection, -1 if unknown
+ *
+ * With RSS or RPS, that's the CPU owning the NIC queue the flow hashed to.
+ */
+int affinity_incoming_cpu(int fd)
+{
+#ifdef SO_INCOMING_CPU
+    int cpu;
+    socklen_t len = sizeof cpu;
+
+    if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0) {
+        return cpu;
+    }
+#else
+    (void)fd;
+#endif
+    return -1;
+}
@@ -0,0 +1,13 @@
+#ifndef _AFFINITY_H_
+#define _AFFINITY_H_
+
+#define AFFINITY_MAX_CPUS 1024
+
+extern int affinity_parse_cpus(const char *list, int *cpus, int max);
+extern int affinity_pin_self(int cpu);
+extern int affinity_cpu_node(int cpu);
+extern int affinity_num_nodes(void);
+extern int affinity_node_cpus(int node, int *cpus, int max);
+extern int affinity_incoming_cpu(int fd);
+
+#endif
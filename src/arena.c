@@ -0,0 +1,101 @@
+/*
+
+Per-connection bump arena
+
+Everything a request needs for parsing, header building and temporaries is
+bumped out of the connection's arena and released all at once by
+arena_reset() when the request is done; nothing is freed individually.
+
+Chunks come from the slab allocator, so a worker that resets its arena and
+starts the next request gets the same, still cache-warm, chunk back out of
+its magazine. An idle connection holds no chunk at all, just the pointer in
+struct arena_t.
+
+Allocations too big for a regular chunk get a chunk of their own, sized to
+fit.
+
+*/
+
+#include <string.h>
+#include "arena.h"
+#include "slab.h"
+
+struct arena_chunk {
+    struct arena_chunk *prev; // Older chunk, freed along with this one
+    size_t block_size; // Size handed to slab_alloc()
+    size_t used; // Bytes of data[] handed out
+    size_t pad; // Keeps data[] ARENA_ALIGN aligned
+    unsigned char data[];
+};
+
+/**
+ * Start an empty arena
+ */
+void arena_init(arena *a)
+{
+    a->chunk = NULL;
+}
+
+/**
+ * Allocate size bytes, aligned to ARENA_ALIGN
+ *
+ * Return NULL if a new chunk was needed and couldn't be allocated.
+ */
+void *arena_alloc(arena *a, size_t size)
+{
+    struct arena_chunk *c = a->chunk;
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    if (c == NULL || c->used + size > c->block_size - sizeof *c) {
+        size_t block_size = sizeof *c + size;
+        if (block_size < ARENA_CHUNK_SIZE) {
+            block_size = ARENA_CHUNK_SIZE;
+        }
+
+        c = slab_alloc(block_size);
+        if (c == NULL) {
+            return NULL;
+        }
+        c->prev = a->chunk;
+        c->block_size = block_size;
+        c->used = 0;
+        a->chunk = c;
+    }
+
+    void *p = c->data + c->used;
+    c->used += size;
+
+    return p;
+}
+
+/**
+ * Copy a string into the arena
+ */
+char *arena_strdup(arena *a, const char *s)
+{
+    size_t length = strlen(s) + 1;
+    char *copy = arena_alloc(a, length);
+
+    if (copy != NULL) {
+        memcpy(copy, s, length);
+    }
+
+    return copy;
+}
+
+/**
+ * Release everything allocated since the last reset
+ */
+void arena_reset(arena *a)
+{
+    struct arena_chunk *c = a->chunk;
+
+    while (c != NULL) {
+        struct arena_chunk *prev = c->prev;
+        slab_free(c, c->block_size);
+        c = prev;
+    }
+
+    a->chunk = NULL;
+}
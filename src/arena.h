@@ -0,0 +1,21 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+
+#define ARENA_CHUNK_SIZE 16384 // One slab object, header included
+#define ARENA_ALIGN 16
+
+struct arena_chunk;
+
+// Bump allocator for memory that lives exactly as long as one request
+typedef struct arena_t {
+    struct arena_chunk *chunk; // Newest chunk, NULL until the first alloc
+} arena;
+
+extern void arena_init(arena *a);
+extern void *arena_alloc(arena *a, size_t size);
+extern char *arena_strdup(arena *a, const char *s);
+extern void arena_reset(arena *a);
+
+#endif
@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "bundle.h"
+
+/**
+ * FNV-1a over a path
+ *
+ * This is part of the file format, so it must never change for a version.
+ */
+uint64_t bundle_hash(const void *data, int data_size)
+{
+    const unsigned char *p = data;
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    for (int i = 0; i < data_size; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+
+    return h;
+}
+
+/**
+ * Check that [offset, offset + length) lies inside the mapping
+ */
+static int in_bounds(bundle *b, uint64_t offset, uint64_t length)
+{
+    return offset <= b->map_length && length <= b->map_length - offset;
+}
+
+/**
+ * Map a bundle file and validate its header
+ *
+ * Returns NULL if the file is missing or isn't a usable bundle.
+ */
+bundle *bundle_open(char *filename)
+{
+    struct stat buf;
+
+    int fd = open(filename, O_RDONLY);
+
+    if (fd == -1) {
+        return NULL;
+    }
+
+    if (fstat(fd, &buf) == -1 || buf.st_size < (off_t)sizeof(struct bundle_header)) {
+        close(fd);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, buf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        perror("bundle mmap");
+        return NULL;
+    }
+
+    bundle *b = malloc(sizeof *b);
+
+    if (b == NULL) {
+        munmap(map, buf.st_size);
+        return NULL;
+    }
+
+    b->map = map;
+    b->map_length = buf.st_size;
+    b->header = map;
+
+    const struct bundle_header *h = b->header;
+
+    if (memcmp(h->magic, BUNDLE_MAGIC, sizeof h->magic) != 0 ||
+        h->version != BUNDLE_VERSION ||
+        h->file_size != b->map_length ||
+        h->slot_count == 0 || (h->slot_count & (h->slot_count - 1)) != 0 ||
+        !in_bounds(b, h->entries_offset, (uint64_t)h->entry_count * sizeof(struct bundle_entry)) ||
+        !in_bounds(b, h->slots_offset, (uint64_t)h->slot_count * sizeof(uint32_t)) ||
+        !in_bounds(b, h->strings_offset, 0)) {
+        fprintf(stderr, "%s: not a valid asset bundle\n", filename);
+        bundle_close(b);
+        return NULL;
+    }
+
+    b->entries = (const struct bundle_entry *)(b->map + h->entries_offset);
+    b->slots = (const uint32_t *)(b->map + h->slots_offset);
+    b->strings = (const char *)(b->map + h->strings_offset);
+
+    for (uint32_t i = 0; i < h->entry_count; i++) {
+        const struct bundle_entry *e = &b->entries[i];
+
+        if (!in_bounds(b, h->strings_offset + e->path_offset, e->path_length + 1) ||
+            !in_bounds(b, h->strings_offset + e->mime_offset, 1) ||
+            !in_bounds(b, e->data_offset, e->data_length) ||
+            !in_bounds(b, e->gzip_offset, e->gzip_length) ||
+            e->etag[BUNDLE_ETAG_SIZE - 1] != '\0') {
+            fprintf(stderr, "%s: corrupt entry %u\n", filename, i);
+            bundle_close(b);
+            return NULL;
+        }
+    }
+
+    for (uint32_t i = 0; i < h->slot_count; i++) {
+        if (b->slots[i] > h->entry_count) {
+            fprintf(stderr, "%s: corrupt index slot %u\n", filename, i);
+            bundle_close(b);
+            return NULL;
+        }
+    }
+
+    // We'll be jumping around the index on every request
+    (void)madvise(map, buf.st_size, MADV_WILLNEED);
+
+    return b;
+}
+
+/**
+ * Unmap a bundle
+ */
+void bundle_close(bundle *b)
+{
+    munmap((void *)b->map, b->map_length);
+    free(b);
+}
+
+/**
+ * Look up a request path in the bundle
+ *
+ * Returns 0 and fills in file on success, -1 if the path isn't there.
+ */
+int bundle_lookup(bundle *b, char *path, bundle_file *file)
+{
+    int path_length = strlen(path);
+    uint64_t hash = bundle_hash(path, path_length);
+    uint32_t mask = b->header->slot_count - 1;
+
+    for (uint32_t i = hash & mask, n = 0; n <= mask; i = (i + 1) & mask, n++) {
+        uint32_t slot = b->slots[i];
+
+        if (slot == 0) {
+            return -1;
+        }
+
+        const struct bundle_entry *e = &b->entries[slot - 1];
+
+        if (e->hash != hash || (int)e->path_length != path_length ||
+            memcmp(b->strings + e->path_offset, path, path_length) != 0) {
+            continue;
+        }
+
+        file->path = b->strings + e->path_offset;
+        file->content_type = b->strings + e->mime_offset;
+        file->etag = e->etag;
+        file->data = b->map + e->data_offset;
+        file->length = e->data_length;
+        file->gzip_data = e->gzip_length > 0 ? b->map + e->gzip_offset : NULL;
+        file->gzip_length = e->gzip_length;
+        // "<hash>" becomes "<hash>-gz"
+        snprintf(file->gzip_etag, sizeof file->gzip_etag, "%.*s-gz\"",
+                 (int)strlen(e->etag) - 1, e->etag);
+
+        return 0;
+    }
+
+    return -1;
+}
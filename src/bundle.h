@@ -0,0 +1,74 @@
+#ifndef _BUNDLE_H_
+#define _BUNDLE_H_
+
+#include <stdint.h>
+
+/*
+ * Packed asset bundle
+ *
+ * Layout on disk (all integers little-endian, offsets from file start):
+ *
+ *   bundle_header
+ *   bundle_entry[entry_count]
+ *   uint32_t slots[slot_count]   hash index: entry number + 1, 0 is empty
+ *   string table                 NUL-terminated paths and MIME types
+ *   payloads                     each body starts on a BUNDLE_ALIGN boundary
+ */
+
+#define BUNDLE_MAGIC "WSBUNDL1"
+#define BUNDLE_VERSION 1
+#define BUNDLE_ALIGN 4096
+#define BUNDLE_ETAG_SIZE 24
+
+struct bundle_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_count;
+    uint32_t slot_count; // Power of two
+    uint32_t reserved;
+    uint64_t entries_offset;
+    uint64_t slots_offset;
+    uint64_t strings_offset;
+    uint64_t file_size;
+};
+
+struct bundle_entry {
+    uint64_t hash; // bundle_hash() of the path
+    uint32_t path_offset; // Into the string table
+    uint32_t path_length;
+    uint32_t mime_offset; // Into the string table
+    uint32_t reserved;
+    char etag[BUNDLE_ETAG_SIZE]; // Quoted, NUL-terminated
+    uint64_t data_offset;
+    uint64_t data_length;
+    uint64_t gzip_offset; // 0 if there is no precompressed body
+    uint64_t gzip_length;
+};
+
+// A file found in a bundle; everything points into the read-only mapping
+typedef struct bundle_file_t {
+    const char *path;
+    const char *content_type;
+    const char *etag;
+    const void *data;
+    int length;
+    const void *gzip_data; // NULL if not precompressed
+    int gzip_length;
+    char gzip_etag[BUNDLE_ETAG_SIZE + 3]; // etag with a -gz suffix; a different body needs its own
+} bundle_file;
+
+typedef struct bundle_t {
+    const unsigned char *map;
+    uint64_t map_length;
+    const struct bundle_header *header;
+    const struct bundle_entry *entries;
+    const uint32_t *slots;
+    const char *strings;
+} bundle;
+
+extern uint64_t bundle_hash(const void *data, int data_size);
+extern bundle *bundle_open(char *filename);
+extern void bundle_close(bundle *bundle);
+extern int bundle_lookup(bundle *bundle, char *path, bundle_file *file);
+
+#endif
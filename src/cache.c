@@ -2,57 +2,96 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <sys/mman.h>
 #include "hashtable.h"
+#include "chashtable.h"
+#include "slab.h"
 #include "cache.h"
 
 /**
- * Allocate a cache entry
+ * Allocate the slab block for an entry
+ *
+ * The struct, path and content type share one block. The content goes at
+ * the end of the same block when it all fits in one slab object, otherwise
+ * (content_length < 0 means no content block) in a second block.
  */
-cache_entry *alloc_entry(char *path, char *content_type, void *content, int content_length)
+static cache_entry *alloc_entry_block(char *path, char *content_type, int content_length)
 {
-    cache_entry *entry = malloc(sizeof(cache_entry));
+    size_t path_size = strlen(path) + 1;
+    size_t type_size = strlen(content_type) + 1;
+    size_t meta_size = sizeof(cache_entry) + path_size + type_size;
+    int inline_content = content_length >= 0 && meta_size + content_length <= SLAB_MAX_SIZE;
+    size_t block_size = inline_content ? meta_size + content_length : meta_size;
+
+    cache_entry *entry = slab_alloc(block_size);
     if (entry == NULL) {
         perror("cache entry alloc failed\n\r");
         return NULL;
     }
     memset(entry, 0, sizeof(cache_entry));
-    entry->content = malloc(sizeof(content_length));
-    if (entry->content == NULL) {
-        perror("cache entry content alloc failed\n\r");
-        free(entry);
-        return NULL;
-    }
-    entry->path = malloc(strlen(path) + 1);
-    if (entry->path == NULL) {
-        perror("cache entry content alloc failed\n\r");
-        free(entry->content);
-        free(entry);
-        return NULL;
+    entry->block_size = block_size;
+    entry->path = (char *)(entry + 1);
+    entry->content_type = entry->path + path_size;
+    entry->inline_content = inline_content;
+    if (inline_content) {
+        entry->content = entry->content_type + type_size;
+    } else if (content_length >= 0) {
+        entry->content = slab_alloc(content_length);
+        if (entry->content == NULL) {
+            perror("cache entry content alloc failed\n\r");
+            slab_free(entry, block_size);
+            return NULL;
+        }
     }
-    entry->content_type = malloc(strlen(content_type) + 1);
-    if (entry->content_type == NULL) {
-        perror("cache entry content alloc failed\n\r");
-        free(entry->content);
-        free(entry->path);
-        free(entry);
+    memcpy(entry->path, path, path_size);
+    memcpy(entry->content_type, content_type, type_size);
+    atomic_init(&entry->refs, 1);
+    return entry;
+}
+
+/**
+ * Allocate a cache entry
+ */
+cache_entry *alloc_entry(char *path, char *content_type, void *content, int content_length)
+{
+    cache_entry *entry = alloc_entry_block(path, content_type, content_length);
+    if (entry == NULL) {
         return NULL;
     }
-    strcpy(entry->path, path);
-    strcpy(entry->content_type, content_type);
     memcpy(entry->content, content, content_length);
     entry->content_length = content_length;
     return entry;
 }
 
+/**
+ * Allocate a cache entry around an existing mmap of the file
+ *
+ * The entry takes ownership of the mapping and munmaps it when freed, so
+ * the content lives in the page cache instead of being copied to the heap.
+ */
+cache_entry *alloc_mapped_entry(char *path, char *content_type, void *map, int map_length)
+{
+    cache_entry *entry = alloc_entry_block(path, content_type, -1);
+    if (entry == NULL) {
+        return NULL;
+    }
+    entry->content = map;
+    entry->content_length = map_length;
+    entry->mapped = 1;
+    return entry;
+}
+
 /**
  * Deallocate a cache entry
  */
 void free_entry(cache_entry *entry)
 {
-    free(entry->path);
-    free(entry->content);
-    free(entry->content_type);
-    free(entry);
+    if (entry->mapped) {
+        munmap(entry->content, entry->content_length);
+    } else if (!entry->inline_content) {
+        slab_free(entry->content, entry->content_length);
+    }
+    slab_free(entry, entry->block_size);
 }
 
 /**
@@ -70,6 +109,9 @@ void dllist_insert_head(cache *cache, cache_entry *ce)
         ce->prev = NULL;
         cache->head = ce;
     }
+
+    cache->cur_size++;
+    cache->cur_bytes += ce->content_length;
 }
 
 /**
@@ -107,9 +149,14 @@ cache_entry *dllist_remove_tail(cache *cache)
     cache_entry *oldtail = cache->tail;
 
     cache->tail = oldtail->prev;
-    cache->tail->next = NULL;
+    if (cache->tail == NULL) {
+        cache->head = NULL;
+    } else {
+        cache->tail->next = NULL;
+    }
 
     cache->cur_size--;
+    cache->cur_bytes -= oldtail->content_length;
 
     return oldtail;
 }
@@ -129,22 +176,30 @@ cache *cache_create(int max_size, int hashsize)
     }
     the_cache->max_size = max_size;
     the_cache->cur_size = 0;
+    the_cache->cur_bytes = 0;
+    the_cache->evictions = 0;
     the_cache->head = NULL;
     the_cache->tail = NULL;
-    the_cache->index = hashtable_create(hashsize, NULL);
+    the_cache->index = chashtable_create(hashsize, 0);
     if (the_cache->index == NULL) {
         perror("cache create hashtable failed");
         free(the_cache);
         return NULL;
     }
+    pthread_mutex_init(&the_cache->lock, NULL);
     return the_cache;
 }
 
+/**
+ * Free a cache and every entry still in it
+ *
+ * NOTE: no other thread may be using the cache
+ */
 void cache_free(cache *cache)
 {
     cache_entry *cur_entry = cache->head;
 
-    hashtable_destroy(cache->index);
+    chashtable_destroy(cache->index);
 
     while (cur_entry != NULL) {
         cache_entry *next_entry = cur_entry->next;
@@ -154,42 +209,152 @@ void cache_free(cache *cache)
         cur_entry = next_entry;
     }
 
+    pthread_mutex_destroy(&cache->lock);
     free(cache);
 }
 
+/**
+ * Drop a reference to an entry, freeing it with the last one
+ *
+ * Every entry returned by cache_get() must be released once the caller is
+ * done with its content.
+ */
+void cache_release(cache_entry *entry)
+{
+    if (atomic_fetch_sub(&entry->refs, 1) == 1) {
+        free_entry(entry);
+    }
+}
+
+/**
+ * Evict the least-recently-used entry if the cache is full
+ *
+ * The entry's stored hash is reused, so the path isn't hashed again.
+ *
+ * NOTE: call with the cache lock held
+ */
+static void evict_if_full(cache *cache)
+{
+    if (cache->cur_size == cache->max_size) {
+        cache_entry *old_tail = dllist_remove_tail(cache);
+        chashtable_delete_hashed(cache->index, old_tail->path, strlen(old_tail->path),
+                                 old_tail->hash);
+        old_tail->linked = 0;
+        cache->evictions++;
+        // A reader may have found it just before the delete; wait until any
+        // such reader has pinned it before dropping the cache's reference
+        chashtable_synchronize(cache->index);
+        cache_release(old_tail);
+    }
+}
+
+/**
+ * Link a new entry in at the head of the cache
+ *
+ * NOTE: call with the cache lock held
+ */
+static void insert_entry(cache *cache, cache_entry *entry, uint64_t hash)
+{
+    entry->hash = hash;
+    evict_if_full(cache);
+    if (chashtable_put_hashed(cache->index, entry->path, strlen(entry->path), hash, entry) == NULL) {
+        perror("cache index insert failed");
+        free_entry(entry);
+        return;
+    }
+    entry->linked = 1;
+    dllist_insert_head(cache, entry);
+}
+
 /**
  * Store an entry in the cache
  *
  * This will also remove the least-recently-used items as necessary.
- * 
- * NOTE: doesn't check for duplicate cache entries
  */
 void cache_put(cache *cache, char *path, char *content_type, void *content, int content_length)
 {
-    cache_entry *entry = hashtable_get(cache->index, path);
+    int path_length = strlen(path);
+    uint64_t hash = default_hashf(path, path_length);
+    pthread_mutex_lock(&cache->lock);
+    cache_entry *entry = chashtable_get_hashed(cache->index, path, path_length, hash);
     if (entry == NULL) {
-        if (cache->cur_size == cache->max_size) {
-            cache_entry *old_tail = dllist_remove_tail(cache);
-            hashtable_delete(cache->index, old_tail->path);
-            free_entry(old_tail);
-        }
         cache_entry *target = alloc_entry(path, content_type, content, content_length);
-        dllist_insert_head(cache, target);
-        hashtable_put(cache->index, path, target);
+        if (target != NULL) {
+            insert_entry(cache, target, hash);
+        }
     } else {
         dllist_move_to_head(cache, entry);
     }
+    pthread_mutex_unlock(&cache->lock);
+    return;
+}
+
+/**
+ * Store an mmap'd file in the cache
+ *
+ * Takes ownership of the mapping: it is munmap'd on eviction, or right away
+ * if the path is already cached or the entry can't be allocated.
+ */
+void cache_put_mapped(cache *cache, char *path, char *content_type, void *map, int map_length)
+{
+    int path_length = strlen(path);
+    uint64_t hash = default_hashf(path, path_length);
+    pthread_mutex_lock(&cache->lock);
+    cache_entry *entry = chashtable_get_hashed(cache->index, path, path_length, hash);
+    if (entry == NULL) {
+        cache_entry *target = alloc_mapped_entry(path, content_type, map, map_length);
+        if (target == NULL) {
+            munmap(map, map_length);
+        } else {
+            insert_entry(cache, target, hash);
+        }
+    } else {
+        munmap(map, map_length);
+        dllist_move_to_head(cache, entry);
+    }
+    pthread_mutex_unlock(&cache->lock);
     return;
 }
 
 /**
  * Retrieve an entry from the cache
+ *
+ * The lookup never blocks. The returned entry is pinned: it stays valid
+ * even if it is evicted meanwhile, until cache_release() is called on it.
  */
 cache_entry *cache_get(cache *cache, char *path)
 {
-    cache_entry *entry = hashtable_get(cache->index, path);
+    int path_length = strlen(path);
+    uint64_t hash = default_hashf(path, path_length);
+
+    unsigned int epoch = chashtable_read_lock(cache->index);
+    cache_entry *entry = chashtable_get_hashed(cache->index, path, path_length, hash);
     if (entry != NULL) {
-        dllist_move_to_head(cache, entry);
+        atomic_fetch_add(&entry->refs, 1);
+    }
+    chashtable_read_unlock(cache->index, epoch);
+
+    if (entry == NULL) {
+        return NULL;
+    }
+
+    // Promotion is best effort: skip it rather than queue behind a writer
+    if (pthread_mutex_trylock(&cache->lock) == 0) {
+        if (entry->linked) {
+            dllist_move_to_head(cache, entry);
+        }
+        pthread_mutex_unlock(&cache->lock);
     }
     return entry;
 }
+
+/**
+ * Read the entry count and the number of evictions so far
+ */
+void cache_stats(cache *cache, int *entries, long *evictions)
+{
+    pthread_mutex_lock(&cache->lock);
+    *entries = cache->cur_size;
+    *evictions = cache->evictions;
+    pthread_mutex_unlock(&cache->lock);
+}
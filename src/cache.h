@@ -1,29 +1,48 @@
 #ifndef _WEBCACHE_H_
 #define _WEBCACHE_H_
 
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define CACHE_MMAP_THRESHOLD (64 * 1024) // Content this big is mmap'd, not copied
+
 // Individual hash table entry
 typedef struct cache_entry_t {
     char *path;   // Endpoint path--key to the cache
+    uint64_t hash; // default_hashf() of path, so eviction needn't rehash it
     char *content_type;
     int content_length;
     void *content;
+    int mapped; // content is an mmap of the file rather than a heap copy
+    int inline_content; // content sits at the end of this entry's own slab block
+    atomic_int refs; // One for the cache while linked, one per cache_get() caller
+    int linked; // Still in the cache; protected by the cache lock
+    int block_size; // Size of the slab block holding this struct
 
     struct cache_entry_t *prev, *next; // Doubly-linked list
 } cache_entry;
 
 // A cache
 typedef struct cache_t {
-    struct hashtable *index;
+    struct chashtable *index; // Lock-free for readers
+    pthread_mutex_t lock; // Protects the list, the sizes, and index writes
     cache_entry *head, *tail; // Doubly-linked list
     int max_size; // Maxiumum number of entries
     int cur_size; // Current number of entries
+    long cur_bytes; // Sum of the entries' content_length
+    long evictions; // Entries pushed out to make room; protected by the lock
 } cache;
 
 extern cache_entry *alloc_entry(char *path, char *content_type, void *content, int content_length);
+extern cache_entry *alloc_mapped_entry(char *path, char *content_type, void *map, int map_length);
 extern void free_entry(cache_entry *entry);
 extern cache *cache_create(int max_size, int hashsize);
 extern void cache_free(cache *cache);
 extern void cache_put(cache *cache, char *path, char *content_type, void *content, int content_length);
+extern void cache_put_mapped(cache *cache, char *path, char *content_type, void *map, int map_length);
 extern cache_entry *cache_get(cache *cache, char *path);
+extern void cache_release(cache_entry *entry);
+extern void cache_stats(cache *cache, int *entries, long *evictions);
 
 #endif
\ No newline at end of file
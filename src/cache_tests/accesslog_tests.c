@@ -0,0 +1,114 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "minunit.h"
+#include "../accesslog.h"
+#include "../log.h"
+
+#define MS 1000000ull // In nanoseconds
+#define TEST_LOG "cache_tests/accesslog_test.log"
+
+char *test_phases_complete_request()
+{
+  struct access_record rec;
+
+  memset(&rec, 0, sizeof rec);
+  access_set_phases(&rec, 1000 * MS, 1001 * MS, 1003 * MS, 1006 * MS, 1010 * MS);
+  mu_assert(rec.phase_us[ACCESS_PHASE_QUEUE] == 1000, "The queue phase of a complete request is wrong");
+  mu_assert(rec.phase_us[ACCESS_PHASE_READ] == 2000, "The read phase of a complete request is wrong");
+  mu_assert(rec.phase_us[ACCESS_PHASE_HANDLE] == 3000, "The handle phase of a complete request is wrong");
+  mu_assert(rec.phase_us[ACCESS_PHASE_SEND] == 4000, "The send phase of a complete request is wrong");
+
+  return NULL;
+}
+
+char *test_phases_never_parsed()
+{
+  struct access_record rec;
+
+  // A header timeout: the 408 went out without anything being parsed
+  memset(&rec, 0, sizeof rec);
+  access_set_phases(&rec, 1000 * MS, 1001 * MS, 0, 11001 * MS, 11002 * MS);
+  mu_assert(rec.phase_us[ACCESS_PHASE_READ] == 10000000, "A timed-out request's read phase should run until its response");
+  mu_assert(rec.phase_us[ACCESS_PHASE_HANDLE] == 0, "A request that was never parsed should spend nothing handling");
+  mu_assert(rec.phase_us[ACCESS_PHASE_SEND] == 1000, "A timed-out request's send phase is wrong");
+
+  // Turned away by admission control: started and answered at once
+  memset(&rec, 0, sizeof rec);
+  access_set_phases(&rec, 1000 * MS, 1002 * MS, 0, 1002 * MS, 1003 * MS);
+  mu_assert(rec.phase_us[ACCESS_PHASE_QUEUE] == 2000, "A rejected request's queue phase is wrong");
+  mu_assert(rec.phase_us[ACCESS_PHASE_READ] == 0 && rec.phase_us[ACCESS_PHASE_HANDLE] == 0, "A rejected request should spend nothing reading or handling");
+  mu_assert(rec.phase_us[ACCESS_PHASE_SEND] == 1000, "A rejected request's send phase is wrong");
+
+  // The client went away before sending anything
+  memset(&rec, 0, sizeof rec);
+  access_set_phases(&rec, 1000 * MS, 1001 * MS, 0, 0, 1005 * MS);
+  for (int i = ACCESS_PHASE_READ; i < ACCESS_NUM_PHASES; i++) {
+    mu_assert(rec.phase_us[i] == 0, "A request with no response should have no later phases");
+  }
+
+  return NULL;
+}
+
+char *test_phases_out_of_order()
+{
+  struct access_record rec;
+
+  // Whatever order the timestamps come in, no phase may wrap around
+  memset(&rec, 0, sizeof rec);
+  access_set_phases(&rec, 1005 * MS, 1001 * MS, 1010 * MS, 1003 * MS, 1002 * MS);
+  for (int i = 0; i < ACCESS_NUM_PHASES; i++) {
+    mu_assert(rec.phase_us[i] <= 10000, "A phase wrapped around on out-of-order timestamps");
+  }
+  mu_assert(access_interval_us(0, 1000 * MS) == 0, "An interval from an unreached point should be 0");
+
+  return NULL;
+}
+
+char *test_log_round_trip()
+{
+  struct access_record rec;
+  struct access_log_header header;
+  struct access_record read_back;
+
+  unlink(TEST_LOG);
+  mu_assert(log_start(open("/dev/null", O_WRONLY)) == 0, "Could not start the log writer");
+  mu_assert(access_log_open(TEST_LOG) == 0, "Could not open the test access log");
+
+  // A request that never parsed, written and read back as logdecode would
+  memset(&rec, 0, sizeof rec);
+  rec.status = 408;
+  access_set_phases(&rec, 1000 * MS, 1001 * MS, 0, 11001 * MS, 11002 * MS);
+  access_log_write(&rec);
+  access_log_close();
+
+  FILE *f = fopen(TEST_LOG, "rb");
+  mu_assert(f != NULL, "The access log file was not written");
+  mu_assert(fread(&header, sizeof header, 1, f) == 1 && header.magic == ACCESS_LOG_MAGIC, "The access log header is wrong");
+  mu_assert(header.count == 1, "The access log should hold one record");
+  mu_assert(fread(&read_back, sizeof read_back, 1, f) == 1, "The access log record is missing");
+  fclose(f);
+  unlink(TEST_LOG);
+
+  mu_assert(read_back.status == 408, "The record read back has the wrong status");
+  mu_assert(read_back.phase_us[ACCESS_PHASE_HANDLE] == 0, "The record read back has a wrapped handle phase");
+  mu_assert(read_back.phase_us[ACCESS_PHASE_READ] == 10000000, "The record read back has the wrong read phase");
+
+  return NULL;
+}
+
+char *all_tests()
+{
+  mu_suite_start();
+
+  mu_run_test(test_phases_complete_request);
+  mu_run_test(test_phases_never_parsed);
+  mu_run_test(test_phases_out_of_order);
+  mu_run_test(test_log_round_trip);
+
+  return NULL;
+}
+
+RUN_TESTS(all_tests)
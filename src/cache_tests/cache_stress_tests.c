@@ -0,0 +1,408 @@
+/**
+ * Concurrent stress test for the cache
+ *
+ * Worker threads hammer cache_get/cache_put with random keys and content
+ * sizes in a cache much smaller than the key space, so entries are evicted
+ * all the time. Meanwhile a checker thread takes the cache lock and checks
+ * that the list, the index, cur_size and cur_bytes agree.
+ *
+ * Every operation is recorded with its start and end time. Afterwards, each
+ * get that hit must return a value put for the same key by a put that
+ * started before the get ended; a value nobody put, or one read before its
+ * put began, means a torn or stale read.
+ *
+ * Environment:
+ *
+ *    CACHE_STRESS_MS=n       Run for n milliseconds (default 300)
+ *    CACHE_STRESS_HISTORY=f  Also write the history to f as JSON lines, for
+ *                            an offline linearizability checker
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "minunit.h"
+#include "../cache.h"
+#include "../chashtable.h"
+#include "../slab.h"
+
+#define NUM_WORKERS 8
+#define NUM_KEYS 512
+#define CACHE_SLOTS 64
+#define HISTORY_SIZE (1 << 18) // Records per worker; later operations aren't recorded
+#define DEFAULT_MS 300
+
+// mu_assert wants a literal message; these failures carry their own
+#define mu_assert_ok(failed) if ((failed) != NULL) {\
+  log_err("%s", failed); return failed; }
+
+#define OP_GET 0
+#define OP_PUT 1
+
+// Start of every value; the rest of the content is a pattern derived from it
+struct value_header {
+  int key;
+  int size;
+  uint64_t version; // Unique per put
+};
+
+struct op_record {
+  int op;
+  int key;
+  uint64_t version; // Put: the value written. Get: the value read, or 0 on a miss
+  long start_ns, end_ns;
+};
+
+struct worker {
+  pthread_t thread;
+  int id;
+  struct op_record *history;
+  int history_len;
+  long ops;
+  char *failed;
+};
+
+static cache *stress_cache;
+static atomic_int stop;
+static atomic_ulong next_version;
+static char *checker_failed;
+static long checks;
+
+static long now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void key_path(int key, char *path, int size)
+{
+  snprintf(path, size, "/stress/%d", key);
+}
+
+/**
+ * Write a value into content: the header, then a fill pattern
+ */
+static void make_value(char *content, int key, int size, uint64_t version)
+{
+  struct value_header h = { key, size, version };
+
+  memcpy(content, &h, sizeof h);
+  for (int i = sizeof h; i < size; i++) {
+    content[i] = (char)(version + i);
+  }
+}
+
+/**
+ * Check a value read from the cache, returning its version or 0 if it's bad
+ */
+static uint64_t check_value(cache_entry *entry, int key)
+{
+  struct value_header h;
+  char *content = entry->content;
+
+  if (entry->content_length < (int)sizeof h) {
+    return 0;
+  }
+  memcpy(&h, content, sizeof h);
+  if (h.key != key || h.size != entry->content_length || h.version == 0) {
+    return 0;
+  }
+  for (int i = sizeof h; i < h.size; i++) {
+    if (content[i] != (char)(h.version + i)) {
+      return 0;
+    }
+  }
+
+  return h.version;
+}
+
+/**
+ * Pick a content size: mostly small, sometimes past the slab limit, and
+ * now and then big enough to be stored as a mapping
+ */
+static int pick_size(unsigned int *seed, int *mapped)
+{
+  int r = rand_r(seed) % 64;
+
+  *mapped = 0;
+  if (r == 0) {
+    *mapped = 1;
+    return CACHE_MMAP_THRESHOLD;
+  }
+  if (r < 4) {
+    return SLAB_MAX_SIZE + rand_r(seed) % 4096;
+  }
+
+  return sizeof(struct value_header) + rand_r(seed) % 512;
+}
+
+static void record(struct worker *w, int op, int key, uint64_t version, long start, long end)
+{
+  if (w->history_len < HISTORY_SIZE) {
+    w->history[w->history_len++] = (struct op_record){ op, key, version, start, end };
+  }
+}
+
+static void *stress_worker(void *arg)
+{
+  struct worker *w = arg;
+  unsigned int seed = w->id + 1;
+  char *buf = malloc(SLAB_MAX_SIZE + 4096);
+  char path[32];
+
+  while (!atomic_load(&stop) && w->failed == NULL) {
+    // Skew towards low keys so some stay hot while the rest churn
+    int key = rand_r(&seed) % (rand_r(&seed) % 4 == 0 ? NUM_KEYS : CACHE_SLOTS);
+    key_path(key, path, sizeof path);
+
+    if (rand_r(&seed) % 10 < 7) {
+      long start = now_ns();
+      cache_entry *entry = cache_get(stress_cache, path);
+      uint64_t version = 0;
+      if (entry != NULL) {
+        if (strcmp(entry->path, path) != 0) {
+          w->failed = "cache_get returned an entry for another path";
+        } else if ((version = check_value(entry, key)) == 0) {
+          w->failed = "cache_get returned corrupt content";
+        }
+        cache_release(entry);
+      }
+      record(w, OP_GET, key, version, start, now_ns());
+    } else {
+      int mapped;
+      int size = pick_size(&seed, &mapped);
+      uint64_t version = atomic_fetch_add(&next_version, 1) + 1;
+      long start = now_ns();
+      if (mapped) {
+        char *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED) {
+          w->failed = "Could not create a test mapping";
+          break;
+        }
+        make_value(map, key, size, version);
+        cache_put_mapped(stress_cache, path, "application/octet-stream", map, size);
+      } else {
+        make_value(buf, key, size, version);
+        cache_put(stress_cache, path, "application/octet-stream", buf, size);
+      }
+      record(w, OP_PUT, key, version, start, now_ns());
+    }
+    w->ops++;
+  }
+
+  free(buf);
+
+  return NULL;
+}
+
+/**
+ * Check the cache's invariants, returning NULL or what's wrong
+ *
+ * With pinned set, every entry must be referenced by the cache alone.
+ *
+ * NOTE: call with the cache lock held
+ */
+static char *check_cache(cache *c, int pinned)
+{
+  cache_entry *prev = NULL;
+  int count = 0;
+  long bytes = 0;
+
+  if (c->cur_size > c->max_size) {
+    return "cur_size is over max_size";
+  }
+  if ((c->head == NULL) != (c->tail == NULL)) {
+    return "Only one of head and tail is NULL";
+  }
+  for (cache_entry *e = c->head; e != NULL; e = e->next) {
+    if (e->prev != prev) {
+      return "An entry's prev pointer doesn't match the list";
+    }
+    if (!e->linked) {
+      return "An entry on the list isn't marked linked";
+    }
+    if (atomic_load(&e->refs) < 1 || (pinned && atomic_load(&e->refs) != 1)) {
+      return "An entry on the list has the wrong reference count";
+    }
+    if (chashtable_get(c->index, e->path) != e) {
+      return "An entry on the list isn't the one the index has for its path";
+    }
+    if (++count > c->max_size) {
+      return "The list is longer than max_size, or has a cycle";
+    }
+    bytes += e->content_length;
+    prev = e;
+  }
+  if (c->tail != prev) {
+    return "The tail isn't the last entry on the list";
+  }
+  if (count != c->cur_size) {
+    return "cur_size doesn't match the list length";
+  }
+  if (count != atomic_load(&c->index->num_entries)) {
+    return "The index and the list hold a different number of entries";
+  }
+  if (bytes != c->cur_bytes) {
+    return "cur_bytes doesn't match the entries' content lengths";
+  }
+
+  return NULL;
+}
+
+static void *stress_checker(void *arg)
+{
+  (void)arg;
+  struct timespec pause = { 0, 1000000 };
+
+  while (!atomic_load(&stop) && checker_failed == NULL) {
+    pthread_mutex_lock(&stress_cache->lock);
+    checker_failed = check_cache(stress_cache, 0);
+    pthread_mutex_unlock(&stress_cache->lock);
+    checks++;
+    nanosleep(&pause, NULL);
+  }
+
+  return NULL;
+}
+
+/**
+ * Check every get that hit against the puts, returning NULL or what's wrong
+ */
+static char *check_history(struct worker *workers, uint64_t num_versions)
+{
+  struct op_record **puts = calloc(num_versions + 1, sizeof(struct op_record *));
+  char *failed = NULL;
+
+  // Index the recorded puts by the version they wrote
+  for (int t = 0; t < NUM_WORKERS; t++) {
+    for (int i = 0; i < workers[t].history_len; i++) {
+      struct op_record *r = &workers[t].history[i];
+      if (r->op == OP_PUT) {
+        puts[r->version] = r;
+      }
+    }
+  }
+
+  for (int t = 0; t < NUM_WORKERS && failed == NULL; t++) {
+    for (int i = 0; i < workers[t].history_len; i++) {
+      struct op_record *r = &workers[t].history[i];
+      if (r->op != OP_GET || r->version == 0) {
+        continue;
+      }
+      if (r->version > num_versions) {
+        failed = "A get returned a value that was never put";
+        break;
+      }
+      struct op_record *put = puts[r->version];
+      if (put == NULL) {
+        continue; // Put after its worker's history filled up
+      }
+      if (put->key != r->key) {
+        failed = "A get returned a value put for another key";
+        break;
+      }
+      if (put->start_ns > r->end_ns) {
+        failed = "A get returned a value before it was put";
+        break;
+      }
+    }
+  }
+
+  free(puts);
+
+  return failed;
+}
+
+static void write_history(char *filename, struct worker *workers)
+{
+  FILE *f = fopen(filename, "w");
+
+  if (f == NULL) {
+    perror("fopen");
+    return;
+  }
+  for (int t = 0; t < NUM_WORKERS; t++) {
+    for (int i = 0; i < workers[t].history_len; i++) {
+      struct op_record *r = &workers[t].history[i];
+      fprintf(f, "{\"thread\":%d,\"op\":\"%s\",\"key\":%d,\"value\":%lu,\"start\":%ld,\"end\":%ld}\n",
+              t, r->op == OP_GET ? "get" : "put", r->key, (unsigned long)r->version,
+              r->start_ns, r->end_ns);
+    }
+  }
+  fclose(f);
+}
+
+char *test_cache_stress()
+{
+  struct worker workers[NUM_WORKERS];
+  pthread_t checker;
+  char *ms_env = getenv("CACHE_STRESS_MS");
+  char *history_file = getenv("CACHE_STRESS_HISTORY");
+  long ms = ms_env != NULL ? atol(ms_env) : DEFAULT_MS;
+  struct timespec run = { ms / 1000, (ms % 1000) * 1000000 };
+  long ops = 0;
+
+  stress_cache = cache_create(CACHE_SLOTS, 0);
+  mu_assert(stress_cache != NULL, "cache_create failed");
+
+  for (int i = 0; i < NUM_WORKERS; i++) {
+    workers[i] = (struct worker){ .id = i };
+    workers[i].history = malloc(HISTORY_SIZE * sizeof(struct op_record));
+    mu_assert(workers[i].history != NULL, "Could not allocate the history");
+    pthread_create(&workers[i].thread, NULL, stress_worker, &workers[i]);
+  }
+  pthread_create(&checker, NULL, stress_checker, NULL);
+
+  nanosleep(&run, NULL);
+  atomic_store(&stop, 1);
+
+  for (int i = 0; i < NUM_WORKERS; i++) {
+    pthread_join(workers[i].thread, NULL);
+    ops += workers[i].ops;
+  }
+  pthread_join(checker, NULL);
+  debug("%ld operations, %ld checks", ops, checks);
+
+  for (int i = 0; i < NUM_WORKERS; i++) {
+    mu_assert_ok(workers[i].failed);
+  }
+  mu_assert_ok(checker_failed);
+  mu_assert(checks > 0, "The checker never ran");
+
+  // Quiescent now: every pin must have been released
+  char *failed = check_cache(stress_cache, 1);
+  mu_assert_ok(failed);
+  mu_assert(stress_cache->cur_size == CACHE_SLOTS, "The cache should have filled up");
+  mu_assert(stress_cache->evictions > 0, "Nothing was evicted, so the test put no pressure on the cache");
+
+  failed = check_history(workers, atomic_load(&next_version));
+  if (history_file != NULL) {
+    write_history(history_file, workers);
+  }
+  mu_assert_ok(failed);
+
+  for (int i = 0; i < NUM_WORKERS; i++) {
+    free(workers[i].history);
+  }
+  cache_free(stress_cache);
+
+  return NULL;
+}
+
+char *all_tests()
+{
+  mu_suite_start();
+
+  mu_run_test(test_cache_stress);
+
+  return NULL;
+}
+
+RUN_TESTS(all_tests)
@@ -1,9 +1,12 @@
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
 #include "utils.h"
 #include "minunit.h"
 #include "../cache.h"
-#include "../hashtable.h"
+#include "../chashtable.h"
+#include "../slab.h"
 
 char *test_cache_create()
 {
@@ -62,7 +65,7 @@ char *test_cache_put()
   mu_assert(cache->head->prev == NULL && cache->tail->next == NULL, "The head and tail of your cache should have NULL prev and next pointers when a new entry is put in an empty cache");
   mu_assert(check_cache_entries(cache->head, test_entry_1) == 0, "Your cache_put function did not put an entry into the head of the empty cache with the expected form");
   mu_assert(check_cache_entries(cache->tail, test_entry_1) == 0, "Your cache_put function did not put an entry into the tail of the empty cache with the expected form");
-  mu_assert(check_cache_entries(hashtable_get(cache->index, "/1"), test_entry_1) == 0, "Your cache_put function did not put the expected entry into the hashtable");
+  mu_assert(check_cache_entries(chashtable_get(cache->index, "/1"), test_entry_1) == 0, "Your cache_put function did not put the expected entry into the hashtable");
 
   // Add in a second entry to the cache
   cache_put(cache, test_entry_2->path, test_entry_2->content_type, test_entry_2->content, test_entry_2->content_length);
@@ -71,7 +74,7 @@ char *test_cache_put()
   mu_assert(check_cache_entries(cache->head, test_entry_2) == 0, "Your cache_put function did not put an entry into the head of the cache with the expected form");
   mu_assert(check_cache_entries(cache->tail, test_entry_1) == 0, "Your cache_put function did not move the oldest entry in the cache to the tail of the cache");
   mu_assert(check_cache_entries(cache->head->next, test_entry_1) == 0, "Your cache_put function did not correctly set the head->next pointer of the cache");
-  mu_assert(check_cache_entries(hashtable_get(cache->index, "/2"), test_entry_2) == 0, "Your cache_put function did not put the expected entry into the hashtable");
+  mu_assert(check_cache_entries(chashtable_get(cache->index, "/2"), test_entry_2) == 0, "Your cache_put function did not put the expected entry into the hashtable");
 
   // Add in a third entry to the cache
   cache_put(cache, test_entry_3->path, test_entry_3->content_type, test_entry_3->content, test_entry_3->content_length);
@@ -96,6 +99,10 @@ char *test_cache_put()
   mu_assert(check_cache_entries(cache->tail, test_entry_2) == 0, "Your cache_put function did not correctly handle the tail of an already-full cache");
 
   cache_free(cache);
+  free_entry(test_entry_1);
+  free_entry(test_entry_2);
+  free_entry(test_entry_3);
+  free_entry(test_entry_4);
 
   return NULL;
 }
@@ -116,12 +123,14 @@ char *test_cache_get()
   entry = cache_get(cache, test_entry_1->path);
   // Check that the retrieved entry's values match the values of the inserted entry
   mu_assert(check_cache_entries(entry, test_entry_1) == 0, "Your cache_get function did not retrieve the newly-added cache entry when there was 1 entry in the cache");
+  cache_release(entry);
 
   // Insert another entry into the cache, then retrieve it
   cache_put(cache, test_entry_2->path, test_entry_2->content_type, test_entry_2->content, test_entry_2->content_length);
   entry = cache_get(cache, test_entry_2->path);
   // Check the retrieved entry's values and also check that the entries are ordered correctly in the cache
   mu_assert(check_cache_entries(entry, test_entry_2) == 0, "Your cache_get function did not retrieve the newly-added cache entry when there were 2 entries in the cache");
+  cache_release(entry);
   mu_assert(check_cache_entries(cache->head, test_entry_2) == 0, "Your cache_get function did not update the head pointer to point to the newly-added entry when there are 2 entries");
   mu_assert(check_cache_entries(cache->tail, test_entry_1) == 0, "Your cache_get function did not move the oldest entry to the tail of the cache");
 
@@ -130,6 +139,7 @@ char *test_cache_get()
   entry = cache_get(cache, test_entry_3->path);
   // Check the retrieved entry's values and also check that the entries are ordered correctly in the cache
   mu_assert(check_cache_entries(entry, test_entry_3) == 0, "Your cache_get function did not retrieve the newly-added cache entry when there were 3 entries in the cache");
+  cache_release(entry);
   mu_assert(check_cache_entries(cache->head, test_entry_3) == 0, "Your cache_get function did not update the head pointer to point to the newly-added entry when there are 3 entries");
   mu_assert(check_cache_entries(cache->tail, test_entry_2) == 0, "Your cache_get function did not move the oldest entry to the tail of the cache when there are 3 entries");
   // Check that the oldest cache entry cannot be retrieved
@@ -137,10 +147,86 @@ char *test_cache_get()
 
   // Retrieve the oldest entry in the cache
   entry = cache_get(cache, test_entry_2->path);
+  cache_release(entry);
   // Check that the most-recently accessed entry has been moved to the head of the cache
   mu_assert(check_cache_entries(cache->head, test_entry_2) == 0, "Your cache_get function did not move the most-recently retrieved entry to the head of the cache");
   mu_assert(check_cache_entries(cache->tail, test_entry_3) == 0, "Your cache_get function did not move the oldest entry to the tail of the cache");
 
+  cache_free(cache);
+  free_entry(test_entry_1);
+  free_entry(test_entry_2);
+  free_entry(test_entry_3);
+
+  return NULL;
+}
+
+/**
+ * Whether [addr, addr + length) is still mapped
+ */
+static int is_mapped(void *addr, int length)
+{
+  unsigned char vec[(length + 4095) / 4096 + 1];
+
+  return mincore(addr, length, vec) == 0;
+}
+
+char *test_cache_put_mapped()
+{
+  // Create a cache with 1 slot
+  cache *cache = cache_create(1, 0);
+  int map_length = CACHE_MMAP_THRESHOLD;
+  char *map = mmap(NULL, map_length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  mu_assert(map != MAP_FAILED, "Could not create a test mapping");
+  strcpy(map, "big");
+
+  cache_put_mapped(cache, "/big", "application/octet-stream", map, map_length);
+  cache_entry *entry = cache_get(cache, "/big");
+  // Check that the cache kept the mapping itself rather than a copy
+  mu_assert(entry != NULL, "Your cache_put_mapped function did not store the entry");
+  mu_assert(entry->mapped == 1, "Your cache_put_mapped function did not mark the entry as mapped");
+  mu_assert(entry->content == map, "Your cache_put_mapped function copied the mapping instead of keeping it");
+  mu_assert(entry->content_length == map_length, "Your cache_put_mapped function did not store the mapping length");
+
+  // Evict the mapped entry with a regular one while we still hold it
+  cache_put(cache, "/small", "text/plain", "small", 6);
+  mu_assert(cache_get(cache, "/big") == NULL, "The mapped entry should have been evicted");
+  mu_assert(cache->cur_size == 1, "Evicting a mapped entry did not maintain cur_size");
+  mu_assert(atomic_load(&entry->refs) == 1, "Evicting an entry should drop the cache's reference and only that");
+  mu_assert(is_mapped(map, map_length), "An evicted entry was unmapped while a reader still held it");
+  mu_assert(strcmp(entry->content, "big") == 0, "An evicted entry's content changed while a reader still held it");
+
+  // Dropping the last reference munmaps the region
+  cache_release(entry);
+  mu_assert(!is_mapped(map, map_length), "Releasing the last reference to an evicted entry did not munmap it");
+
+  cache_free(cache);
+
+  return NULL;
+}
+
+char *test_cache_empty_entry()
+{
+  // Create a cache with 1 slot
+  cache *cache = cache_create(1, 0);
+
+  cache_put(cache, "/empty", "text/plain", "", 0);
+  cache_entry *entry = cache_get(cache, "/empty");
+  mu_assert(entry != NULL && entry->content_length == 0, "An empty entry was not stored");
+  mu_assert(entry->inline_content, "An empty entry should keep its (no) content inline");
+  uintptr_t block = (uintptr_t)entry;
+  uintptr_t block_end = block + entry->block_size;
+
+  // Evict it, then drop the last reference so it's freed
+  cache_put(cache, "/other", "text/plain", "other", 6);
+  cache_release(entry);
+
+  // Freeing must not have handed the end of its block back as an object
+  // of its own; the allocator would give that out next
+  void *obj = slab_alloc(SLAB_MIN_SIZE);
+  mu_assert((uintptr_t)obj % 16 == 0, "Freeing an empty entry handed out a misaligned slab object");
+  mu_assert((uintptr_t)obj <= block || (uintptr_t)obj > block_end, "Freeing an empty entry handed out part of its block");
+  slab_free(obj, SLAB_MIN_SIZE);
+
   cache_free(cache);
 
   return NULL;
@@ -154,6 +240,8 @@ char *all_tests()
   mu_run_test(test_cache_alloc_entry);
   mu_run_test(test_cache_put);
   mu_run_test(test_cache_get);
+  mu_run_test(test_cache_put_mapped);
+  mu_run_test(test_cache_empty_entry);
 
   return NULL;
 }
@@ -0,0 +1,169 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "minunit.h"
+#include "../chashtable.h"
+
+#define NUM_KEYS 20000
+#define NUM_WRITERS 4
+#define NUM_READERS 4
+
+struct stress_state {
+  struct chashtable *ht;
+  int id;
+  atomic_int *stop;
+  int failed;
+};
+
+char *test_chashtable_basic()
+{
+  struct chashtable *ht = chashtable_create(0, 0);
+  int a = 1, b = 2;
+
+  mu_assert(ht != NULL, "chashtable_create did not return a table");
+  mu_assert(chashtable_get(ht, "/a") == NULL, "An empty table should not find anything");
+
+  chashtable_put(ht, "/a", &a);
+  chashtable_put(ht, "/b", &b);
+  mu_assert(chashtable_get(ht, "/a") == &a, "chashtable_get did not find the first key");
+  mu_assert(chashtable_get(ht, "/b") == &b, "chashtable_get did not find the second key");
+  mu_assert(atomic_load(&ht->num_entries) == 2, "num_entries should count both keys");
+
+  // Putting an existing key replaces its data
+  chashtable_put(ht, "/a", &b);
+  mu_assert(chashtable_get(ht, "/a") == &b, "chashtable_put did not replace existing data");
+  mu_assert(atomic_load(&ht->num_entries) == 2, "Replacing data should not add an entry");
+
+  mu_assert(chashtable_delete(ht, "/a") == &b, "chashtable_delete did not return the data");
+  mu_assert(chashtable_get(ht, "/a") == NULL, "A deleted key should not be found");
+  mu_assert(chashtable_get(ht, "/b") == &b, "Deleting one key should not affect another");
+  mu_assert(chashtable_delete(ht, "/a") == NULL, "Deleting a missing key should return NULL");
+
+  chashtable_destroy(ht);
+
+  return NULL;
+}
+
+char *test_chashtable_resize()
+{
+  struct chashtable *ht = chashtable_create(16, 4);
+  static int values[NUM_KEYS];
+  char key[32];
+
+  for (int i = 0; i < NUM_KEYS; i++) {
+    values[i] = i;
+    sprintf(key, "/file/%d", i);
+    chashtable_put(ht, key, &values[i]);
+  }
+  mu_assert(atomic_load(&ht->num_entries) == NUM_KEYS, "The table lost entries while growing");
+
+  // Delete the even keys, leaving tombstones behind
+  for (int i = 0; i < NUM_KEYS; i += 2) {
+    sprintf(key, "/file/%d", i);
+    mu_assert(chashtable_delete(ht, key) == &values[i], "Could not delete a key after growing");
+  }
+
+  for (int i = 0; i < NUM_KEYS; i++) {
+    sprintf(key, "/file/%d", i);
+    int *v = chashtable_get(ht, key);
+    mu_assert((i % 2 == 0) ? v == NULL : v == &values[i], "Lookups after deletes returned the wrong data");
+  }
+
+  chashtable_destroy(ht);
+
+  return NULL;
+}
+
+/**
+ * Writer: each thread owns the keys i % NUM_WRITERS == id and keeps
+ * inserting and deleting them, which forces resizes under the readers
+ */
+void *stress_writer(void *arg)
+{
+  struct stress_state *s = arg;
+  char key[32];
+
+  for (int round = 0; round < 20; round++) {
+    for (int i = s->id; i < NUM_KEYS; i += NUM_WRITERS) {
+      sprintf(key, "/file/%d", i);
+      chashtable_put(s->ht, key, (void *)(intptr_t)(i + 1));
+    }
+    for (int i = s->id; i < NUM_KEYS; i += NUM_WRITERS) {
+      sprintf(key, "/file/%d", i);
+      if (chashtable_delete(s->ht, key) != (void *)(intptr_t)(i + 1)) {
+        s->failed = 1;
+      }
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Reader: a key may or may not be present, but if it is found it must map
+ * to its own value
+ */
+void *stress_reader(void *arg)
+{
+  struct stress_state *s = arg;
+  char key[32];
+  unsigned int seed = s->id;
+
+  while (!atomic_load(s->stop)) {
+    int i = rand_r(&seed) % NUM_KEYS;
+    sprintf(key, "/file/%d", i);
+    void *v = chashtable_get(s->ht, key);
+    if (v != NULL && v != (void *)(intptr_t)(i + 1)) {
+      s->failed = 1;
+    }
+  }
+
+  return NULL;
+}
+
+char *test_chashtable_concurrent()
+{
+  struct chashtable *ht = chashtable_create(16, 8);
+  pthread_t writers[NUM_WRITERS], readers[NUM_READERS];
+  struct stress_state wstate[NUM_WRITERS], rstate[NUM_READERS];
+  atomic_int stop = 0;
+
+  for (int i = 0; i < NUM_READERS; i++) {
+    rstate[i] = (struct stress_state){ ht, i, &stop, 0 };
+    pthread_create(&readers[i], NULL, stress_reader, &rstate[i]);
+  }
+  for (int i = 0; i < NUM_WRITERS; i++) {
+    wstate[i] = (struct stress_state){ ht, i, &stop, 0 };
+    pthread_create(&writers[i], NULL, stress_writer, &wstate[i]);
+  }
+
+  for (int i = 0; i < NUM_WRITERS; i++) {
+    pthread_join(writers[i], NULL);
+    mu_assert(!wstate[i].failed, "A writer could not delete a key it had just inserted");
+  }
+  atomic_store(&stop, 1);
+  for (int i = 0; i < NUM_READERS; i++) {
+    pthread_join(readers[i], NULL);
+    mu_assert(!rstate[i].failed, "A reader saw a key mapped to the wrong data");
+  }
+
+  mu_assert(atomic_load(&ht->num_entries) == 0, "Every key was deleted, but num_entries is not 0");
+
+  chashtable_destroy(ht);
+
+  return NULL;
+}
+
+char *all_tests()
+{
+  mu_suite_start();
+
+  mu_run_test(test_chashtable_basic);
+  mu_run_test(test_chashtable_resize);
+  mu_run_test(test_chashtable_concurrent);
+
+  return NULL;
+}
+
+RUN_TESTS(all_tests)
@@ -0,0 +1,229 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include "minunit.h"
+#include "../hashtable.h"
+
+#define NUM_KEYS 5000
+
+// Built with -Wl,--wrap=posix_memalign, so slot arrays can be made to fail
+static int fail_allocs;
+
+int __real_posix_memalign(void **ptr, size_t alignment, size_t size);
+
+int __wrap_posix_memalign(void **ptr, size_t alignment, size_t size)
+{
+  return fail_allocs ? -1 : __real_posix_memalign(ptr, alignment, size);
+}
+
+// Every key lands in the same group, with the same tag
+static uint64_t collide_hashf(const void *data, int data_size)
+{
+  (void)data;
+  (void)data_size;
+  return 0;
+}
+
+char *test_hashtable_basic()
+{
+  struct hashtable *ht = hashtable_create(0, NULL);
+  int a = 1, b = 2, c = 3;
+  int bin_key[2] = { 7, 0 };
+
+  mu_assert(ht != NULL, "hashtable_create did not return a table");
+  mu_assert(hashtable_get(ht, "/a") == NULL, "An empty table should not find anything");
+
+  hashtable_put(ht, "/a", &a);
+  hashtable_put(ht, "/b", &b);
+  mu_assert(hashtable_get(ht, "/a") == &a, "hashtable_get did not find the first key");
+  mu_assert(hashtable_get(ht, "/b") == &b, "hashtable_get did not find the second key");
+  mu_assert(ht->num_entries == 2, "num_entries should count both keys");
+
+  // Putting an existing key replaces its data
+  hashtable_put(ht, "/a", &b);
+  mu_assert(hashtable_get(ht, "/a") == &b, "hashtable_put did not replace existing data");
+  mu_assert(ht->num_entries == 2, "Replacing data should not add an entry");
+
+  // Binary keys compare by length as well as bytes
+  hashtable_put_bin(ht, bin_key, sizeof bin_key, &c);
+  mu_assert(hashtable_get_bin(ht, bin_key, sizeof bin_key) == &c, "hashtable_get_bin did not find a binary key");
+  mu_assert(hashtable_get_bin(ht, bin_key, sizeof bin_key[0]) == NULL, "A prefix of a binary key should not match it");
+
+  // The *_hashed functions agree with the plain ones
+  uint64_t hash = hashtable_hash(ht, "/b", 2);
+  mu_assert(hashtable_get_hashed(ht, "/b", 2, hash) == &b, "hashtable_get_hashed did not find a key put with hashtable_put");
+  hashtable_put_hashed(ht, "/c", 2, hashtable_hash(ht, "/c", 2), &c);
+  mu_assert(hashtable_get(ht, "/c") == &c, "hashtable_get did not find a key put with hashtable_put_hashed");
+  mu_assert(hashtable_delete_hashed(ht, "/c", 2, hashtable_hash(ht, "/c", 2)) == &c, "hashtable_delete_hashed did not return the data");
+
+  mu_assert(hashtable_delete(ht, "/a") == &b, "hashtable_delete did not return the data");
+  mu_assert(hashtable_get(ht, "/a") == NULL, "A deleted key should not be found");
+  mu_assert(hashtable_get(ht, "/b") == &b, "Deleting one key should not affect another");
+  mu_assert(hashtable_delete(ht, "/a") == NULL, "Deleting a missing key should return NULL");
+  mu_assert(ht->num_entries == 2, "num_entries is off after deleting");
+
+  hashtable_destroy(ht);
+
+  return NULL;
+}
+
+char *test_hashtable_grow_shrink()
+{
+  struct hashtable *ht = hashtable_create(16, NULL);
+  static int values[NUM_KEYS];
+  char key[32];
+  int saw_rehash = 0;
+
+  for (int i = 0; i < NUM_KEYS; i++) {
+    values[i] = i;
+    sprintf(key, "/file/%d", i);
+    mu_assert(hashtable_put(ht, key, &values[i]) == &values[i], "hashtable_put failed while growing");
+    saw_rehash |= ht->rehash_pos >= 0;
+
+    // Every key so far must be reachable mid-rehash, from either array
+    if (ht->rehash_pos >= 0 && i % 97 == 0) {
+      for (int j = 0; j <= i; j++) {
+        sprintf(key, "/file/%d", j);
+        mu_assert(hashtable_get(ht, key) == &values[j], "A key went missing during an incremental rehash");
+      }
+    }
+  }
+  mu_assert(saw_rehash, "The table never resized");
+  mu_assert(ht->num_entries == NUM_KEYS, "The table lost entries while growing");
+  mu_assert(ht->size >= NUM_KEYS, "The table did not grow to fit its entries");
+
+  // Delete all but a few; the table shrinks back
+  int grown_size = ht->size;
+  for (int i = 10; i < NUM_KEYS; i++) {
+    sprintf(key, "/file/%d", i);
+    mu_assert(hashtable_delete(ht, key) == &values[i], "hashtable_delete did not return the data while shrinking");
+  }
+  // Lookups finish any resize still in progress
+  for (int round = 0; round < NUM_KEYS && ht->rehash_pos >= 0; round++) {
+    hashtable_get(ht, "/file/0");
+  }
+  mu_assert(ht->size < grown_size, "The table did not shrink after most entries were deleted");
+  mu_assert(ht->num_entries == 10, "num_entries is off after shrinking");
+  for (int i = 0; i < 10; i++) {
+    sprintf(key, "/file/%d", i);
+    mu_assert(hashtable_get(ht, key) == &values[i], "A key went missing while shrinking");
+  }
+
+  hashtable_destroy(ht);
+
+  return NULL;
+}
+
+char *test_hashtable_tombstones()
+{
+  // 4 groups of 16; every key probes group 0 first
+  struct hashtable *ht = hashtable_create(64, collide_hashf);
+  static int values[20];
+  char key[32];
+
+  for (int i = 0; i < 20; i++) {
+    sprintf(key, "/k%d", i);
+    hashtable_put(ht, key, &values[i]);
+  }
+  mu_assert(ht->cur.num_deleted == 0, "A table with no deletes should have no tombstones");
+
+  // Group 0 is full, so a probe may have run past this slot: tombstone
+  mu_assert(hashtable_delete(ht, "/k3") == &values[3], "hashtable_delete did not return the data");
+  mu_assert(ht->cur.num_deleted == 1, "Deleting from a full group should leave a tombstone");
+  for (int i = 16; i < 20; i++) {
+    sprintf(key, "/k%d", i);
+    mu_assert(hashtable_get(ht, key) == &values[i], "A key past a tombstone was not found");
+  }
+  mu_assert(hashtable_get(ht, "/k3") == NULL, "A deleted key was found");
+
+  // The next insert reuses the tombstone rather than an empty slot further on
+  hashtable_put(ht, "/new", &values[3]);
+  mu_assert(ht->cur.num_deleted == 0, "An insert did not reuse a tombstone");
+  mu_assert(hashtable_get(ht, "/new") == &values[3], "A key stored in a tombstone was not found");
+
+  // The last group probed has empty slots, so its deletes leave none
+  mu_assert(hashtable_delete(ht, "/k19") == &values[19], "hashtable_delete did not return the data");
+  mu_assert(ht->cur.num_deleted == 0, "Deleting from a group with an empty slot should not leave a tombstone");
+
+  hashtable_destroy(ht);
+
+  return NULL;
+}
+
+char *test_hashtable_load_limits()
+{
+  struct hashtable *ht = hashtable_create(64, NULL);
+  static int values[64];
+  char key[32];
+
+  mu_assert(hashtable_set_load_limits(ht, 0, 0) == -1, "A grow load of 0 should be rejected");
+  mu_assert(hashtable_set_load_limits(ht, 1.0f, 0.1f) == -1, "A grow load past the maximum should be rejected");
+  mu_assert(hashtable_set_load_limits(ht, 0.5f, -0.1f) == -1, "A negative shrink load should be rejected");
+  mu_assert(hashtable_set_load_limits(ht, 0.5f, 0.2f) == -1, "Limits a resize could bounce between should be rejected");
+  mu_assert(ht->grow_load != 0.5f, "Rejected limits should not be applied");
+
+  mu_assert(hashtable_set_load_limits(ht, 0.5f, 0.1f) == 0, "Valid load limits were rejected");
+  mu_assert(ht->grow_load == 0.5f && ht->shrink_load == 0.1f, "Valid load limits were not applied");
+
+  // Grows once it would pass half full
+  for (int i = 0; i < 32; i++) {
+    sprintf(key, "/k%d", i);
+    hashtable_put(ht, key, &values[i]);
+  }
+  mu_assert(ht->size == 64, "The table grew before reaching grow_load");
+  hashtable_put(ht, "/one-more", &values[32]);
+  mu_assert(ht->size == 128, "The table did not grow at grow_load");
+
+  hashtable_destroy(ht);
+
+  return NULL;
+}
+
+char *test_hashtable_grow_fails()
+{
+  struct hashtable *ht = hashtable_create(16, NULL);
+  static int values[32];
+  char key[32];
+  int stored = 0;
+
+  // With no memory to grow, the one array fills to MAX_GROW_LOAD and no further
+  fail_allocs = 1;
+  for (int i = 0; i < 32; i++) {
+    sprintf(key, "/k%d", i);
+    if (hashtable_put(ht, key, &values[i]) != NULL) {
+      stored++;
+    }
+  }
+  mu_assert(ht->size == 16, "The table grew without memory to grow into");
+  mu_assert(stored == 15 && ht->num_entries == 15, "A table that can't grow should stop at 15 of 16 slots");
+  for (int i = 0; i < stored; i++) {
+    sprintf(key, "/k%d", i);
+    mu_assert(hashtable_get(ht, key) == &values[i], "A key stored before growth failed went missing");
+  }
+  mu_assert(hashtable_put(ht, "/k0", &values[31]) == &values[31], "Replacing a key should work even when the table is full");
+
+  // Growth resumes once memory is back
+  fail_allocs = 0;
+  mu_assert(hashtable_put(ht, "/k31", &values[31]) == &values[31], "hashtable_put still failed after memory came back");
+  mu_assert(ht->size == 32, "The table did not grow once it could");
+
+  hashtable_destroy(ht);
+
+  return NULL;
+}
+
+char *all_tests()
+{
+  mu_suite_start();
+
+  mu_run_test(test_hashtable_basic);
+  mu_run_test(test_hashtable_grow_shrink);
+  mu_run_test(test_hashtable_tombstones);
+  mu_run_test(test_hashtable_load_limits);
+  mu_run_test(test_hashtable_grow_fails);
+
+  return NULL;
+}
+
+RUN_TESTS(all_tests)
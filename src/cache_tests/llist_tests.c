@@ -0,0 +1,226 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "minunit.h"
+#include "../llist.h"
+
+#define NUM_ITEMS 1000 // Enough nodes to span several slabs
+
+struct item {
+  int id;
+  struct ilist_link link;
+};
+
+static int cmp_int(void *a, void *b)
+{
+  return *(int *)a - *(int *)b;
+}
+
+/**
+ * Whether an intrusive list holds exactly items ids[0..n), in order, with
+ * consistent links both ways
+ */
+static int ilist_is(struct ilist *list, int *ids, int n)
+{
+  struct ilist_link *link = list->head, *prev = NULL;
+
+  if (list->count != n) {
+    return 0;
+  }
+  for (int i = 0; i < n; i++, prev = link, link = link->next) {
+    if (link == NULL || link->prev != prev || ilist_entry(link, struct item, link)->id != ids[i]) {
+      return 0;
+    }
+  }
+  return link == NULL && list->tail == prev;
+}
+
+char *test_llist_tail()
+{
+  struct llist *list = llist_create();
+  int a = 1, b = 2, c = 3;
+
+  mu_assert(llist_head(list) == NULL && llist_tail(list) == NULL, "An empty list should have no head or tail");
+
+  // A single element is both head and tail
+  llist_append(list, &a);
+  mu_assert(llist_head(list) == &a && llist_tail(list) == &a, "A single appended element should be head and tail");
+  mu_assert(llist_delete(list, &a, cmp_int) == &a, "llist_delete did not return the data");
+  mu_assert(llist_head(list) == NULL && llist_tail(list) == NULL && llist_count(list) == 0, "Deleting the only element should empty the list");
+
+  // Appending after the list was emptied must not follow a stale tail
+  llist_append(list, &a);
+  llist_append(list, &b);
+  llist_insert(list, &c);
+  mu_assert(llist_head(list) == &c && llist_tail(list) == &b, "llist_insert/llist_append put elements at the wrong end");
+
+  // Deleting the tail moves it back one
+  mu_assert(llist_delete(list, &b, cmp_int) == &b, "llist_delete did not return the tail's data");
+  mu_assert(llist_tail(list) == &a, "Deleting the tail did not update the tail");
+  llist_append(list, &b);
+  mu_assert(llist_tail(list) == &b && llist_count(list) == 3, "Appending after deleting the tail went wrong");
+
+  // Deleting the head leaves the tail alone
+  mu_assert(llist_delete(list, &c, cmp_int) == &c, "llist_delete did not return the head's data");
+  mu_assert(llist_head(list) == &a && llist_tail(list) == &b, "Deleting the head changed the tail");
+  mu_assert(llist_delete(list, &c, cmp_int) == NULL, "Deleting a missing element should return NULL");
+
+  llist_destroy(list);
+
+  return NULL;
+}
+
+char *test_llist_many()
+{
+  static int values[NUM_ITEMS];
+  struct llist *list = llist_create();
+
+  for (int i = 0; i < NUM_ITEMS; i++) {
+    values[i] = i;
+    mu_assert(llist_append(list, &values[i]) == &values[i], "llist_append failed");
+  }
+  // Delete the evens; their nodes go back on the free list
+  for (int i = 0; i < NUM_ITEMS; i += 2) {
+    mu_assert(llist_delete(list, &values[i], cmp_int) == &values[i], "llist_delete did not find an element");
+  }
+  // And get handed out again to new elements
+  for (int i = 0; i < NUM_ITEMS; i += 2) {
+    llist_append(list, &values[i]);
+  }
+  mu_assert(llist_count(list) == NUM_ITEMS, "llist_count is off after deleting and re-adding");
+
+  void **a = llist_array_get(list);
+  for (int i = 0; i < NUM_ITEMS / 2; i++) {
+    mu_assert(*(int *)a[i] == 2 * i + 1, "The odd elements are out of order");
+    mu_assert(*(int *)a[NUM_ITEMS / 2 + i] == 2 * i, "The re-added elements are out of order");
+  }
+  mu_assert(a[NUM_ITEMS] == NULL, "llist_array_get should end the array with NULL");
+  llist_array_free(a);
+  mu_assert(*(int *)llist_tail(list) == NUM_ITEMS - 2, "The tail is wrong after re-adding");
+
+  llist_destroy(list);
+
+  return NULL;
+}
+
+static void *fill_list(void *arg)
+{
+  static int values[NUM_ITEMS];
+
+  for (int i = 0; i < NUM_ITEMS; i++) {
+    values[i] = i;
+    llist_append(arg, &values[i]);
+  }
+  return NULL;
+}
+
+char *test_llist_other_thread()
+{
+  struct llist *list = llist_create();
+  pthread_t thread;
+
+  // Nodes from another thread's slabs end up on this thread's free list
+  pthread_create(&thread, NULL, fill_list, list);
+  pthread_join(thread, NULL);
+  mu_assert(llist_count(list) == NUM_ITEMS, "A list filled on another thread has the wrong count");
+  llist_destroy(list);
+
+  list = llist_create();
+  fill_list(list);
+  mu_assert(llist_count(list) == NUM_ITEMS && *(int *)llist_tail(list) == NUM_ITEMS - 1, "Reusing another thread's nodes went wrong");
+  llist_destroy(list);
+
+  return NULL;
+}
+
+char *test_ilist_empty_and_single()
+{
+  struct ilist list;
+  struct item x = { 1, { NULL, NULL } };
+  int one[] = { 1 };
+
+  ilist_init(&list);
+  mu_assert(ilist_is(&list, NULL, 0), "ilist_init should make an empty list");
+  mu_assert(ilist_pop_head(&list) == NULL, "Popping the head of an empty list should return NULL");
+  mu_assert(ilist_pop_tail(&list) == NULL, "Popping the tail of an empty list should return NULL");
+
+  ilist_append(&list, &x.link);
+  mu_assert(ilist_is(&list, one, 1), "Appending to an empty list went wrong");
+  mu_assert(ilist_pop_head(&list) == &x.link && ilist_is(&list, NULL, 0), "Popping the head of a single-element list went wrong");
+
+  ilist_insert(&list, &x.link);
+  mu_assert(ilist_is(&list, one, 1), "Inserting into an empty list went wrong");
+  mu_assert(ilist_pop_tail(&list) == &x.link && ilist_is(&list, NULL, 0), "Popping the tail of a single-element list went wrong");
+
+  ilist_append(&list, &x.link);
+  ilist_move_to_head(&list, &x.link);
+  mu_assert(ilist_is(&list, one, 1), "Moving the only element to the head went wrong");
+  ilist_remove(&list, &x.link);
+  mu_assert(ilist_is(&list, NULL, 0), "Removing the only element should empty the list");
+  mu_assert(x.link.prev == NULL && x.link.next == NULL, "A removed link should be cleared");
+
+  return NULL;
+}
+
+char *test_ilist_ops()
+{
+  struct ilist list;
+  struct item items[5];
+
+  ilist_init(&list);
+  for (int i = 0; i < 5; i++) {
+    items[i].id = i;
+  }
+
+  ilist_append(&list, &items[1].link);
+  ilist_append(&list, &items[2].link);
+  ilist_insert(&list, &items[0].link);
+  ilist_append(&list, &items[3].link);
+  ilist_append(&list, &items[4].link);
+  int all[] = { 0, 1, 2, 3, 4 };
+  mu_assert(ilist_is(&list, all, 5), "ilist_insert/ilist_append built the wrong list");
+
+  // Remove from the middle, the head and the tail
+  ilist_remove(&list, &items[2].link);
+  int no_middle[] = { 0, 1, 3, 4 };
+  mu_assert(ilist_is(&list, no_middle, 4), "Removing from the middle went wrong");
+  ilist_remove(&list, &items[0].link);
+  ilist_remove(&list, &items[4].link);
+  int inner[] = { 1, 3 };
+  mu_assert(ilist_is(&list, inner, 2), "Removing the head and tail went wrong");
+
+  // Move the tail, then a middle element, then the head to the head
+  ilist_append(&list, &items[0].link);
+  ilist_append(&list, &items[2].link);
+  ilist_move_to_head(&list, &items[2].link);
+  int moved_tail[] = { 2, 1, 3, 0 };
+  mu_assert(ilist_is(&list, moved_tail, 4), "Moving the tail to the head went wrong");
+  ilist_move_to_head(&list, &items[3].link);
+  int moved_middle[] = { 3, 2, 1, 0 };
+  mu_assert(ilist_is(&list, moved_middle, 4), "Moving a middle element to the head went wrong");
+  ilist_move_to_head(&list, &items[3].link);
+  mu_assert(ilist_is(&list, moved_middle, 4), "Moving the head to the head should change nothing");
+
+  // Pop from both ends
+  mu_assert(ilist_entry(ilist_pop_head(&list), struct item, link)->id == 3, "ilist_pop_head returned the wrong element");
+  mu_assert(ilist_entry(ilist_pop_tail(&list), struct item, link)->id == 0, "ilist_pop_tail returned the wrong element");
+  int rest[] = { 2, 1 };
+  mu_assert(ilist_is(&list, rest, 2), "Popping from both ends went wrong");
+
+  return NULL;
+}
+
+char *all_tests()
+{
+  mu_suite_start();
+
+  mu_run_test(test_llist_tail);
+  mu_run_test(test_llist_many);
+  mu_run_test(test_llist_other_thread);
+  mu_run_test(test_ilist_empty_and_single);
+  mu_run_test(test_ilist_ops);
+
+  return NULL;
+}
+
+RUN_TESTS(all_tests)
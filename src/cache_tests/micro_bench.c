@@ -0,0 +1,392 @@
+/**
+ * micro_bench.c -- Microbenchmarks for the cache, hashtable, llist and MIME lookup
+ *
+ * Usage:
+ *
+ *    make microbench
+ *    ./cache_tests/micro_bench [-t max_threads] [-n ops_per_thread] [-b bench]
+ *
+ * Every benchmark runs with 1, 2, 4, ... threads up to max_threads (default:
+ * the number of CPUs) and prints one JSON object per run:
+ *
+ *    {"bench":"cache_get_put_zipf","threads":2,"ops":2000000,
+ *     "ns_per_op":85.1,"mops":23.5,"allocs_per_op":0.0012}
+ *
+ * ns_per_op is the time one thread spends per operation; mops is the
+ * combined throughput. allocs_per_op counts malloc/calloc/realloc calls made
+ * by the code under test (the binary is linked with --wrap for them).
+ *
+ * Keys are drawn from a Zipfian distribution, like real request paths. The
+ * cache is shared between threads; hashtable and llist aren't thread-safe,
+ * so each thread gets its own.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "../cache.h"
+#include "../hashtable.h"
+#include "../llist.h"
+#include "../mime.h"
+
+#define NUM_KEYS 10000
+#define ZIPF_S 0.99
+#define KEY_SEQ_SIZE 65536 // Precomputed key draws per thread, a power of two
+#define CACHE_SIZE 1000 // Entries; a tenth of the keys, so there are misses
+#define LIST_SIZE 64
+#define DEFAULT_OPS 1000000
+
+struct worker {
+  pthread_t thread;
+  int id;
+  long ops;
+  int *keys; // KEY_SEQ_SIZE Zipfian key indexes
+  void *shared;
+  void *local; // From the benchmark's thread_setup
+  double elapsed_ns;
+  long allocs;
+};
+
+struct bench {
+  const char *name;
+  void *(*setup)(void); // Shared state, or NULL
+  void *(*thread_setup)(void *shared, struct worker *w); // Untimed, per thread
+  void (*run)(struct worker *w); // Timed: w->ops operations
+  void (*thread_teardown)(void *local);
+  void (*teardown)(void *shared);
+};
+
+static char *key_names[NUM_KEYS];
+static int key_lengths[NUM_KEYS];
+static double zipf_cdf[NUM_KEYS];
+static pthread_barrier_t start_barrier;
+static char content[64] = "benchmark content";
+
+/*
+ * Allocation counting, through the linker's --wrap
+ */
+static __thread long thread_allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+  thread_allocs++;
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+  thread_allocs++;
+  return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size)
+{
+  thread_allocs++;
+  return __real_realloc(p, size);
+}
+
+/*
+ * Keys
+ */
+static void make_keys(void)
+{
+  double sum = 0;
+
+  for (int i = 0; i < NUM_KEYS; i++) {
+    char name[32];
+    snprintf(name, sizeof name, "/file/%d.html", i);
+    key_names[i] = strdup(name);
+    key_lengths[i] = strlen(name);
+    sum += 1.0 / pow(i + 1, ZIPF_S);
+    zipf_cdf[i] = sum;
+  }
+  for (int i = 0; i < NUM_KEYS; i++) {
+    zipf_cdf[i] /= sum;
+  }
+}
+
+static int zipf_draw(unsigned int *seed)
+{
+  double u = (double)rand_r(seed) / RAND_MAX;
+  int lo = 0, hi = NUM_KEYS - 1;
+
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (zipf_cdf[mid] < u) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
+/*
+ * cache_get, falling back to cache_put on a miss like the server does
+ */
+static void *cache_setup(void)
+{
+  return cache_create(CACHE_SIZE, 0);
+}
+
+static void cache_teardown(void *shared)
+{
+  cache_free(shared);
+}
+
+static void run_cache_get_put(struct worker *w)
+{
+  cache *c = w->shared;
+
+  for (long i = 0; i < w->ops; i++) {
+    char *key = key_names[w->keys[i & (KEY_SEQ_SIZE - 1)]];
+    cache_entry *e = cache_get(c, key);
+    if (e != NULL) {
+      cache_release(e);
+    } else {
+      cache_put(c, key, "text/html", content, sizeof content);
+    }
+  }
+}
+
+static void run_cache_put(struct worker *w)
+{
+  cache *c = w->shared;
+
+  for (long i = 0; i < w->ops; i++) {
+    cache_put(c, key_names[w->keys[i & (KEY_SEQ_SIZE - 1)]], "text/html", content, sizeof content);
+  }
+}
+
+/*
+ * hashtable_get_bin
+ */
+static void *hashtable_thread_setup(void *shared, struct worker *w)
+{
+  (void)shared;
+  (void)w;
+  struct hashtable *ht = hashtable_create(0, NULL);
+
+  for (int i = 0; i < NUM_KEYS; i++) {
+    hashtable_put(ht, key_names[i], key_names[i]);
+  }
+  // Let any incremental resize finish before timing
+  for (int i = 0; i < NUM_KEYS; i++) {
+    hashtable_get(ht, key_names[i]);
+  }
+
+  return ht;
+}
+
+static void hashtable_thread_teardown(void *local)
+{
+  hashtable_destroy(local);
+}
+
+static void run_hashtable_get_bin(struct worker *w)
+{
+  struct hashtable *ht = w->local;
+
+  for (long i = 0; i < w->ops; i++) {
+    int k = w->keys[i & (KEY_SEQ_SIZE - 1)];
+    if (hashtable_get_bin(ht, key_names[k], key_lengths[k]) == NULL) {
+      fprintf(stderr, "hashtable_get_bin lost a key\n");
+      exit(1);
+    }
+  }
+}
+
+/*
+ * llist_find over a short list
+ */
+static int str_cmp(void *a, void *b)
+{
+  return strcmp(a, b);
+}
+
+static void *llist_thread_setup(void *shared, struct worker *w)
+{
+  (void)shared;
+  (void)w;
+  struct llist *l = llist_create();
+
+  for (int i = 0; i < LIST_SIZE; i++) {
+    llist_append(l, key_names[i]);
+  }
+
+  return l;
+}
+
+static void llist_thread_teardown(void *local)
+{
+  llist_destroy(local);
+}
+
+static void run_llist_find(struct worker *w)
+{
+  struct llist *l = w->local;
+
+  for (long i = 0; i < w->ops; i++) {
+    if (llist_find(l, key_names[w->keys[i & (KEY_SEQ_SIZE - 1)] % LIST_SIZE], str_cmp) == NULL) {
+      fprintf(stderr, "llist_find lost an element\n");
+      exit(1);
+    }
+  }
+}
+
+/*
+ * mime_type_get
+ */
+static char *mime_names[] = {
+  "/index.html", "/cat.jpg", "/app.js", "/style.css", "/data.json", "/logo.PNG",
+  "/font.woff2", "/movie.mp4", "/readme", "/archive.tar.gz", "/a.b/c", "/notes.txt",
+  "/icon.svg", "/photo.JPEG", "/song.mp3", "/unknown.xyz",
+};
+
+static void run_mime_type_get(struct worker *w)
+{
+  const int n = sizeof mime_names / sizeof mime_names[0];
+
+  for (long i = 0; i < w->ops; i++) {
+    if (mime_type_get(mime_names[w->keys[i & (KEY_SEQ_SIZE - 1)] % n]) == NULL) {
+      exit(1);
+    }
+  }
+}
+
+static struct bench benches[] = {
+  { "cache_get_put_zipf", cache_setup, NULL, run_cache_get_put, NULL, cache_teardown },
+  { "cache_put_zipf", cache_setup, NULL, run_cache_put, NULL, cache_teardown },
+  { "hashtable_get_bin_zipf", NULL, hashtable_thread_setup, run_hashtable_get_bin,
+    hashtable_thread_teardown, NULL },
+  { "llist_find", NULL, llist_thread_setup, run_llist_find, llist_thread_teardown, NULL },
+  { "mime_type_get", NULL, NULL, run_mime_type_get, NULL, NULL },
+};
+
+static double now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static struct bench *current;
+
+static void *worker_main(void *arg)
+{
+  struct worker *w = arg;
+
+  if (current->thread_setup != NULL) {
+    w->local = current->thread_setup(w->shared, w);
+  }
+
+  pthread_barrier_wait(&start_barrier);
+
+  long allocs = thread_allocs;
+  double start = now_ns();
+  current->run(w);
+  w->elapsed_ns = now_ns() - start;
+  w->allocs = thread_allocs - allocs;
+
+  if (current->thread_teardown != NULL) {
+    current->thread_teardown(w->local);
+  }
+
+  return NULL;
+}
+
+static void run_bench(struct bench *b, int threads, long ops)
+{
+  struct worker workers[threads];
+  void *shared = b->setup != NULL ? b->setup() : NULL;
+  double ns_per_op = 0, longest = 0;
+  long allocs = 0;
+
+  current = b;
+  pthread_barrier_init(&start_barrier, NULL, threads);
+
+  for (int i = 0; i < threads; i++) {
+    unsigned int seed = i + 1;
+    workers[i].id = i;
+    workers[i].ops = ops;
+    workers[i].shared = shared;
+    workers[i].local = NULL;
+    workers[i].keys = malloc(KEY_SEQ_SIZE * sizeof(int));
+    for (int k = 0; k < KEY_SEQ_SIZE; k++) {
+      workers[i].keys[k] = zipf_draw(&seed);
+    }
+    pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+  }
+
+  for (int i = 0; i < threads; i++) {
+    pthread_join(workers[i].thread, NULL);
+    ns_per_op += workers[i].elapsed_ns / ops;
+    allocs += workers[i].allocs;
+    if (workers[i].elapsed_ns > longest) {
+      longest = workers[i].elapsed_ns;
+    }
+    free(workers[i].keys);
+  }
+
+  pthread_barrier_destroy(&start_barrier);
+  if (b->teardown != NULL) {
+    b->teardown(shared);
+  }
+
+  printf("{\"bench\":\"%s\",\"threads\":%d,\"ops\":%ld,\"ns_per_op\":%.1f,\"mops\":%.2f,"
+         "\"allocs_per_op\":%.4f}\n", b->name, threads, ops * threads, ns_per_op / threads,
+         ops * threads / longest * 1e3, (double)allocs / (ops * threads));
+  fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+  int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  long ops = DEFAULT_OPS;
+  char *only = NULL;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "t:n:b:")) != -1) {
+    switch (opt) {
+    case 't': max_threads = atoi(optarg); break;
+    case 'n': ops = atol(optarg); break;
+    case 'b': only = optarg; break;
+    default:
+      fprintf(stderr, "usage: %s [-t max_threads] [-n ops_per_thread] [-b bench]\n", argv[0]);
+      exit(1);
+    }
+  }
+  if (max_threads < 1) {
+    max_threads = 1;
+  }
+
+  make_keys();
+
+  for (size_t i = 0; i < sizeof benches / sizeof benches[0]; i++) {
+    if (only != NULL && strcmp(only, benches[i].name) != 0) {
+      continue;
+    }
+    for (int threads = 1; ; threads *= 2) {
+      if (threads > max_threads) {
+        threads = max_threads;
+      }
+      run_bench(&benches[i], threads, ops);
+      if (threads == max_threads) {
+        break;
+      }
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,140 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "minunit.h"
+#include "../slab.h"
+
+#define NUM_OBJS 1000
+#define NUM_THREADS 4
+
+char *test_slab_sizes()
+{
+  // Every size up to the largest class, plus the edges around each class
+  for (size_t size = 1; size <= SLAB_MAX_SIZE; size += size < 256 ? 1 : size / 7) {
+    for (size_t s = size > 1 ? size - 1 : size; s <= size + 1 && s <= SLAB_MAX_SIZE; s++) {
+      unsigned char *p = slab_alloc(s);
+      mu_assert(p != NULL, "slab_alloc failed");
+      mu_assert((uintptr_t)p % 16 == 0, "slab_alloc returned an object that isn't 16-byte aligned");
+      // The whole requested size must be usable
+      memset(p, 0xab, s);
+      slab_free(p, s);
+    }
+  }
+
+  return NULL;
+}
+
+char *test_slab_objects_distinct()
+{
+  unsigned char *objs[NUM_OBJS];
+  size_t size = 48;
+
+  for (int i = 0; i < NUM_OBJS; i++) {
+    objs[i] = slab_alloc(size);
+    mu_assert(objs[i] != NULL, "slab_alloc failed");
+    memset(objs[i], i & 0xff, size);
+  }
+  // Writing one object must not have touched another
+  for (int i = 0; i < NUM_OBJS; i++) {
+    for (size_t j = 0; j < size; j++) {
+      mu_assert(objs[i][j] == (i & 0xff), "Two live slab objects overlap");
+    }
+  }
+  for (int i = 0; i < NUM_OBJS; i++) {
+    slab_free(objs[i], size);
+  }
+
+  return NULL;
+}
+
+char *test_slab_reuse()
+{
+  void *a = slab_alloc(100);
+  slab_free(a, 100);
+  void *b = slab_alloc(100);
+  mu_assert(a == b, "A freed object should be the next one handed out for its class");
+  // 100 and 128 share a class, 129 doesn't
+  slab_free(b, 128);
+  mu_assert(slab_alloc(128) == a, "Sizes in the same class should share objects");
+  slab_free(a, 100);
+  void *c = slab_alloc(129);
+  mu_assert(c != a, "Sizes in different classes should not share objects");
+  slab_free(c, 129);
+
+  return NULL;
+}
+
+char *test_slab_large()
+{
+  size_t size = SLAB_MAX_SIZE + 1;
+  char *p = slab_alloc(size);
+
+  mu_assert(p != NULL, "slab_alloc of a size past SLAB_MAX_SIZE failed");
+  memset(p, 0xcd, size);
+  slab_free(p, size);
+  slab_free(NULL, 32); // A no-op, like free(NULL)
+
+  return NULL;
+}
+
+static void *alloc_worker(void *arg)
+{
+  int id = (intptr_t)arg;
+  unsigned char *objs[NUM_OBJS];
+
+  for (int round = 0; round < 20; round++) {
+    for (int i = 0; i < NUM_OBJS; i++) {
+      size_t size = 32 + (i % 5) * 40;
+      objs[i] = slab_alloc(size);
+      if (objs[i] == NULL) {
+        return "slab_alloc failed";
+      }
+      memset(objs[i], id, size);
+    }
+    for (int i = 0; i < NUM_OBJS; i++) {
+      size_t size = 32 + (i % 5) * 40;
+      for (size_t j = 0; j < size; j++) {
+        if (objs[i][j] != id) {
+          return "Another thread wrote to this thread's slab object";
+        }
+      }
+      slab_free(objs[i], size);
+    }
+  }
+  // Give everything back to the depots for the next thread
+  slab_thread_flush();
+
+  return NULL;
+}
+
+char *test_slab_threads()
+{
+  pthread_t threads[NUM_THREADS];
+
+  for (int i = 0; i < NUM_THREADS; i++) {
+    pthread_create(&threads[i], NULL, alloc_worker, (void *)(intptr_t)(i + 1));
+  }
+  for (int i = 0; i < NUM_THREADS; i++) {
+    void *failed;
+    pthread_join(threads[i], &failed);
+    mu_assert(failed == NULL, "A thread saw its slab objects corrupted");
+  }
+
+  return NULL;
+}
+
+char *all_tests()
+{
+  mu_suite_start();
+
+  mu_run_test(test_slab_sizes);
+  mu_run_test(test_slab_objects_distinct);
+  mu_run_test(test_slab_reuse);
+  mu_run_test(test_slab_large);
+  mu_run_test(test_slab_threads);
+
+  return NULL;
+}
+
+RUN_TESTS(all_tests)
@@ -0,0 +1,126 @@
+#include <stdlib.h>
+#include <string.h>
+#include "minunit.h"
+#include "../timerwheel.h"
+
+#define TICK_MS 10
+#define NUM_TIMERS 10000
+
+static void count_fire(void *arg)
+{
+  (*(int *)arg)++;
+}
+
+char *test_timer_fires_on_time()
+{
+  struct timer_wheel *wheel = timer_wheel_create(TICK_MS);
+  struct timer t;
+  int fired = 0;
+
+  timer_init(&t, count_fire, &fired);
+  timer_wheel_arm(wheel, &t, 55); // Rounds up to 6 ticks
+
+  timer_wheel_advance(wheel, 50);
+  mu_assert(fired == 0, "A timer fired before its deadline");
+  timer_wheel_advance(wheel, 60);
+  mu_assert(fired == 1, "A timer did not fire at its deadline");
+  mu_assert(!t.armed, "A fired timer should be disarmed");
+  timer_wheel_advance(wheel, 200);
+  mu_assert(fired == 1, "A timer fired twice");
+  mu_assert(wheel->armed_count == 0, "armed_count should be back to 0");
+
+  timer_wheel_destroy(wheel);
+
+  return NULL;
+}
+
+char *test_timer_cancel_and_rearm()
+{
+  struct timer_wheel *wheel = timer_wheel_create(TICK_MS);
+  struct timer t;
+  int fired = 0;
+
+  timer_init(&t, count_fire, &fired);
+  timer_wheel_arm(wheel, &t, 30);
+  timer_wheel_cancel(wheel, &t);
+  timer_wheel_advance(wheel, 100);
+  mu_assert(fired == 0, "A cancelled timer fired");
+  timer_wheel_cancel(wheel, &t); // Cancelling twice is fine
+
+  // Re-arming pushes the deadline back
+  timer_wheel_arm(wheel, &t, 30); // Tick 13
+  timer_wheel_advance(wheel, 120);
+  timer_wheel_arm(wheel, &t, 30); // Tick 15
+  timer_wheel_advance(wheel, 140);
+  mu_assert(fired == 0, "A re-armed timer fired at its old deadline");
+  timer_wheel_advance(wheel, 150);
+  mu_assert(fired == 1, "A re-armed timer did not fire at its new deadline");
+
+  timer_wheel_destroy(wheel);
+
+  return NULL;
+}
+
+char *test_timer_past_one_revolution()
+{
+  struct timer_wheel *wheel = timer_wheel_create(TICK_MS);
+  struct timer near, far;
+  int near_fired = 0, far_fired = 0;
+  int revolution_ms = TIMER_WHEEL_SLOTS * TICK_MS;
+
+  // Both land in the same slot, a revolution apart
+  timer_init(&near, count_fire, &near_fired);
+  timer_init(&far, count_fire, &far_fired);
+  timer_wheel_arm(wheel, &near, TICK_MS);
+  timer_wheel_arm(wheel, &far, TICK_MS + revolution_ms);
+
+  timer_wheel_advance(wheel, TICK_MS);
+  mu_assert(near_fired == 1 && far_fired == 0, "Only the timer due this revolution should fire");
+  timer_wheel_advance(wheel, revolution_ms);
+  mu_assert(far_fired == 0, "A timer fired a tick early");
+  timer_wheel_advance(wheel, revolution_ms + TICK_MS);
+  mu_assert(far_fired == 1, "A timer more than one revolution out did not fire");
+
+  timer_wheel_destroy(wheel);
+
+  return NULL;
+}
+
+char *test_timer_many()
+{
+  struct timer_wheel *wheel = timer_wheel_create(TICK_MS);
+  struct timer *timers = malloc(NUM_TIMERS * sizeof *timers);
+  int fired = 0;
+
+  for (int i = 0; i < NUM_TIMERS; i++) {
+    timer_init(&timers[i], count_fire, &fired);
+    timer_wheel_arm(wheel, &timers[i], (i % 3000) + 1);
+  }
+  // Cancel every other one
+  for (int i = 0; i < NUM_TIMERS; i += 2) {
+    timer_wheel_cancel(wheel, &timers[i]);
+  }
+  mu_assert(wheel->armed_count == NUM_TIMERS / 2, "armed_count is off after cancelling");
+
+  int total = timer_wheel_advance(wheel, 3000);
+  mu_assert(total == NUM_TIMERS / 2 && fired == NUM_TIMERS / 2, "Not every armed timer fired");
+
+  free(timers);
+  timer_wheel_destroy(wheel);
+
+  return NULL;
+}
+
+char *all_tests()
+{
+  mu_suite_start();
+
+  mu_run_test(test_timer_fires_on_time);
+  mu_run_test(test_timer_cancel_and_rearm);
+  mu_run_test(test_timer_past_one_revolution);
+  mu_run_test(test_timer_many);
+
+  return NULL;
+}
+
+RUN_TESTS(all_tests)
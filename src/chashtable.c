@@ -0,0 +1,553 @@
+/*
+
+Concurrent hashtable for data shared between threads (the cache index).
+
+Readers never take a lock. Writers lock one stripe: the slots of the table
+are split into num_stripes contiguous ranges, and a key's stripe is the
+range its home slot falls in, so writers of the same key always serialize
+while writers of unrelated keys mostly don't.
+
+The table is open-addressed with linear probing over an array of node
+pointers. A slot is NULL (never used), TOMBSTONE (deleted), or a node.
+Writers publish nodes with a compare-and-swap, because two stripes can
+probe into the same free slot at the edge of their ranges.
+
+Nodes and old slot arrays are only freed after a grace period: every reader
+runs inside chashtable_read_lock()/chashtable_read_unlock(), and
+chashtable_synchronize() waits until every reader that could have seen the
+old pointer is gone. That is also what makes resizing safe while readers
+are in flight: the new array is published with one atomic store, and the
+old one is freed after the readers still walking it have left.
+
+Example:
+
+struct chashtable *ht = chashtable_create(0, 0);
+
+chashtable_put(ht, "/index.html", entry);
+
+struct cache_entry *e = chashtable_get(ht, "/index.html");
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include "hashtable.h"
+#include "chashtable.h"
+
+#define DEFAULT_SIZE 128
+#define DEFAULT_STRIPES 16
+#define MIN_SLOTS_PER_STRIPE 8
+#define RETIRE_BATCH 64 // Deleted nodes to collect before waiting out a grace period
+
+#define TOMBSTONE ((struct chnode *)1)
+
+// Resize once entries + tombstones fill this fraction of the slots, out of 4
+#define MAX_USED_QUARTERS 3
+
+struct chnode {
+    uint64_t hash;
+    int key_size;
+    _Atomic(void *) data;
+    struct chnode *next_retired;
+    unsigned char key[];
+};
+
+struct chtable {
+    int size; // Power of two
+    int stripe_shift; // home slot >> stripe_shift == stripe
+    _Atomic(struct chnode *) slots[];
+};
+
+/**
+ * Allocate an empty slot array
+ */
+static struct chtable *table_alloc(int size, int num_stripes)
+{
+    struct chtable *t = calloc(1, sizeof *t + size * sizeof t->slots[0]);
+
+    if (t == NULL) {
+        return NULL;
+    }
+
+    t->size = size;
+    t->stripe_shift = __builtin_ctz(size) - __builtin_ctz(num_stripes);
+
+    return t;
+}
+
+/**
+ * Round up to a power of two, at least min
+ */
+static int pow2_at_least(int n, int min)
+{
+    int p = min;
+
+    while (p < n) {
+        p <<= 1;
+    }
+
+    return p;
+}
+
+/**
+ * Create a new concurrent hashtable
+ *
+ * size and num_stripes of 0 pick defaults.
+ */
+struct chashtable *chashtable_create(int size, int num_stripes)
+{
+    if (num_stripes < 1) {
+        num_stripes = DEFAULT_STRIPES;
+    }
+
+    if (size < 1) {
+        size = DEFAULT_SIZE;
+    }
+
+    num_stripes = pow2_at_least(num_stripes, 1);
+    size = pow2_at_least(size, num_stripes * MIN_SLOTS_PER_STRIPE);
+
+    struct chashtable *ht = malloc(sizeof *ht);
+
+    if (ht == NULL) return NULL;
+
+    ht->stripes = malloc(num_stripes * sizeof *ht->stripes);
+    struct chtable *t = table_alloc(size, num_stripes);
+
+    if (ht->stripes == NULL || t == NULL) {
+        free(ht->stripes);
+        free(t);
+        free(ht);
+        return NULL;
+    }
+
+    for (int i = 0; i < num_stripes; i++) {
+        pthread_mutex_init(&ht->stripes[i], NULL);
+    }
+
+    ht->num_stripes = num_stripes;
+    atomic_init(&ht->table, t);
+    atomic_init(&ht->num_entries, 0);
+    atomic_init(&ht->num_used, 0);
+    atomic_init(&ht->epoch, 0);
+    atomic_init(&ht->readers[0], 0);
+    atomic_init(&ht->readers[1], 0);
+    pthread_mutex_init(&ht->sync_lock, NULL);
+    pthread_mutex_init(&ht->retire_lock, NULL);
+    ht->retired = NULL;
+    ht->num_retired = 0;
+
+    return ht;
+}
+
+/**
+ * Free every node still waiting on the retired list
+ *
+ * NOTE: caller must have waited out a grace period since they were retired
+ */
+static void free_nodes(struct chnode *n)
+{
+    while (n != NULL) {
+        struct chnode *next = n->next_retired;
+        free(n);
+        n = next;
+    }
+}
+
+/**
+ * Destroy a concurrent hashtable
+ *
+ * NOTE: does *not* free the data pointers, and no other thread may be
+ * using the table
+ */
+void chashtable_destroy(struct chashtable *ht)
+{
+    struct chtable *t = atomic_load(&ht->table);
+
+    for (int i = 0; i < t->size; i++) {
+        struct chnode *n = atomic_load_explicit(&t->slots[i], memory_order_relaxed);
+
+        if (n != NULL && n != TOMBSTONE) {
+            free(n);
+        }
+    }
+
+    free_nodes(ht->retired);
+
+    for (int i = 0; i < ht->num_stripes; i++) {
+        pthread_mutex_destroy(&ht->stripes[i]);
+    }
+
+    pthread_mutex_destroy(&ht->sync_lock);
+    pthread_mutex_destroy(&ht->retire_lock);
+    free(ht->stripes);
+    free(t);
+    free(ht);
+}
+
+/**
+ * Enter a read-side critical section
+ *
+ * Nothing reachable from the table is freed until the section ends.
+ * Returns the epoch to hand to chashtable_read_unlock().
+ */
+unsigned int chashtable_read_lock(struct chashtable *ht)
+{
+    for (;;) {
+        unsigned int epoch = atomic_load(&ht->epoch);
+
+        atomic_fetch_add(&ht->readers[epoch & 1], 1);
+
+        // If the epoch moved before we were counted, a writer may already
+        // have stopped waiting for this counter; count ourselves again
+        if (atomic_load(&ht->epoch) == epoch) {
+            return epoch;
+        }
+
+        atomic_fetch_sub(&ht->readers[epoch & 1], 1);
+    }
+}
+
+/**
+ * Leave a read-side critical section
+ */
+void chashtable_read_unlock(struct chashtable *ht, unsigned int epoch)
+{
+    atomic_fetch_sub_explicit(&ht->readers[epoch & 1], 1, memory_order_release);
+}
+
+/**
+ * Wait until every reader that was in a critical section has left it
+ *
+ * Anything unpublished before the call can be freed after it.
+ */
+void chashtable_synchronize(struct chashtable *ht)
+{
+    pthread_mutex_lock(&ht->sync_lock);
+
+    unsigned int epoch = atomic_fetch_add(&ht->epoch, 1);
+
+    while (atomic_load(&ht->readers[epoch & 1]) != 0) {
+        sched_yield();
+    }
+
+    pthread_mutex_unlock(&ht->sync_lock);
+}
+
+/**
+ * Lock the stripe that owns hash in the current table
+ *
+ * Returns the table the stripe belongs to; it can't be swapped out while
+ * the stripe is held.
+ *
+ * NOTE: writers must not be inside a read-side critical section themselves,
+ * or a resize would wait on them forever
+ */
+static struct chtable *lock_stripe(struct chashtable *ht, uint64_t hash, pthread_mutex_t **lock)
+{
+    for (;;) {
+        // Until we hold a stripe, a resize may free t under us
+        unsigned int epoch = chashtable_read_lock(ht);
+        struct chtable *t = atomic_load(&ht->table);
+        pthread_mutex_t *m = &ht->stripes[(hash & (t->size - 1)) >> t->stripe_shift];
+
+        pthread_mutex_lock(m);
+
+        int current = atomic_load(&ht->table) == t;
+        chashtable_read_unlock(ht, epoch);
+
+        if (current) {
+            *lock = m;
+            return t;
+        }
+
+        // Resized while we waited; the key may live in another stripe now
+        pthread_mutex_unlock(m);
+    }
+}
+
+/**
+ * Find the slot holding key in t, or -1
+ */
+static int find_slot(struct chtable *t, void *key, int key_size, uint64_t hash,
+                     struct chnode **found)
+{
+    int mask = t->size - 1;
+
+    for (int i = hash & mask, n = 0; n < t->size; i = (i + 1) & mask, n++) {
+        struct chnode *node = atomic_load_explicit(&t->slots[i], memory_order_acquire);
+
+        if (node == NULL) {
+            break;
+        }
+
+        if (node != TOMBSTONE && node->hash == hash && node->key_size == key_size &&
+            memcmp(node->key, key, key_size) == 0) {
+            *found = node;
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Rebuild the table into a fresh slot array sized for its live entries
+ *
+ * Takes every stripe lock, so no writer is inside the old array; readers
+ * may be, and the old array is only freed after a grace period.
+ */
+static void resize(struct chashtable *ht, struct chtable *old)
+{
+    for (int i = 0; i < ht->num_stripes; i++) {
+        pthread_mutex_lock(&ht->stripes[i]);
+    }
+
+    // Someone else got here first
+    if (atomic_load(&ht->table) != old) {
+        for (int i = ht->num_stripes - 1; i >= 0; i--) {
+            pthread_mutex_unlock(&ht->stripes[i]);
+        }
+        return;
+    }
+
+    // Aim for a quarter full so there is room to grow before the next resize
+    int entries = atomic_load(&ht->num_entries);
+    int size = pow2_at_least(entries * 4, ht->num_stripes * MIN_SLOTS_PER_STRIPE);
+    struct chtable *t = table_alloc(size, ht->num_stripes);
+
+    if (t != NULL) {
+        for (int i = 0; i < old->size; i++) {
+            struct chnode *n = atomic_load_explicit(&old->slots[i], memory_order_relaxed);
+
+            if (n == NULL || n == TOMBSTONE) {
+                continue;
+            }
+
+            int j = n->hash & (size - 1);
+            while (atomic_load_explicit(&t->slots[j], memory_order_relaxed) != NULL) {
+                j = (j + 1) & (size - 1);
+            }
+            atomic_store_explicit(&t->slots[j], n, memory_order_relaxed);
+        }
+
+        atomic_store(&ht->num_used, entries);
+        atomic_store(&ht->table, t);
+    } else {
+        perror("chashtable resize");
+    }
+
+    for (int i = ht->num_stripes - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&ht->stripes[i]);
+    }
+
+    if (t != NULL) {
+        chashtable_synchronize(ht);
+        free(old);
+    }
+}
+
+/**
+ * Put to the hash table with a string key
+ */
+void *chashtable_put(struct chashtable *ht, char *key, void *data)
+{
+    return chashtable_put_bin(ht, key, strlen(key), data);
+}
+
+/**
+ * Put to the hash table with a binary key
+ */
+void *chashtable_put_bin(struct chashtable *ht, void *key, int key_size, void *data)
+{
+    return chashtable_put_hashed(ht, key, key_size, default_hashf(key, key_size), data);
+}
+
+/**
+ * Put to the hash table with a binary key and its default_hashf() hash
+ *
+ * If the key is already present its data is replaced.
+ */
+void *chashtable_put_hashed(struct chashtable *ht, void *key, int key_size, uint64_t hash, void *data)
+{
+    struct chnode *node = NULL;
+    pthread_mutex_t *lock;
+
+    for (;;) {
+        struct chtable *t = lock_stripe(ht, hash, &lock);
+        struct chnode *found;
+
+        if (find_slot(t, key, key_size, hash, &found) != -1) {
+            atomic_store_explicit(&found->data, data, memory_order_release);
+            pthread_mutex_unlock(lock);
+            free(node);
+            return data;
+        }
+
+        if ((atomic_load(&ht->num_used) + 1) * 4 > t->size * MAX_USED_QUARTERS) {
+            pthread_mutex_unlock(lock);
+            resize(ht, t);
+            continue;
+        }
+
+        if (node == NULL) {
+            node = malloc(sizeof *node + key_size);
+
+            if (node == NULL) {
+                pthread_mutex_unlock(lock);
+                return NULL;
+            }
+
+            node->hash = hash;
+            node->key_size = key_size;
+            atomic_init(&node->data, data);
+            memcpy(node->key, key, key_size);
+        }
+
+        // Only our stripe inserts this key, but neighbouring stripes can race
+        // us for the same free slot, so claim it with a CAS
+        int mask = t->size - 1;
+        for (int i = hash & mask, n = 0; n < t->size; i = (i + 1) & mask, n++) {
+            struct chnode *cur = atomic_load_explicit(&t->slots[i], memory_order_relaxed);
+
+            if (cur != NULL && cur != TOMBSTONE) {
+                continue;
+            }
+
+            if (atomic_compare_exchange_strong(&t->slots[i], &cur, node)) {
+                if (cur == NULL) {
+                    atomic_fetch_add(&ht->num_used, 1);
+                }
+                atomic_fetch_add(&ht->num_entries, 1);
+                pthread_mutex_unlock(lock);
+                return data;
+            }
+        }
+
+        // Every slot was taken under us; make room and try again
+        pthread_mutex_unlock(lock);
+        resize(ht, t);
+    }
+}
+
+/**
+ * Get from the hash table with a string key
+ */
+void *chashtable_get(struct chashtable *ht, char *key)
+{
+    return chashtable_get_bin(ht, key, strlen(key));
+}
+
+/**
+ * Get from the hash table with a binary key
+ */
+void *chashtable_get_bin(struct chashtable *ht, void *key, int key_size)
+{
+    return chashtable_get_hashed(ht, key, key_size, default_hashf(key, key_size));
+}
+
+/**
+ * Get from the hash table with a binary key and its default_hashf() hash
+ *
+ * Never blocks.
+ */
+void *chashtable_get_hashed(struct chashtable *ht, void *key, int key_size, uint64_t hash)
+{
+    unsigned int epoch = chashtable_read_lock(ht);
+    struct chtable *t = atomic_load(&ht->table);
+    struct chnode *found;
+    void *data = NULL;
+
+    if (find_slot(t, key, key_size, hash, &found) != -1) {
+        data = atomic_load_explicit(&found->data, memory_order_acquire);
+    }
+
+    chashtable_read_unlock(ht, epoch);
+
+    return data;
+}
+
+/**
+ * Delete from the hash table by string key
+ */
+void *chashtable_delete(struct chashtable *ht, char *key)
+{
+    return chashtable_delete_bin(ht, key, strlen(key));
+}
+
+/**
+ * Delete from the hash table by binary key
+ */
+void *chashtable_delete_bin(struct chashtable *ht, void *key, int key_size)
+{
+    return chashtable_delete_hashed(ht, key, key_size, default_hashf(key, key_size));
+}
+
+/**
+ * Delete by binary key and its default_hashf() hash
+ *
+ * NOTE: does *not* free the data--just retires the table's node
+ */
+void *chashtable_delete_hashed(struct chashtable *ht, void *key, int key_size, uint64_t hash)
+{
+    pthread_mutex_t *lock;
+    struct chtable *t = lock_stripe(ht, hash, &lock);
+    struct chnode *found;
+
+    int i = find_slot(t, key, key_size, hash, &found);
+
+    if (i == -1) {
+        pthread_mutex_unlock(lock);
+        return NULL;
+    }
+
+    void *data = atomic_load(&found->data);
+
+    atomic_store_explicit(&t->slots[i], TOMBSTONE, memory_order_release);
+    atomic_fetch_sub(&ht->num_entries, 1);
+    pthread_mutex_unlock(lock);
+
+    // Readers may still hold the node; free it after a grace period
+    struct chnode *batch = NULL;
+
+    pthread_mutex_lock(&ht->retire_lock);
+    found->next_retired = ht->retired;
+    ht->retired = found;
+    if (++ht->num_retired >= RETIRE_BATCH) {
+        batch = ht->retired;
+        ht->retired = NULL;
+        ht->num_retired = 0;
+    }
+    pthread_mutex_unlock(&ht->retire_lock);
+
+    if (batch != NULL) {
+        chashtable_synchronize(ht);
+        free_nodes(batch);
+    }
+
+    return data;
+}
+
+/**
+ * For-each element in the hash table
+ *
+ * Runs inside a read-side critical section; entries added or removed
+ * concurrently may or may not be seen.
+ */
+void chashtable_foreach(struct chashtable *ht, void (*f)(void *, void *), void *arg)
+{
+    unsigned int epoch = chashtable_read_lock(ht);
+    struct chtable *t = atomic_load(&ht->table);
+
+    for (int i = 0; i < t->size; i++) {
+        struct chnode *n = atomic_load_explicit(&t->slots[i], memory_order_acquire);
+
+        if (n != NULL && n != TOMBSTONE) {
+            f(atomic_load(&n->data), arg);
+        }
+    }
+
+    chashtable_read_unlock(ht, epoch);
+}
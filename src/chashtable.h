@@ -0,0 +1,46 @@
+#ifndef _CHASHTABLE_H_
+#define _CHASHTABLE_H_
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+struct chnode;
+struct chtable;
+
+// Concurrent hashtable: striped locks for writers, lock-free readers
+struct chashtable {
+    _Atomic(struct chtable *) table;
+    int num_stripes; // Power of two
+    pthread_mutex_t *stripes; // Stripe i covers the i-th range of home slots
+    atomic_int num_entries; // Read-only
+    atomic_int num_used; // Slots holding an entry or a tombstone
+
+    // Grace periods for freeing what readers might still be looking at
+    atomic_uint epoch;
+    atomic_int readers[2];
+    pthread_mutex_t sync_lock;
+
+    // Deleted nodes waiting for a grace period before being freed
+    pthread_mutex_t retire_lock;
+    struct chnode *retired;
+    int num_retired;
+};
+
+extern struct chashtable *chashtable_create(int size, int num_stripes);
+extern void chashtable_destroy(struct chashtable *ht);
+extern void *chashtable_put(struct chashtable *ht, char *key, void *data);
+extern void *chashtable_put_bin(struct chashtable *ht, void *key, int key_size, void *data);
+extern void *chashtable_put_hashed(struct chashtable *ht, void *key, int key_size, uint64_t hash, void *data);
+extern void *chashtable_get(struct chashtable *ht, char *key);
+extern void *chashtable_get_bin(struct chashtable *ht, void *key, int key_size);
+extern void *chashtable_get_hashed(struct chashtable *ht, void *key, int key_size, uint64_t hash);
+extern void *chashtable_delete(struct chashtable *ht, char *key);
+extern void *chashtable_delete_bin(struct chashtable *ht, void *key, int key_size);
+extern void *chashtable_delete_hashed(struct chashtable *ht, void *key, int key_size, uint64_t hash);
+extern void chashtable_foreach(struct chashtable *ht, void (*f)(void *, void *), void *arg);
+extern unsigned int chashtable_read_lock(struct chashtable *ht);
+extern void chashtable_read_unlock(struct chashtable *ht, unsigned int epoch);
+extern void chashtable_synchronize(struct chashtable *ht);
+
+#endif
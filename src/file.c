@@ -1,7 +1,22 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include "file.h"
+#include "mime.h"
+
+// Free list of FILE_CHUNK_SIZE buffers shared by all readers
+struct chunk_pool {
+    void *free[FILE_POOL_MAX];
+    int count;
+    pthread_mutex_t lock;
+};
+
+static struct chunk_pool pool = { .count = 0, .lock = PTHREAD_MUTEX_INITIALIZER };
 
 /**
  * Loads a file into memory and returns a pointer to the data.
@@ -61,6 +76,7 @@ file_data *file_load(char *filename)
 
     filedata->data = buffer;
     filedata->size = total_bytes;
+    filedata->mime_type = mime_type_get(filename);
 
     return filedata;
 }
@@ -72,4 +88,182 @@ void file_free(file_data *filedata)
 {
     free(filedata->data);
     free(filedata);
-}
\ No newline at end of file
+}
+
+/**
+ * Map a whole file read-only into memory
+ *
+ * The pages are shared with the kernel's page cache rather than copied.
+ * Release the mapping with munmap(map, *size).
+ *
+ * Returns NULL for missing, empty, or non-regular files.
+ */
+void *file_map(char *filename, int *size)
+{
+    struct stat buf;
+
+    int fd = open(filename, O_RDONLY);
+
+    if (fd == -1) {
+        return NULL;
+    }
+
+    if (fstat(fd, &buf) == -1 || !S_ISREG(buf.st_mode) || buf.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, buf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+    // The mapping keeps its own reference to the file
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    *size = buf.st_size;
+
+    return map;
+}
+
+/**
+ * Take a chunk buffer from the pool, or allocate a new one
+ */
+static void *chunk_get(void)
+{
+    void *chunk = NULL;
+
+    pthread_mutex_lock(&pool.lock);
+    if (pool.count > 0) {
+        chunk = pool.free[--pool.count];
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    if (chunk == NULL) {
+        chunk = malloc(FILE_CHUNK_SIZE);
+    }
+
+    return chunk;
+}
+
+/**
+ * Return a chunk buffer to the pool; frees it if the pool is full
+ */
+static void chunk_put(void *chunk)
+{
+    pthread_mutex_lock(&pool.lock);
+    if (pool.count < FILE_POOL_MAX) {
+        pool.free[pool.count++] = chunk;
+        chunk = NULL;
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    free(chunk);
+}
+
+/**
+ * Open a file for chunked reading
+ *
+ * Memory use is one pooled chunk per reader no matter how big the file is.
+ * advice is one of the FILE_ADVICE_* readahead hints.
+ *
+ * Returns NULL if the file can't be opened or isn't a regular file.
+ */
+file_reader *file_reader_open(char *filename, int advice)
+{
+    struct stat buf;
+
+    int fd = open(filename, O_RDONLY);
+
+    if (fd == -1) {
+        return NULL;
+    }
+
+    if (fstat(fd, &buf) == -1 || !S_ISREG(buf.st_mode)) {
+        close(fd);
+        return NULL;
+    }
+
+    file_reader *reader = malloc(sizeof *reader);
+
+    if (reader == NULL) {
+        close(fd);
+        return NULL;
+    }
+
+    reader->fd = fd;
+    reader->advice = advice;
+    reader->size = buf.st_size;
+    reader->offset = 0;
+    reader->chunk = NULL;
+    reader->mime_type = mime_type_get(filename);
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    if (advice != FILE_ADVICE_NONE) {
+        (void)posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+#endif
+
+    return reader;
+}
+
+/**
+ * Read the next chunk of the file
+ *
+ * On return *data points at the reader's chunk buffer, which stays valid
+ * until the next call or file_reader_close().
+ *
+ * Returns the number of bytes in the chunk, 0 at end of file, -1 on error.
+ */
+int file_reader_next(file_reader *reader, void **data)
+{
+    if (reader->offset >= reader->size) {
+        return 0;
+    }
+
+    if (reader->chunk == NULL) {
+        reader->chunk = chunk_get();
+
+        if (reader->chunk == NULL) {
+            return -1;
+        }
+    }
+
+    ssize_t bytes_read;
+
+    do {
+        bytes_read = pread(reader->fd, reader->chunk, FILE_CHUNK_SIZE, reader->offset);
+    } while (bytes_read == -1 && errno == EINTR);
+
+    if (bytes_read <= 0) {
+        // File shrank underneath us or the read failed
+        return -1;
+    }
+
+    reader->offset += bytes_read;
+
+#ifdef POSIX_FADV_WILLNEED
+    // Start pulling in the next chunk while the caller sends this one
+    if (reader->advice == FILE_ADVICE_WILLNEED && reader->offset < reader->size) {
+        (void)posix_fadvise(reader->fd, reader->offset, FILE_CHUNK_SIZE, POSIX_FADV_WILLNEED);
+    }
+#endif
+
+    *data = reader->chunk;
+
+    return (int)bytes_read;
+}
+
+/**
+ * Close a reader and give its chunk back to the pool
+ */
+void file_reader_close(file_reader *reader)
+{
+    if (reader->chunk != NULL) {
+        chunk_put(reader->chunk);
+    }
+
+    close(reader->fd);
+    free(reader);
+}
@@ -1,12 +1,39 @@
 #ifndef _FILELS_H_ // This was just _FILE_H_, but that interfered with Cygwin
 #define _FILELS_H_
+
+#include <sys/types.h>
+
 #define MAX_FILE_TYPE 255
+
+#define FILE_CHUNK_SIZE 65536 // Size of one pooled streaming buffer
+#define FILE_POOL_MAX 64      // Idle chunks kept around for reuse
+
+// Readahead hints for file_reader_open()
+#define FILE_ADVICE_NONE 0
+#define FILE_ADVICE_SEQUENTIAL 1 // Tell the kernel we'll read front to back
+#define FILE_ADVICE_WILLNEED 2   // Also prefetch the next chunk while we send
+
 typedef struct {
     int size;
     void *data;
+    char *mime_type; // Resolved once at load; never freed
 } file_data;
 
+// A chunked reader over an open file
+typedef struct file_reader_t {
+    int fd;
+    int advice;
+    off_t size;   // Total file size, read-only
+    off_t offset; // Bytes handed out so far
+    void *chunk;  // Pooled buffer of FILE_CHUNK_SIZE bytes
+    char *mime_type; // Resolved once at open; never freed
+} file_reader;
+
 extern file_data *file_load(char *filename);
 extern void file_free(file_data *filedata);
+extern void *file_map(char *filename, int *size);
+extern file_reader *file_reader_open(char *filename, int advice);
+extern int file_reader_next(file_reader *reader, void **data);
+extern void file_reader_close(file_reader *reader);
 
 #endif
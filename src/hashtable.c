@@ -38,25 +38,40 @@ printf("%d %s\n", q->bar, q->baz); // 12 Hello
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-#include "llist.h"
+#include <stdint.h>
 #include "hashtable.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * Open-addressing "Swiss table"
+ *
+ * Slots are split into aligned groups of GROUP_SIZE. Each slot has one
+ * control byte: CTRL_EMPTY, CTRL_DELETED, or the low 7 bits of the key's
+ * hash (h2) when full. A lookup starts at the group picked by the rest of
+ * the hash (h1), compares h2 against all 16 control bytes of the group at
+ * once, and only looks at the slots that match. Probing stops at the first
+ * group with an empty slot.
+ *
+ * Resizing is incremental: when the table passes grow_load (or drops under
+ * shrink_load) a new slot array is allocated and the old one is kept
+ * around. Every later operation moves REHASH_GROUPS groups across, and
+ * lookups check both arrays until the old one is empty.
+ */
+
 #define DEFAULT_SIZE 128
 #define DEFAULT_GROW_FACTOR 2
+#define GROUP_SIZE 16
 
-// Hash table entry
-struct htent {
-    void *key;
-    int key_size;
-    int hashed_key;
-    void *data;
-};
+#define CTRL_EMPTY ((signed char)0x80)
+#define CTRL_DELETED ((signed char)0xfe)
 
-// Used to cleanup the linked lists
-struct foreach_callback_payload {
-	void *arg;
-	void (*f)(void *, void *);
-};
+#define DEFAULT_GROW_LOAD 0.875f   // Occupancy (full + deleted) that triggers growth
+#define DEFAULT_SHRINK_LOAD 0.125f // Load under which the table shrinks
+#define MAX_GROW_LOAD 0.9375f      // Never fill past this, even mid-resize
+#define REHASH_GROUPS 2            // Groups migrated per operation while resizing
 
 /**
  * Change the entry count, maintain load metrics
@@ -67,26 +82,408 @@ void add_entry_count(struct hashtable *ht, int d)
     ht->load = (float)ht->num_entries / ht->size;
 }
 
+static inline uint64_t read64(const unsigned char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+static inline uint64_t read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+/**
+ * 64x64->128 multiply, folded back to 64 bits
+ */
+static inline uint64_t mix(uint64_t a, uint64_t b)
+{
+    __uint128_t r = (__uint128_t)a * b;
+
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+/**
+ * Default hashing function, after wyhash
+ *
+ * Consumes 8-16 bytes per multiply instead of doing a division per byte.
+ */
+uint64_t default_hashf(const void *data, int data_size)
+{
+    static const uint64_t s0 = 0xa0761d6478bd642fULL, s1 = 0xe7037ed1a0b428dbULL,
+                          s2 = 0x8ebc6af09c88c6e3ULL, s3 = 0x589965cc75374cc3ULL;
+    const unsigned char *p = data;
+    uint64_t len = data_size;
+    uint64_t seed = mix(s0, s1);
+    uint64_t a, b;
+
+    if (len <= 16) {
+        if (len >= 4) {
+            // Two overlapping reads cover 4..16 bytes without a loop
+            uint64_t off = (len >> 3) << 2;
+            a = (read32(p) << 32) | read32(p + off);
+            b = (read32(p + len - 4) << 32) | read32(p + len - 4 - off);
+        } else if (len > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        uint64_t i = len;
+
+        if (i > 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = mix(read64(p) ^ s1, read64(p + 8) ^ seed);
+                see1 = mix(read64(p + 16) ^ s2, read64(p + 24) ^ see1);
+                see2 = mix(read64(p + 32) ^ s3, read64(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+
+        while (i > 16) {
+            seed = mix(read64(p) ^ s1, read64(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+
+        a = read64(p + i - 16);
+        b = read64(p + i - 8);
+    }
+
+    __uint128_t r = (__uint128_t)(a ^ s1) * (b ^ seed);
+
+    return mix((uint64_t)r ^ s0 ^ len, (uint64_t)(r >> 64) ^ s1);
+}
+
+#ifdef __SSE2__
 /**
- * Default modulo hashing function
+ * Bitmask of the slots in a group whose control byte equals c
  */
-int default_hashf(void *data, int data_size, int bucket_count)
+static inline unsigned int group_match(const signed char *ctrl, signed char c)
 {
-    const int R = 31; // Small prime
-    int h = 0;
-    unsigned char *p = data;
+    __m128i group = _mm_load_si128((const __m128i *)ctrl);
 
-    for (int i = 0; i < data_size; i++) {
-        h = (R * h + p[i]) % bucket_count;
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(c)));
+}
+
+/**
+ * Bitmask of the empty or deleted slots in a group
+ *
+ * Both have the high bit set, full slots don't.
+ */
+static inline unsigned int group_match_free(const signed char *ctrl)
+{
+    return _mm_movemask_epi8(_mm_load_si128((const __m128i *)ctrl));
+}
+#else
+static inline unsigned int group_match(const signed char *ctrl, signed char c)
+{
+    unsigned int mask = 0;
+
+    for (int i = 0; i < GROUP_SIZE; i++) {
+        mask |= (unsigned int)(ctrl[i] == c) << i;
     }
 
-    return h;
+    return mask;
+}
+
+static inline unsigned int group_match_free(const signed char *ctrl)
+{
+    unsigned int mask = 0;
+
+    for (int i = 0; i < GROUP_SIZE; i++) {
+        mask |= (unsigned int)(ctrl[i] < 0) << i;
+    }
+
+    return mask;
+}
+#endif
+
+/**
+ * Hash a key with the table's hash function
+ *
+ * Callers that look the same key up more than once can hash it once and
+ * use the *_hashed functions.
+ */
+uint64_t hashtable_hash(struct hashtable *ht, void *key, int key_size)
+{
+    return ht->hashf(key, key_size);
+}
+
+/**
+ * Control byte for a full slot: the top 7 bits of the hash
+ *
+ * The low bits pick the group, so these are independent of it.
+ */
+static inline signed char hash_tag(uint64_t hash)
+{
+    return hash >> 57;
+}
+
+/**
+ * Allocate the control bytes and slots for an array of size slots
+ *
+ * size must be a power-of-two multiple of GROUP_SIZE.
+ */
+static int alloc_slots(struct htslots *t, int size)
+{
+    void *ctrl;
+
+    if (posix_memalign(&ctrl, GROUP_SIZE, size) != 0) {
+        return -1;
+    }
+
+    t->slots = calloc(size, sizeof(struct htent));
+
+    if (t->slots == NULL) {
+        free(ctrl);
+        return -1;
+    }
+
+    memset(ctrl, CTRL_EMPTY, size);
+    t->ctrl = ctrl;
+    t->size = size;
+    t->num_full = 0;
+    t->num_deleted = 0;
+
+    return 0;
+}
+
+/**
+ * Free a slot array; keys must already have been freed or moved
+ */
+static void free_slots(struct htslots *t)
+{
+    free(t->ctrl);
+    free(t->slots);
+    t->ctrl = NULL;
+    t->slots = NULL;
+    t->size = 0;
+}
+
+/**
+ * Find the slot holding key in t, or -1
+ */
+static int find_slot(struct htslots *t, void *key, int key_size, uint64_t hash)
+{
+    int group_mask = t->size / GROUP_SIZE - 1;
+    int g = hash & group_mask;
+    signed char h2 = hash_tag(hash);
+
+    // Triangular probing visits every group once when the count is a power of two
+    for (int step = 1; step <= group_mask + 1; g = (g + step++) & group_mask) {
+        signed char *ctrl = t->ctrl + g * GROUP_SIZE;
+        unsigned int match = group_match(ctrl, h2);
+
+        while (match != 0) {
+            int i = g * GROUP_SIZE + __builtin_ctz(match);
+            struct htent *ent = &t->slots[i];
+
+            // The full hash rejects almost every false tag match before memcmp
+            if (ent->hash == hash && ent->key_size == key_size &&
+                memcmp(ent->key, key, key_size) == 0) {
+                return i;
+            }
+
+            match &= match - 1;
+        }
+
+        if (group_match(ctrl, CTRL_EMPTY) != 0) {
+            break;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Find a free (empty or deleted) slot in t for a key with this hash
+ */
+static int find_free_slot(struct htslots *t, uint64_t hash)
+{
+    int group_mask = t->size / GROUP_SIZE - 1;
+    int g = hash & group_mask;
+
+    for (int step = 1; step <= group_mask + 1; g = (g + step++) & group_mask) {
+        unsigned int match = group_match_free(t->ctrl + g * GROUP_SIZE);
+
+        if (match != 0) {
+            return g * GROUP_SIZE + __builtin_ctz(match);
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Store an entry in a free slot of t
+ */
+static void insert_slot(struct htslots *t, struct htent *ent)
+{
+    int i = find_free_slot(t, ent->hash);
+
+    if (t->ctrl[i] == CTRL_DELETED) {
+        t->num_deleted--;
+    }
+
+    t->ctrl[i] = hash_tag(ent->hash);
+    t->slots[i] = *ent;
+    t->num_full++;
+}
+
+/**
+ * Empty slot i of t, leaving a tombstone only if a probe might run past it
+ */
+static void clear_slot(struct htslots *t, int i)
+{
+    signed char *group = t->ctrl + i / GROUP_SIZE * GROUP_SIZE;
+
+    // If the group already has an empty slot no probe ever ran past it,
+    // so this slot can go straight back to empty instead of a tombstone
+    if (group_match(group, CTRL_EMPTY) != 0) {
+        t->ctrl[i] = CTRL_EMPTY;
+    } else {
+        t->ctrl[i] = CTRL_DELETED;
+        t->num_deleted++;
+    }
+
+    t->num_full--;
+}
+
+/**
+ * Move up to groups groups of the old array into the current one
+ */
+static void rehash_step(struct hashtable *ht, int groups)
+{
+    struct htslots *old = &ht->old;
+    int end = ht->rehash_pos + groups * GROUP_SIZE;
+
+    if (end > old->size) {
+        end = old->size;
+    }
+
+    for (int i = ht->rehash_pos; i < end; i++) {
+        if (old->ctrl[i] >= 0) {
+            insert_slot(&ht->cur, &old->slots[i]);
+            // A tombstone, not empty, so probes for keys not yet moved go on past it
+            old->ctrl[i] = CTRL_DELETED;
+            old->num_full--;
+        }
+    }
+
+    ht->rehash_pos = end;
+
+    if (ht->rehash_pos == old->size) {
+        free_slots(old);
+        ht->rehash_pos = -1;
+    }
+}
+
+/**
+ * Start moving everything into a new array of new_size slots
+ */
+static int start_resize(struct hashtable *ht, int new_size)
+{
+    struct htslots next;
+
+    if (alloc_slots(&next, new_size) == -1) {
+        return -1;
+    }
+
+    ht->old = ht->cur;
+    ht->cur = next;
+    ht->size = new_size;
+    ht->rehash_pos = 0;
+    ht->load = (float)ht->num_entries / ht->size;
+
+    return 0;
+}
+
+/**
+ * Do a slice of any resize in progress, and start one if the load calls for it
+ *
+ * Called before every operation, so the cost of a resize is spread over the
+ * REHASH_GROUPS-sized steps of the operations that follow it.
+ *
+ * Returns 0, or -1 if the table needed to grow, couldn't, and is too full
+ * to take another entry.
+ */
+static int maintain(struct hashtable *ht)
+{
+    struct htslots *cur = &ht->cur;
+
+    if (ht->rehash_pos >= 0) {
+        rehash_step(ht, REHASH_GROUPS);
+
+        // Only odd load limits can fill the new array before the old one
+        // drains; if they do, finish the move now rather than overflow
+        if (ht->rehash_pos >= 0 &&
+            cur->num_full + cur->num_deleted + 1 > cur->size * MAX_GROW_LOAD) {
+            rehash_step(ht, ht->old.size / GROUP_SIZE);
+        }
+
+        if (ht->rehash_pos >= 0) {
+            return 0;
+        }
+    }
+
+    if (cur->num_full + cur->num_deleted + 1 > cur->size * ht->grow_load) {
+        // Mostly tombstones? Clean up at the same size instead of growing
+        int new_size = cur->num_deleted > cur->num_full ? cur->size : cur->size * DEFAULT_GROW_FACTOR;
+
+        // Out of memory: keep filling the current array, up to a point
+        if (start_resize(ht, new_size) == -1 &&
+            cur->num_full + cur->num_deleted + 1 > cur->size * MAX_GROW_LOAD) {
+            return -1;
+        }
+    } else if (cur->size > ht->min_size && cur->num_full < cur->size * ht->shrink_load) {
+        // Failing to shrink just leaves the table bigger than it needs to be
+        start_resize(ht, cur->size / DEFAULT_GROW_FACTOR);
+    }
+
+    return 0;
+}
+
+/**
+ * Find key in whichever array holds it
+ *
+ * Returns the entry, and the array it lives in through *where.
+ */
+static struct htent *lookup(struct hashtable *ht, void *key, int key_size, uint64_t hash,
+                            struct htslots **where, int *index)
+{
+    int i = find_slot(&ht->cur, key, key_size, hash);
+
+    if (i != -1) {
+        *where = &ht->cur;
+        *index = i;
+        return &ht->cur.slots[i];
+    }
+
+    if (ht->rehash_pos >= 0) {
+        i = find_slot(&ht->old, key, key_size, hash);
+
+        if (i != -1) {
+            *where = &ht->old;
+            *index = i;
+            return &ht->old.slots[i];
+        }
+    }
+
+    return NULL;
 }
 
 /**
  * Create a new hashtable
  */
-struct hashtable *hashtable_create(int size, int (*hashf)(void *, int, int))
+struct hashtable *hashtable_create(int size, uint64_t (*hashf)(const void *, int))
 {
     if (size < 1) {
         size = DEFAULT_SIZE;
@@ -100,27 +497,65 @@ struct hashtable *hashtable_create(int size, int (*hashf)(void *, int, int))
 
     if (ht == NULL) return NULL;
 
-    ht->size = size;
+    // Round up to a power-of-two number of groups
+    int slots = GROUP_SIZE;
+    while (slots < size) {
+        slots <<= 1;
+    }
+
+    if (alloc_slots(&ht->cur, slots) == -1) {
+        free(ht);
+        return NULL;
+    }
+
+    memset(&ht->old, 0, sizeof ht->old);
+    ht->size = slots;
+    ht->min_size = slots;
     ht->num_entries = 0;
     ht->load = 0;
-    ht->bucket = malloc(size * sizeof(struct llist *));
+    ht->grow_load = DEFAULT_GROW_LOAD;
+    ht->shrink_load = DEFAULT_SHRINK_LOAD;
+    ht->rehash_pos = -1;
     ht->hashf = hashf;
 
-    for (int i = 0; i < size; i++) {
-        ht->bucket[i] = llist_create();
-    }
-
     return ht;
 }
 
 /**
- * Free an htent
+ * Set the load factors at which the table grows and shrinks
+ *
+ * grow_load counts tombstones as well as entries. shrink_load of 0 never
+ * shrinks the table below its current size. The two must be far enough
+ * apart that a resize can't immediately trigger the opposite one.
+ *
+ * Returns 0 on success, -1 if the limits are out of range.
  */
-void htent_free(void *htent, void *arg)
+int hashtable_set_load_limits(struct hashtable *ht, float grow_load, float shrink_load)
 {
-	(void)arg;
+    const float factor = DEFAULT_GROW_FACTOR;
 
-	free(htent);
+    if (grow_load <= 0 || grow_load > MAX_GROW_LOAD ||
+        shrink_load < 0 || shrink_load * factor >= grow_load / factor) {
+        return -1;
+    }
+
+    ht->grow_load = grow_load;
+    ht->shrink_load = shrink_load;
+    ht->min_size = shrink_load == 0 ? ht->size : ht->min_size;
+
+    return 0;
+}
+
+/**
+ * Free the keys in one slot array
+ */
+static void free_keys(struct htslots *t)
+{
+    for (int i = 0; i < t->size; i++) {
+        if (t->ctrl[i] >= 0) {
+            free(t->slots[i].key);
+        }
+    }
 }
 
 /**
@@ -130,11 +565,12 @@ void htent_free(void *htent, void *arg)
  */
 void hashtable_destroy(struct hashtable *ht)
 {
-    for (int i = 0; i < ht->size; i++) {
-        struct llist *llist = ht->bucket[i];
+    free_keys(&ht->cur);
+    free_slots(&ht->cur);
 
-		llist_foreach(llist, htent_free, NULL);
-        llist_destroy(llist);
+    if (ht->rehash_pos >= 0) {
+        free_keys(&ht->old);
+        free_slots(&ht->old);
     }
 
     free(ht);
@@ -150,45 +586,54 @@ void *hashtable_put(struct hashtable *ht, char *key, void *data)
 
 /**
  * Put to hash table with a binary key
+ *
+ * If the key is already present its data is replaced.
  */
 void *hashtable_put_bin(struct hashtable *ht, void *key, int key_size, void *data)
 {
-    int index = ht->hashf(key, key_size, ht->size);
+    return hashtable_put_hashed(ht, key, key_size, hashtable_hash(ht, key, key_size), data);
+}
 
-    struct llist *llist = ht->bucket[index];
+/**
+ * Put to hash table with a binary key and its precomputed hashtable_hash()
+ *
+ * Returns data, or NULL if the key couldn't be stored.
+ */
+void *hashtable_put_hashed(struct hashtable *ht, void *key, int key_size, uint64_t hash, void *data)
+{
+    struct htslots *where;
+    int i;
+
+    int full = maintain(ht) == -1;
 
-    struct htent *ent = malloc(sizeof *ent);
-    ent->key = malloc(key_size);
-    memcpy(ent->key, key, key_size);
-    ent->key_size = key_size;
-    ent->hashed_key = index;
-    ent->data = data;
+    struct htent *ent = lookup(ht, key, key_size, hash, &where, &i);
+
+    if (ent != NULL) {
+        ent->data = data;
+        return data;
+    }
 
-    if (llist_append(llist, ent) == NULL) {
-        free(ent->key);
-        free(ent);
+    if (full) {
         return NULL;
     }
 
-    add_entry_count(ht, +1);
+    struct htent new_ent;
+    new_ent.key = malloc(key_size);
 
-    return data;
-}
+    if (new_ent.key == NULL) {
+        return NULL;
+    }
 
-/**
- * Comparison function for hashtable entries
- */
-int htcmp(void *a, void *b)
-{
-    struct htent *entA = a, *entB = b;
+    memcpy(new_ent.key, key, key_size);
+    new_ent.key_size = key_size;
+    new_ent.hash = hash;
+    new_ent.data = data;
 
-    int size_diff = entB->key_size - entA->key_size;
+    insert_slot(&ht->cur, &new_ent);
 
-    if (size_diff) {
-        return size_diff;
-    }
+    add_entry_count(ht, +1);
 
-    return memcmp(entA->key, entB->key, entA->key_size);
+    return data;
 }
 
 /**
@@ -204,19 +649,26 @@ void *hashtable_get(struct hashtable *ht, char *key)
  */
 void *hashtable_get_bin(struct hashtable *ht, void *key, int key_size)
 {
-    int index = ht->hashf(key, key_size, ht->size);
+    return hashtable_get_hashed(ht, key, key_size, hashtable_hash(ht, key, key_size));
+}
 
-    struct llist *llist = ht->bucket[index];
+/**
+ * Get from the hash table with a binary key and its precomputed hashtable_hash()
+ */
+void *hashtable_get_hashed(struct hashtable *ht, void *key, int key_size, uint64_t hash)
+{
+    struct htslots *where;
+    int i;
 
-    struct htent cmpent;
-    cmpent.key = key;
-    cmpent.key_size = key_size;
+    if (ht->rehash_pos >= 0) {
+        maintain(ht);
+    }
 
-    struct htent *n = llist_find(llist, &cmpent, htcmp);
+    struct htent *ent = lookup(ht, key, key_size, hash, &where, &i);
 
-    if (n == NULL) { return NULL; }
+    if (ent == NULL) { return NULL; }
 
-    return n->data;
+    return ent->data;
 }
 
 /**
@@ -234,38 +686,35 @@ void *hashtable_delete(struct hashtable *ht, char *key)
  */
 void *hashtable_delete_bin(struct hashtable *ht, void *key, int key_size)
 {
-    int index = ht->hashf(key, key_size, ht->size);
+    return hashtable_delete_hashed(ht, key, key_size, hashtable_hash(ht, key, key_size));
+}
 
-    struct llist *llist = ht->bucket[index];
+/**
+ * Delete by binary key and its precomputed hashtable_hash()
+ *
+ * NOTE: does *not* free the data--just free's the hash table entry
+ */
+void *hashtable_delete_hashed(struct hashtable *ht, void *key, int key_size, uint64_t hash)
+{
+    struct htslots *where;
+    int i;
 
-    struct htent cmpent;
-    cmpent.key = key;
-    cmpent.key_size = key_size;
+    maintain(ht);
 
-    struct htent *ent = llist_delete(llist, &cmpent, htcmp);
+    struct htent *ent = lookup(ht, key, key_size, hash, &where, &i);
 
-	if (ent == NULL) {
-		return NULL;
-	}
+    if (ent == NULL) {
+        return NULL;
+    }
 
-	void *data = ent->data;
+    void *data = ent->data;
 
-	free(ent);
+    free(ent->key);
+    clear_slot(where, i);
 
     add_entry_count(ht, -1);
 
-	return data;
-}
-
-/**
- * Foreach callback function
- */
-void foreach_callback(void *vent, void *vpayload)
-{
-	struct htent *ent = vent;
-	struct foreach_callback_payload *payload = vpayload;
-
-	payload->f(ent->data, payload->arg);
+    return data;
 }
 
 /**
@@ -275,14 +724,17 @@ void foreach_callback(void *vent, void *vpayload)
  */
 void hashtable_foreach(struct hashtable *ht, void (*f)(void *, void *), void *arg)
 {
-	struct foreach_callback_payload payload;
-
-	payload.f = f;
-	payload.arg = arg;
-
-	for (int i = 0; i < ht->size; i++) {
-		struct llist *llist = ht->bucket[i];
+    for (int i = 0; i < ht->cur.size; i++) {
+        if (ht->cur.ctrl[i] >= 0) {
+            f(ht->cur.slots[i].data, arg);
+        }
+    }
 
-		llist_foreach(llist, foreach_callback, &payload);
-	}
+    if (ht->rehash_pos >= 0) {
+        for (int i = ht->rehash_pos; i < ht->old.size; i++) {
+            if (ht->old.ctrl[i] >= 0) {
+                f(ht->old.slots[i].data, arg);
+            }
+        }
+    }
 }
@@ -1,22 +1,51 @@
 #ifndef _HASHTABLE_H_
 #define _HASHTABLE_H_
 
+#include <stdint.h>
+
+// Hash table entry, stored inline in the slot array
+struct htent {
+    void *key;
+    int key_size;
+    uint64_t hash; // Full hash, checked before the key itself
+    void *data;
+};
+
+// One slot array; the table has two of them while it is resizing
+struct htslots {
+    int size; // Number of slots
+    int num_full;
+    int num_deleted; // Tombstones still occupying slots
+    signed char *ctrl; // One control byte per slot, see hashtable.c
+    struct htent *slots;
+};
+
 struct hashtable {
-    int size; // Read-only
+    int size; // Read-only, number of slots
     int num_entries; // Read-only
     float load; // Read-only
-    struct llist **bucket;
-    int (*hashf)(void *data, int data_size, int bucket_count);
+    float grow_load; // See hashtable_set_load_limits()
+    float shrink_load;
+    int min_size; // Never shrink below this many slots
+    int rehash_pos; // Next old slot to migrate, -1 when not resizing
+    struct htslots cur, old;
+    uint64_t (*hashf)(const void *data, int data_size);
 };
 
-extern struct hashtable *hashtable_create(int size, int (*hashf)(void *, int, int));
+extern uint64_t default_hashf(const void *data, int data_size);
+extern struct hashtable *hashtable_create(int size, uint64_t (*hashf)(const void *, int));
 extern void hashtable_destroy(struct hashtable *ht);
+extern int hashtable_set_load_limits(struct hashtable *ht, float grow_load, float shrink_load);
 extern void *hashtable_put(struct hashtable *ht, char *key, void *data);
 extern void *hashtable_put_bin(struct hashtable *ht, void *key, int key_size, void *data);
+extern void *hashtable_put_hashed(struct hashtable *ht, void *key, int key_size, uint64_t hash, void *data);
 extern void *hashtable_get(struct hashtable *ht, char *key);
 extern void *hashtable_get_bin(struct hashtable *ht, void *key, int key_size);
+extern void *hashtable_get_hashed(struct hashtable *ht, void *key, int key_size, uint64_t hash);
 extern void *hashtable_delete(struct hashtable *ht, char *key);
 extern void *hashtable_delete_bin(struct hashtable *ht, void *key, int key_size);
+extern void *hashtable_delete_hashed(struct hashtable *ht, void *key, int key_size, uint64_t hash);
+extern uint64_t hashtable_hash(struct hashtable *ht, void *key, int key_size);
 extern void hashtable_foreach(struct hashtable *ht, void (*f)(void *, void *), void *arg);
 
 #endif
@@ -0,0 +1,115 @@
+/*
+
+Cached HTTP Date header
+
+Formatting a date for every response means time(), localtime() (which takes
+a lock inside glibc) and a printf. The header only changes once a second, so
+a timer thread formats the complete "Date: ...\r\n" line, RFC 7231
+IMF-fixdate, right after each second ticks over and publishes it with an
+atomic pointer swap. Responses just copy HTTP_DATE_LENGTH bytes.
+
+The line is written into a small ring of buffers, so a buffer is only
+rewritten seconds after it stopped being the current one and a reader that
+loaded the old pointer can still copy it out intact.
+
+Until http_date_start() runs (tools, tests), http_date_get() formats the
+date itself.
+
+*/
+
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "httpdate.h"
+
+#define DATE_RING_SIZE 4
+#define DATE_BUF_SIZE 64 // Room past HTTP_DATE_LENGTH for years beyond 9999
+
+static char date_ring[DATE_RING_SIZE][DATE_BUF_SIZE];
+static _Atomic(const char *) current_date;
+static __thread char fallback_date[DATE_BUF_SIZE];
+
+static const char *day_names[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+static const char *month_names[] = {
+    "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+};
+
+/**
+ * Format the Date header line for t into buf
+ *
+ * Doesn't use strftime(), so the result is the same in any locale.
+ */
+static void format_date(char *buf, time_t t)
+{
+    struct tm tm;
+
+    gmtime_r(&t, &tm);
+    snprintf(buf, DATE_BUF_SIZE, "Date: %s, %02d %s %04d %02d:%02d:%02d GMT\r\n",
+             day_names[tm.tm_wday], tm.tm_mday, month_names[tm.tm_mon], tm.tm_year + 1900,
+             tm.tm_hour, tm.tm_min, tm.tm_sec);
+}
+
+/**
+ * Timer thread: republish the date just after every second boundary
+ */
+static void *date_timer(void *arg)
+{
+    (void)arg;
+    int next = 1;
+
+    while (1) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+
+        // Sleep to the next second boundary
+        struct timespec pause = { 0, 1000000000L - now.tv_nsec };
+        while (nanosleep(&pause, &pause) == -1) {
+            // EINTR; sleep out the rest
+        }
+
+        format_date(date_ring[next], time(NULL));
+        atomic_store_explicit(&current_date, date_ring[next], memory_order_release);
+        next = (next + 1) % DATE_RING_SIZE;
+    }
+
+    return NULL;
+}
+
+/**
+ * Publish the current date and start the thread that keeps it current
+ *
+ * Return 0 on success, -1 on error.
+ */
+int http_date_start(void)
+{
+    pthread_t tid;
+
+    format_date(date_ring[0], time(NULL));
+    atomic_store_explicit(&current_date, date_ring[0], memory_order_release);
+
+    if (pthread_create(&tid, NULL, date_timer, NULL) != 0) {
+        perror("pthread_create date timer");
+        return -1;
+    }
+    pthread_detach(tid);
+
+    return 0;
+}
+
+/**
+ * Return the current "Date: ...\r\n" line, HTTP_DATE_LENGTH bytes long
+ *
+ * Copy it out straight away; the buffer is reused a few seconds later.
+ */
+const char *http_date_get(void)
+{
+    const char *date = atomic_load_explicit(&current_date, memory_order_acquire);
+
+    if (date == NULL) {
+        format_date(fallback_date, time(NULL));
+        return fallback_date;
+    }
+
+    return date;
+}
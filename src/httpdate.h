@@ -0,0 +1,10 @@
+#ifndef _HTTPDATE_H_
+#define _HTTPDATE_H_
+
+// "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+#define HTTP_DATE_LENGTH 37
+
+extern int http_date_start(void);
+extern const char *http_date_get(void);
+
+#endif
@@ -1,11 +1,52 @@
 #include <stdlib.h>
 #include "llist.h"
 
+#define NODE_SLAB_SIZE 64 // Nodes carved out of each slab allocation
+
 struct llist_node {
 	void *data;
 	struct llist_node *next;
 };
 
+// Per-thread free list of nodes, refilled a slab at a time. Slabs are
+// never returned to malloc; freed nodes are simply reused.
+static __thread struct llist_node *free_nodes;
+
+/**
+ * Get a node from the free list, refilling it from a new slab if empty
+ */
+static struct llist_node *node_alloc(void)
+{
+	if (free_nodes == NULL) {
+		struct llist_node *slab = malloc(NODE_SLAB_SIZE * sizeof *slab);
+
+		if (slab == NULL) {
+			return NULL;
+		}
+
+		for (int i = 0; i < NODE_SLAB_SIZE - 1; i++) {
+			slab[i].next = &slab[i + 1];
+		}
+		slab[NODE_SLAB_SIZE - 1].next = NULL;
+
+		free_nodes = slab;
+	}
+
+	struct llist_node *n = free_nodes;
+	free_nodes = n->next;
+
+	return n;
+}
+
+/**
+ * Put a node back on the free list
+ */
+static void node_free(struct llist_node *n)
+{
+	n->next = free_nodes;
+	free_nodes = n;
+}
+
 /**
  * Allocate a new linked list
  */
@@ -28,7 +69,7 @@ void llist_destroy(struct llist *llist)
 
 	while (n != NULL) {
 		next = n->next;
-		free(n);
+		node_free(n);
 
 		n = next;
 	}
@@ -41,7 +82,7 @@ void llist_destroy(struct llist *llist)
  */
 void *llist_insert(struct llist *llist, void *data)
 {
-	struct llist_node *n = calloc(1, sizeof *n);
+	struct llist_node *n = node_alloc();
 
 	if (n == NULL) {
 		return NULL;
@@ -51,6 +92,10 @@ void *llist_insert(struct llist *llist, void *data)
 	n->next = llist->head;
 	llist->head = n;
 
+	if (llist->tail == NULL) {
+		llist->tail = n;
+	}
+
 	llist->count++;
 
 	return data;
@@ -61,25 +106,21 @@ void *llist_insert(struct llist *llist, void *data)
  */
 void *llist_append(struct llist *llist, void *data)
 {
-	struct llist_node *tail = llist->head;
-
 	// If list is empty, just insert
-	if (tail == NULL) {
+	if (llist->tail == NULL) {
 		return llist_insert(llist, data);
 	}
 
-	struct llist_node *n = calloc(1, sizeof *n);
+	struct llist_node *n = node_alloc();
 
 	if (n == NULL) {
 		return NULL;
 	}
 
-	while (tail->next != NULL) {
-		tail = tail->next;
-	}
-
 	n->data = data;
-	tail->next = n;
+	n->next = NULL;
+	llist->tail->next = n;
+	llist->tail = n;
 
 	llist->count++;
 
@@ -103,17 +144,11 @@ void *llist_head(struct llist *llist)
  */
 void *llist_tail(struct llist *llist)
 {
-	struct llist_node *n = llist->head;
-
-	if (n == NULL) {
+	if (llist->tail == NULL) {
 		return NULL;
 	}
 
-	while (n->next != NULL) {
-		n = n->next;
-	}
-
-	return n->data;
+	return llist->tail->data;
 }
 
 /**
@@ -163,14 +198,18 @@ void *llist_delete(struct llist *llist, void *data, int (*cmpfn)(void *, void *)
 			if (prev == NULL) {
 				// Free the head
 				llist->head = n->next;
-				free(n);
 
 			} else {
 				// Free the non-head
 				prev->next = n->next;
-				free(n);
 			}
 
+			if (llist->tail == n) {
+				llist->tail = prev;
+			}
+
+			node_free(n);
+
 			llist->count--;
 
 			return data;
@@ -218,7 +257,7 @@ void **llist_array_get(struct llist *llist)
 		return NULL;
 	}
 
-	void **a = malloc(sizeof *a * llist->count + 1);
+	void **a = malloc(sizeof *a * (llist->count + 1));
 
 	struct llist_node *n;
 	int i;
@@ -241,3 +280,110 @@ void llist_array_free(void **a)
 {
 	free(a);
 }
+
+/**
+ * Initialize an empty intrusive list
+ */
+void ilist_init(struct ilist *ilist)
+{
+	ilist->head = ilist->tail = NULL;
+	ilist->count = 0;
+}
+
+/**
+ * Insert a link at the head of an intrusive list
+ */
+void ilist_insert(struct ilist *ilist, struct ilist_link *link)
+{
+	link->prev = NULL;
+	link->next = ilist->head;
+
+	if (ilist->head == NULL) {
+		ilist->tail = link;
+	} else {
+		ilist->head->prev = link;
+	}
+
+	ilist->head = link;
+	ilist->count++;
+}
+
+/**
+ * Append a link to the tail of an intrusive list
+ */
+void ilist_append(struct ilist *ilist, struct ilist_link *link)
+{
+	link->next = NULL;
+	link->prev = ilist->tail;
+
+	if (ilist->tail == NULL) {
+		ilist->head = link;
+	} else {
+		ilist->tail->next = link;
+	}
+
+	ilist->tail = link;
+	ilist->count++;
+}
+
+/**
+ * Unlink an element from an intrusive list
+ *
+ * NOTE: the link must be on this list
+ */
+void ilist_remove(struct ilist *ilist, struct ilist_link *link)
+{
+	if (link->prev == NULL) {
+		ilist->head = link->next;
+	} else {
+		link->prev->next = link->next;
+	}
+
+	if (link->next == NULL) {
+		ilist->tail = link->prev;
+	} else {
+		link->next->prev = link->prev;
+	}
+
+	link->prev = link->next = NULL;
+	ilist->count--;
+}
+
+/**
+ * Remove and return the first link, or NULL if the list is empty
+ */
+struct ilist_link *ilist_pop_head(struct ilist *ilist)
+{
+	struct ilist_link *link = ilist->head;
+
+	if (link != NULL) {
+		ilist_remove(ilist, link);
+	}
+
+	return link;
+}
+
+/**
+ * Remove and return the last link, or NULL if the list is empty
+ */
+struct ilist_link *ilist_pop_tail(struct ilist *ilist)
+{
+	struct ilist_link *link = ilist->tail;
+
+	if (link != NULL) {
+		ilist_remove(ilist, link);
+	}
+
+	return link;
+}
+
+/**
+ * Move a link that is already on the list to its head
+ */
+void ilist_move_to_head(struct ilist *ilist, struct ilist_link *link)
+{
+	if (ilist->head != link) {
+		ilist_remove(ilist, link);
+		ilist_insert(ilist, link);
+	}
+}
@@ -1,11 +1,36 @@
 #ifndef _LLIST_H_
 #define _LLIST_H_
 
+#include <stddef.h>
+
 struct llist {
-	struct llist_node *head;
+	struct llist_node *head, *tail;
+	int count;
+};
+
+/*
+ * Intrusive doubly-linked list
+ *
+ * The link lives inside the element, so inserting never allocates and
+ * getting from a link back to its element is pointer arithmetic:
+ *
+ *    struct job { int id; struct ilist_link link; };
+ *
+ *    ilist_append(&jobs, &j->link);
+ *    struct job *first = ilist_entry(jobs.head, struct job, link);
+ */
+struct ilist_link {
+	struct ilist_link *prev, *next;
+};
+
+struct ilist {
+	struct ilist_link *head, *tail;
 	int count;
 };
 
+#define ilist_entry(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+
 extern struct llist *llist_create(void);
 extern void llist_destroy(struct llist *llist);
 extern void *llist_insert(struct llist *llist, void *data);
@@ -19,5 +44,13 @@ extern void llist_foreach(struct llist *llist, void (*f)(void *, void *), void *
 extern void **llist_array_get(struct llist *llist);
 extern void llist_array_free(void **a);
 
+extern void ilist_init(struct ilist *ilist);
+extern void ilist_insert(struct ilist *ilist, struct ilist_link *link);
+extern void ilist_append(struct ilist *ilist, struct ilist_link *link);
+extern void ilist_remove(struct ilist *ilist, struct ilist_link *link);
+extern struct ilist_link *ilist_pop_head(struct ilist *ilist);
+extern struct ilist_link *ilist_pop_tail(struct ilist *ilist);
+extern void ilist_move_to_head(struct ilist *ilist, struct ilist_link *link);
+
 #endif
 
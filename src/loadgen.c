@@ -0,0 +1,546 @@
+/**
+ * loadgen.c -- HTTP load generator for benchmarking the server
+ *
+ * Usage:
+ *
+ *    ./loadgen [-h host] [-p port] [-c connections] [-d seconds] [-r rate]
+ *              [-k] [-m path:weight,path:weight...]
+ *
+ * -c  Concurrent connections (default 50)
+ * -d  How long to run, in seconds (default 10)
+ * -r  Open loop: send this many requests per second whether or not earlier
+ *     ones have finished, measuring latency from when each was due so a
+ *     stalled server can't hide it. Without -r the load is closed loop:
+ *     each connection sends its next request as soon as the last one ends.
+ * -k  Keep connections alive between requests (reconnecting whenever the
+ *     server closes them)
+ * -m  Paths to request and their relative weights (default /index.html:1)
+ *
+ * Everything runs on one thread around epoll. Results are printed as JSON.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define MAX_PATHS 32
+#define MAX_REQUEST 1024
+#define READ_BUFFER 65536
+#define MAX_EVENTS 256
+
+#define CONN_IDLE 0       // Not waiting on anything
+#define CONN_CONNECTING 1
+#define CONN_SENDING 2
+#define CONN_READING 3
+
+struct path_weight {
+    char *path;
+    int weight;
+};
+
+struct conn {
+    int fd; // -1 when not connected
+    int state;
+    char request[MAX_REQUEST];
+    int request_length;
+    int sent;
+    uint64_t started_ns; // When the request was due (open loop) or sent
+    char header[4096]; // Response header, until the blank line is seen
+    int header_length;
+    int header_done;
+    long content_length; // -1 if the server didn't say
+    long body_read;
+    int server_closes; // Response had "Connection: close"
+};
+
+// Options
+static char *host = "127.0.0.1";
+static char *port = "3490";
+static int num_conns = 50;
+static int duration = 10;
+static double rate = 0;
+static int keepalive = 0;
+static struct path_weight paths[MAX_PATHS];
+static int num_paths = 0;
+static int total_weight = 0;
+
+// State
+static int epfd;
+static struct addrinfo *server_addr;
+static struct conn *conns;
+static uint64_t *due; // Open loop: requests due but not yet sent, oldest first
+static int due_head, due_count, due_capacity;
+static unsigned int seed = 1;
+
+// Results
+static uint32_t *latencies; // Microseconds
+static long num_latencies, latencies_capacity;
+static long errors, connects;
+static unsigned long long bytes;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *xrealloc(void *p, size_t size)
+{
+    p = realloc(p, size);
+    if (p == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+
+    return p;
+}
+
+/**
+ * Parse "path:weight,path:weight..."; a missing weight is 1
+ */
+static void parse_mix(char *mix)
+{
+    char *save;
+
+    for (char *item = strtok_r(mix, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+        if (num_paths == MAX_PATHS) {
+            fprintf(stderr, "loadgen: at most %d paths\n", MAX_PATHS);
+            exit(1);
+        }
+        char *colon = strrchr(item, ':');
+        int weight = 1;
+        if (colon != NULL) {
+            *colon = '\0';
+            weight = atoi(colon + 1);
+        }
+        if (item[0] != '/' || weight <= 0) {
+            fprintf(stderr, "loadgen: bad path mix entry '%s'\n", item);
+            exit(1);
+        }
+        paths[num_paths].path = item;
+        paths[num_paths].weight = weight;
+        total_weight += weight;
+        num_paths++;
+    }
+}
+
+static char *pick_path(void)
+{
+    int r = rand_r(&seed) % total_weight;
+
+    for (int i = 0; i < num_paths; i++) {
+        r -= paths[i].weight;
+        if (r < 0) {
+            return paths[i].path;
+        }
+    }
+
+    return paths[num_paths - 1].path;
+}
+
+static void record_latency(uint64_t ns)
+{
+    if (num_latencies == latencies_capacity) {
+        latencies_capacity = latencies_capacity == 0 ? 65536 : latencies_capacity * 2;
+        latencies = xrealloc(latencies, latencies_capacity * sizeof *latencies);
+    }
+
+    latencies[num_latencies++] = ns / 1000;
+}
+
+static void conn_close(struct conn *c)
+{
+    if (c->fd != -1) {
+        close(c->fd);
+        c->fd = -1;
+    }
+    c->state = CONN_IDLE;
+}
+
+static void watch(struct conn *c, int op, uint32_t events)
+{
+    struct epoll_event ev;
+
+    ev.events = events;
+    ev.data.ptr = c;
+    if (epoll_ctl(epfd, op, c->fd, &ev) == -1) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+}
+
+/**
+ * Write as much of the request as the socket takes
+ *
+ * Return 0 when it's all gone, 1 if there's more, -1 on error.
+ */
+static int send_some(struct conn *c)
+{
+    while (c->sent < c->request_length) {
+        int rv = send(c->fd, c->request + c->sent, c->request_length - c->sent, MSG_NOSIGNAL);
+
+        if (rv < 0) {
+            if (errno == EAGAIN) {
+                return 1;
+            }
+            return -1;
+        }
+        c->sent += rv;
+    }
+
+    return 0;
+}
+
+/**
+ * Start a request on an idle connection, connecting first if needed
+ *
+ * started_ns is when the request counts as started.
+ */
+static void conn_start(struct conn *c, uint64_t started_ns)
+{
+    c->request_length = snprintf(c->request, sizeof c->request,
+                                 "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n\r\n",
+                                 pick_path(), host, keepalive ? "keep-alive" : "close");
+    c->sent = 0;
+    c->started_ns = started_ns;
+    c->header_length = 0;
+    c->header_done = 0;
+    c->content_length = -1;
+    c->body_read = 0;
+    c->server_closes = 0;
+
+    if (c->fd != -1) {
+        c->state = CONN_SENDING;
+        watch(c, EPOLL_CTL_MOD, EPOLLOUT);
+        return;
+    }
+
+    c->fd = socket(server_addr->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd == -1) {
+        perror("socket");
+        exit(1);
+    }
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    connects++;
+
+    if (connect(c->fd, server_addr->ai_addr, server_addr->ai_addrlen) == -1 &&
+        errno != EINPROGRESS) {
+        errors++;
+        close(c->fd);
+        c->fd = -1;
+        c->state = CONN_IDLE;
+        return;
+    }
+
+    c->state = CONN_CONNECTING;
+    watch(c, EPOLL_CTL_ADD, EPOLLOUT);
+}
+
+/**
+ * Look at a complete response header for Content-Length and Connection
+ */
+static void parse_header(struct conn *c)
+{
+    char *line = c->header;
+
+    while ((line = strstr(line, "\r\n")) != NULL) {
+        line += 2;
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            c->content_length = atol(line + 15);
+        } else if (strncasecmp(line, "Connection:", 11) == 0) {
+            c->server_closes = strstr(line, "close") != NULL &&
+                               strstr(line, "close") < strstr(line, "\r\n");
+        }
+    }
+}
+
+/**
+ * Consume response bytes
+ *
+ * Return 1 once the whole response is in, 0 if more is expected.
+ */
+static int take_response(struct conn *c, char *data, int length)
+{
+    bytes += length;
+
+    if (!c->header_done) {
+        int room = sizeof c->header - 1 - c->header_length;
+        int n = length < room ? length : room;
+
+        memcpy(c->header + c->header_length, data, n);
+        c->header_length += n;
+        c->header[c->header_length] = '\0';
+
+        char *end = strstr(c->header, "\r\n\r\n");
+        if (end == NULL) {
+            return 0;
+        }
+        *end = '\0';
+        c->header_done = 1;
+        parse_header(c);
+
+        // Whatever followed the blank line is body
+        int header_bytes = end + 4 - c->header - (c->header_length - n);
+        c->body_read = length - header_bytes;
+    } else {
+        c->body_read += length;
+    }
+
+    return c->content_length >= 0 && c->body_read >= c->content_length;
+}
+
+/**
+ * The current request on c finished, well or badly
+ */
+static void conn_done(struct conn *c, int ok, uint64_t now)
+{
+    if (ok) {
+        record_latency(now - c->started_ns);
+    } else {
+        errors++;
+    }
+
+    if (!ok || !keepalive || c->server_closes) {
+        conn_close(c);
+    } else {
+        c->state = CONN_IDLE;
+        watch(c, EPOLL_CTL_MOD, 0);
+    }
+}
+
+static void handle_event(struct conn *c, uint32_t events, uint64_t now)
+{
+    static char buf[READ_BUFFER];
+
+    if (c->state == CONN_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof err;
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0) {
+            conn_done(c, 0, now);
+            return;
+        }
+        c->state = CONN_SENDING;
+    }
+
+    if (c->state == CONN_SENDING) {
+        int rv = send_some(c);
+        if (rv == -1) {
+            conn_done(c, 0, now);
+        } else if (rv == 0) {
+            c->state = CONN_READING;
+            watch(c, EPOLL_CTL_MOD, EPOLLIN);
+        }
+        return;
+    }
+
+    if (c->state == CONN_READING && (events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+        while (1) {
+            int rv = recv(c->fd, buf, sizeof buf, 0);
+
+            if (rv > 0) {
+                if (take_response(c, buf, rv)) {
+                    conn_done(c, 1, now);
+                    return;
+                }
+                continue;
+            }
+            if (rv < 0 && errno == EAGAIN) {
+                return;
+            }
+            // EOF ends a response without a Content-Length; anything else is an error
+            c->server_closes = 1;
+            conn_done(c, rv == 0 && c->header_done && c->content_length < 0, now);
+            return;
+        }
+    }
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static uint32_t percentile(double p)
+{
+    if (num_latencies == 0) {
+        return 0;
+    }
+
+    long i = (long)(p * num_latencies);
+    if (i >= num_latencies) {
+        i = num_latencies - 1;
+    }
+
+    return latencies[i];
+}
+
+static void report(double elapsed)
+{
+    double mean = 0;
+
+    qsort(latencies, num_latencies, sizeof *latencies, compare_u32);
+    for (long i = 0; i < num_latencies; i++) {
+        mean += latencies[i];
+    }
+    if (num_latencies > 0) {
+        mean /= num_latencies;
+    }
+
+    printf("{\"mode\":\"%s\",\"rate\":%.0f,\"connections\":%d,\"keepalive\":%s,\"paths\":[",
+           rate > 0 ? "open" : "closed", rate, num_conns, keepalive ? "true" : "false");
+    for (int i = 0; i < num_paths; i++) {
+        printf("%s{\"path\":\"%s\",\"weight\":%d}", i > 0 ? "," : "", paths[i].path,
+               paths[i].weight);
+    }
+    printf("],\"duration_s\":%.3f,\"requests\":%ld,\"errors\":%ld,\"connects\":%ld,"
+           "\"throughput_rps\":%.1f,\"bytes\":%llu,"
+           "\"latency_us\":{\"mean\":%.1f,\"p50\":%u,\"p99\":%u,\"p999\":%u,\"max\":%u}}\n",
+           elapsed, num_latencies, errors, connects, num_latencies / elapsed, bytes, mean,
+           percentile(0.50), percentile(0.99), percentile(0.999),
+           num_latencies > 0 ? latencies[num_latencies - 1] : 0);
+}
+
+/**
+ * Open loop: queue up every request that has come due
+ */
+static void schedule(uint64_t *next_due, uint64_t interval, uint64_t now)
+{
+    while (*next_due <= now) {
+        if (due_count == due_capacity) {
+            // Grow, unwrapping the ring into the new array
+            int capacity = due_capacity == 0 ? 1024 : due_capacity * 2;
+            uint64_t *grown = xrealloc(NULL, capacity * sizeof *grown);
+            for (int i = 0; i < due_count; i++) {
+                grown[i] = due[(due_head + i) % due_capacity];
+            }
+            free(due);
+            due = grown;
+            due_head = 0;
+            due_capacity = capacity;
+        }
+        due[(due_head + due_count) % due_capacity] = *next_due;
+        due_count++;
+        *next_due += interval;
+    }
+}
+
+/**
+ * Main
+ */
+int main(int argc, char **argv)
+{
+    struct addrinfo hints;
+    struct epoll_event events[MAX_EVENTS];
+    int opt;
+
+    while ((opt = getopt(argc, argv, "h:p:c:d:r:km:")) != -1) {
+        switch (opt) {
+        case 'h': host = optarg; break;
+        case 'p': port = optarg; break;
+        case 'c': num_conns = atoi(optarg); break;
+        case 'd': duration = atoi(optarg); break;
+        case 'r': rate = atof(optarg); break;
+        case 'k': keepalive = 1; break;
+        case 'm': parse_mix(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-h host] [-p port] [-c connections] [-d seconds] "
+                    "[-r rate] [-k] [-m path:weight,...]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (num_paths == 0) {
+        char default_mix[] = "/index.html:1";
+        parse_mix(strdup(default_mix));
+    }
+    if (num_conns <= 0 || duration <= 0) {
+        fprintf(stderr, "loadgen: connections and duration must be positive\n");
+        exit(1);
+    }
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int rv = getaddrinfo(host, port, &hints, &server_addr);
+    if (rv != 0) {
+        fprintf(stderr, "loadgen: %s: %s\n", host, gai_strerror(rv));
+        exit(1);
+    }
+
+    epfd = epoll_create1(0);
+    if (epfd == -1) {
+        perror("epoll_create1");
+        exit(1);
+    }
+
+    conns = calloc(num_conns, sizeof *conns);
+    if (conns == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for (int i = 0; i < num_conns; i++) {
+        conns[i].fd = -1;
+    }
+
+    uint64_t start = now_ns();
+    uint64_t end = start + (uint64_t)duration * 1000000000;
+    uint64_t interval = rate > 0 ? (uint64_t)(1e9 / rate) : 0;
+    uint64_t next_due = start;
+    uint64_t now = start;
+
+    while (now < end) {
+        if (rate > 0) {
+            schedule(&next_due, interval, now);
+        }
+
+        // Put idle connections to work
+        for (int i = 0; i < num_conns; i++) {
+            if (conns[i].state != CONN_IDLE) {
+                continue;
+            }
+            if (rate == 0) {
+                conn_start(&conns[i], now);
+            } else if (due_count > 0) {
+                conn_start(&conns[i], due[due_head]);
+                due_head = (due_head + 1) % due_capacity;
+                due_count--;
+            }
+        }
+
+        int timeout = 100;
+        if (rate > 0) {
+            timeout = next_due > now ? (int)((next_due - now) / 1000000) : 0;
+        }
+        int n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+        if (n == -1 && errno != EINTR) {
+            perror("epoll_wait");
+            exit(1);
+        }
+
+        now = now_ns();
+        for (int i = 0; i < n; i++) {
+            handle_event(events[i].data.ptr, events[i].events, now);
+        }
+    }
+
+    report((now - start) / 1e9);
+
+    return 0;
+}
@@ -0,0 +1,405 @@
+/*
+
+Asynchronous logging
+
+Every thread that logs gets its own ring of LOG_RING_SIZE fixed-size
+records. log_write() formats the message straight into the next free record
+and bumps the ring's tail; it never takes a lock or makes a system call. If
+the ring is full the message is dropped and counted rather than waiting for
+the writer.
+
+A background writer thread drains all the rings every LOG_FLUSH_INTERVAL_MS
+into one buffer and write()s it out. Messages from one thread stay in order;
+messages from different threads are only roughly ordered.
+
+Besides text, a ring can carry fixed-size binary records for another
+channel; the writer hands those to the channel's sink function instead of
+formatting anything (see accesslog.c). Sinks only ever run on one thread at
+a time. Records that mustn't be lost go through log_write_record_wait():
+if the ring is full, the producer drains the rings itself instead of
+dropping the record. Drops are counted and reported per channel.
+
+A thread's ring goes back on the shelf when the thread exits, and the next
+new thread picks it up; rings are never freed.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "log.h"
+
+#define LOG_FLUSH_INTERVAL_MS 10
+#define LOG_WRITE_BUFFER 65536
+
+struct log_record {
+    int length;
+    int channel;
+    char text[LOG_RECORD_MAX_DATA]; // Or binary data for other channels
+};
+
+// Single producer (the owning thread), single consumer (the writer)
+struct log_ring {
+    atomic_uint head; // Next record to write out
+    atomic_uint tail; // Next record to fill
+    atomic_int in_use; // Owned by a live thread
+    atomic_ulong dropped[LOG_NUM_CHANNELS]; // Records lost to a full ring, by channel
+    struct log_ring *next; // All rings ever made
+    struct log_record records[LOG_RING_SIZE];
+};
+
+static _Atomic(struct log_ring *) rings;
+static __thread struct log_ring *thread_ring;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+#ifdef LOG_ENABLE_DEBUG
+static atomic_int log_level = LOG_DEBUG;
+#else
+static atomic_int log_level = LOG_INFO;
+#endif
+static int log_fd = -1;
+static void (*sinks[LOG_NUM_CHANNELS])(const void *data, int length);
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER; // One consumer at a time
+
+static const char *level_names[] = { "ERROR", "WARN", "INFO", "DEBUG" };
+static const char *channel_names[] = { "messages", "access records", "trace records" };
+
+/**
+ * Thread exit: hand the ring to the next thread that needs one
+ */
+static void ring_release(void *arg)
+{
+    struct log_ring *ring = arg;
+
+    atomic_store(&ring->in_use, 0);
+}
+
+static void make_ring_key(void)
+{
+    pthread_key_create(&ring_key, ring_release);
+}
+
+/**
+ * Return this thread's ring, reusing or making one on first use
+ */
+static struct log_ring *get_ring(void)
+{
+    struct log_ring *ring = thread_ring;
+
+    if (ring != NULL) {
+        return ring;
+    }
+
+    pthread_once(&ring_key_once, make_ring_key);
+
+    for (ring = atomic_load(&rings); ring != NULL; ring = ring->next) {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&ring->in_use, &expected, 1)) {
+            break;
+        }
+    }
+
+    if (ring == NULL) {
+        ring = calloc(1, sizeof *ring);
+        if (ring == NULL) {
+            return NULL;
+        }
+        atomic_store(&ring->in_use, 1);
+
+        ring->next = atomic_load(&rings);
+        while (!atomic_compare_exchange_weak(&rings, &ring->next, ring)) {
+            // ring->next now holds the new head; try again
+        }
+    }
+
+    pthread_setspecific(ring_key, ring);
+    thread_ring = ring;
+
+    return ring;
+}
+
+/**
+ * Write all of buf to the log fd
+ */
+static void write_out(const char *buf, int len)
+{
+    while (len > 0) {
+        int rv = write(log_fd, buf, len);
+
+        if (rv < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return; // Nowhere left to report it
+        }
+
+        buf += rv;
+        len -= rv;
+    }
+}
+
+/**
+ * Write out everything queued in every ring
+ *
+ * Return the number of records handled, text or binary.
+ */
+static int drain(void)
+{
+    static char buf[LOG_WRITE_BUFFER]; // Only touched under drain_lock
+    int used = 0;
+    int records = 0;
+
+    for (struct log_ring *ring = atomic_load(&rings); ring != NULL; ring = ring->next) {
+        unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+        for (int channel = 0; channel < LOG_NUM_CHANNELS; channel++) {
+            unsigned long dropped = atomic_exchange(&ring->dropped[channel], 0);
+
+            if (dropped > 0) {
+                if (used + LOG_RECORD_SIZE > LOG_WRITE_BUFFER) {
+                    write_out(buf, used);
+                    used = 0;
+                }
+                used += snprintf(buf + used, LOG_RECORD_SIZE, "WARN log: dropped %lu %s\n",
+                                 dropped, channel_names[channel]);
+            }
+        }
+
+        for (; head != tail; head++) {
+            struct log_record *rec = &ring->records[head & (LOG_RING_SIZE - 1)];
+
+            records++;
+            if (rec->channel != LOG_CHANNEL_TEXT) {
+                if (sinks[rec->channel] != NULL) {
+                    sinks[rec->channel](rec->text, rec->length);
+                }
+                continue;
+            }
+
+            if (used + LOG_RECORD_SIZE > LOG_WRITE_BUFFER) {
+                write_out(buf, used);
+                used = 0;
+            }
+            memcpy(buf + used, rec->text, rec->length);
+            used += rec->length;
+        }
+
+        // Hand the records back to the producer
+        atomic_store_explicit(&ring->head, head, memory_order_release);
+
+        if (used + LOG_RECORD_SIZE > LOG_WRITE_BUFFER) {
+            write_out(buf, used);
+            used = 0;
+        }
+    }
+
+    write_out(buf, used);
+
+    return records;
+}
+
+/**
+ * Writer thread: drain the rings, sleeping when there's nothing to do
+ */
+static void *log_writer(void *arg)
+{
+    (void)arg;
+    struct timespec pause = { 0, LOG_FLUSH_INTERVAL_MS * 1000000L };
+
+    while (1) {
+        pthread_mutex_lock(&drain_lock);
+        int records = drain();
+        pthread_mutex_unlock(&drain_lock);
+
+        if (records == 0) {
+            nanosleep(&pause, NULL);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Start the background writer, sending log lines to fd
+ *
+ * Messages logged before this are kept (up to a ring's worth per thread)
+ * and written once it starts.
+ *
+ * Return 0 on success, -1 on error.
+ */
+int log_start(int fd)
+{
+    pthread_t tid;
+
+    log_fd = fd;
+
+    if (pthread_create(&tid, NULL, log_writer, NULL) != 0) {
+        perror("pthread_create log writer");
+        return -1;
+    }
+    pthread_detach(tid);
+
+    return 0;
+}
+
+/**
+ * Drop messages less important than level
+ */
+void log_set_level(int level)
+{
+    atomic_store_explicit(&log_level, level, memory_order_relaxed);
+}
+
+/**
+ * Send a channel's binary records to sink, or drop them if sink is NULL
+ *
+ * Once this returns, the old sink is no longer running or called.
+ */
+void log_set_sink(int channel, void (*sink)(const void *data, int length))
+{
+    pthread_mutex_lock(&drain_lock);
+    sinks[channel] = sink;
+    pthread_mutex_unlock(&drain_lock);
+}
+
+/**
+ * Claim the calling thread's next free record for channel
+ *
+ * If the ring is full, either drain the rings from this thread until
+ * there's room (wait) or count a drop and return NULL.
+ */
+static struct log_record *record_claim(int channel, int wait, struct log_ring **ringp,
+                                       unsigned int *tailp)
+{
+    struct log_ring *ring = get_ring();
+    if (ring == NULL) {
+        return NULL;
+    }
+
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    while (tail - head == LOG_RING_SIZE) {
+        if (!wait || log_fd < 0) {
+            atomic_fetch_add_explicit(&ring->dropped[channel], 1, memory_order_relaxed);
+            return NULL;
+        }
+        // The writer has fallen a whole ring behind; catch up for it
+        pthread_mutex_lock(&drain_lock);
+        drain();
+        pthread_mutex_unlock(&drain_lock);
+        head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    }
+
+    *ringp = ring;
+    *tailp = tail;
+
+    return &ring->records[tail & (LOG_RING_SIZE - 1)];
+}
+
+/**
+ * Queue a log line; never blocks
+ *
+ * A newline is added to the end of the message.
+ */
+void log_write(int level, const char *fmt, ...)
+{
+    if (level > atomic_load_explicit(&log_level, memory_order_relaxed)) {
+        return;
+    }
+
+    struct log_ring *ring;
+    unsigned int tail;
+    struct log_record *rec = record_claim(LOG_CHANNEL_TEXT, 0, &ring, &tail);
+    if (rec == NULL) {
+        return;
+    }
+
+    const int room = sizeof rec->text - 1; // Keep one byte for the newline
+    va_list ap;
+
+    int length = snprintf(rec->text, room, "%s ", level_names[level]);
+    va_start(ap, fmt);
+    length += vsnprintf(rec->text + length, room - length, fmt, ap);
+    va_end(ap);
+
+    if (length >= room) {
+        length = room - 1; // Truncated
+    }
+    rec->text[length++] = '\n';
+    rec->length = length;
+    rec->channel = LOG_CHANNEL_TEXT;
+
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+/**
+ * Queue a binary record of at most LOG_RECORD_MAX_DATA bytes
+ */
+static int write_record(int channel, int wait, const void *data, int length)
+{
+    struct log_ring *ring;
+    unsigned int tail;
+
+    if (length > LOG_RECORD_MAX_DATA) {
+        return -1;
+    }
+
+    struct log_record *rec = record_claim(channel, wait, &ring, &tail);
+    if (rec == NULL) {
+        return -1;
+    }
+
+    memcpy(rec->text, data, length);
+    rec->length = length;
+    rec->channel = channel;
+
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+
+    return 0;
+}
+
+/**
+ * Queue a binary record of at most LOG_RECORD_MAX_DATA bytes; never blocks
+ *
+ * Return 0 on success, -1 if it was dropped.
+ */
+int log_write_record(int channel, const void *data, int length)
+{
+    return write_record(channel, 0, data, length);
+}
+
+/**
+ * Queue a binary record, writing out the rings first if this thread's is full
+ *
+ * Only drops the record if logging hasn't started. Must not be called from
+ * a sink.
+ *
+ * Return 0 on success, -1 if it was dropped.
+ */
+int log_write_record_wait(int channel, const void *data, int length)
+{
+    return write_record(channel, 1, data, length);
+}
+
+/**
+ * Write out everything queued so far, from the calling thread
+ */
+void log_flush(void)
+{
+    if (log_fd < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&drain_lock);
+    drain();
+    pthread_mutex_unlock(&drain_lock);
+}
@@ -0,0 +1,40 @@
+#ifndef _LOG_H_
+#define _LOG_H_
+
+#define LOG_ERROR 0
+#define LOG_WARN 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3
+
+#define LOG_RING_SIZE 256   // Records per thread, a power of two
+#define LOG_RECORD_SIZE 256 // Longer messages are truncated
+#define LOG_RECORD_MAX_DATA (LOG_RECORD_SIZE - 2 * (int)sizeof(int)) // Per record
+
+// Where a record goes: text lines to the log fd, binary records to a sink
+#define LOG_CHANNEL_TEXT 0
+#define LOG_CHANNEL_ACCESS 1 // See accesslog.c
+#define LOG_CHANNEL_TRACE 2 // See trace.c
+#define LOG_NUM_CHANNELS 3
+
+extern int log_start(int fd);
+extern void log_set_level(int level);
+extern void log_set_sink(int channel, void (*sink)(const void *data, int length));
+extern void log_write(int level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+extern int log_write_record(int channel, const void *data, int length);
+extern int log_write_record_wait(int channel, const void *data, int length);
+extern void log_flush(void);
+
+#define log_error(...) log_write(LOG_ERROR, __VA_ARGS__)
+#define log_warn(...) log_write(LOG_WARN, __VA_ARGS__)
+#define log_info(...) log_write(LOG_INFO, __VA_ARGS__)
+
+// Debug logging costs nothing unless built with -DLOG_ENABLE_DEBUG; the
+// arguments are still type checked
+#ifdef LOG_ENABLE_DEBUG
+#define log_debug(...) log_write(LOG_DEBUG, __VA_ARGS__)
+#else
+#define log_debug(...) do { if (0) log_write(LOG_DEBUG, __VA_ARGS__); } while (0)
+#endif
+
+#endif
@@ -0,0 +1,161 @@
+/**
+ * logdecode.c -- Print binary access logs as text or JSON
+ *
+ * Usage:
+ *
+ *    ./logdecode [-j] ./access.log [./access.log.1 ...]
+ *
+ * Text is one line per request; -j prints one JSON object per line instead.
+ * See accesslog.h for the record layout.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include "accesslog.h"
+
+static const char *method_names[] = { "OTHER", "GET", "POST", "HEAD" };
+
+/**
+ * Format the record's time as an RFC 3339 UTC timestamp with microseconds
+ */
+static void format_time(uint64_t time_ns, char *buf, int size)
+{
+    time_t t = time_ns / 1000000000;
+    struct tm tm;
+    char date[32];
+
+    gmtime_r(&t, &tm);
+    strftime(date, sizeof date, "%Y-%m-%dT%H:%M:%S", &tm);
+    snprintf(buf, size, "%s.%06luZ", date, (unsigned long)(time_ns % 1000000000 / 1000));
+}
+
+static const char *cache_name(int flags)
+{
+    if (flags & ACCESS_CACHE_HIT) {
+        return "hit";
+    }
+    if (flags & ACCESS_CACHE_MISS) {
+        return "miss";
+    }
+    return "-";
+}
+
+/**
+ * Print s as a JSON string
+ */
+static void print_json_string(const char *s)
+{
+    putchar('"');
+    for (; *s != '\0'; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            printf("\\%c", c);
+        } else if (c < 0x20) {
+            printf("\\u%04x", c);
+        } else {
+            putchar(c);
+        }
+    }
+    putchar('"');
+}
+
+static void print_record(struct access_record *rec, int json)
+{
+    char when[64];
+    char addr[INET6_ADDRSTRLEN] = "-";
+    char path[ACCESS_PATH_SIZE + 1];
+    const char *method = rec->method < 4 ? method_names[rec->method] : "OTHER";
+
+    format_time(rec->time_ns, when, sizeof when);
+    if (rec->family == AF_INET || rec->family == AF_INET6) {
+        inet_ntop(rec->family, rec->addr, addr, sizeof addr);
+    }
+    memcpy(path, rec->path, ACCESS_PATH_SIZE);
+    path[ACCESS_PATH_SIZE] = '\0';
+
+    if (json) {
+        printf("{\"time\":\"%s\",\"addr\":\"%s\",\"fd\":%d,\"method\":\"%s\",\"path\":", when, addr,
+               rec->fd, method);
+        print_json_string(path);
+        printf(",\"status\":%u,\"bytes\":%llu,\"cache\":\"%s\",\"bundle\":%s,"
+               "\"queue_us\":%u,\"read_us\":%u,\"handle_us\":%u,\"send_us\":%u}\n",
+               rec->status, (unsigned long long)rec->bytes, cache_name(rec->flags),
+               (rec->flags & ACCESS_BUNDLE) ? "true" : "false",
+               rec->phase_us[ACCESS_PHASE_QUEUE], rec->phase_us[ACCESS_PHASE_READ],
+               rec->phase_us[ACCESS_PHASE_HANDLE], rec->phase_us[ACCESS_PHASE_SEND]);
+    } else {
+        printf("%s %s fd=%d %s %s %u %llu cache=%s%s queue=%uus read=%uus handle=%uus send=%uus\n",
+               when, addr, rec->fd, method, path[0] != '\0' ? path : "-", rec->status,
+               (unsigned long long)rec->bytes, cache_name(rec->flags),
+               (rec->flags & ACCESS_BUNDLE) ? " bundle" : "",
+               rec->phase_us[ACCESS_PHASE_QUEUE], rec->phase_us[ACCESS_PHASE_READ],
+               rec->phase_us[ACCESS_PHASE_HANDLE], rec->phase_us[ACCESS_PHASE_SEND]);
+    }
+}
+
+/**
+ * Print every record in one log file
+ *
+ * Return 0 on success, -1 if the file isn't a readable access log.
+ */
+static int decode(char *filename, int json)
+{
+    struct access_log_header header;
+    struct access_record rec;
+    FILE *fp = fopen(filename, "rb");
+
+    if (fp == NULL) {
+        perror(filename);
+        return -1;
+    }
+
+    if (fread(&header, sizeof header, 1, fp) != 1 || header.magic != ACCESS_LOG_MAGIC) {
+        fprintf(stderr, "%s: not an access log\n", filename);
+        fclose(fp);
+        return -1;
+    }
+    if (header.version != ACCESS_LOG_VERSION || header.record_size != sizeof rec) {
+        fprintf(stderr, "%s: unsupported version %u\n", filename, header.version);
+        fclose(fp);
+        return -1;
+    }
+
+    for (uint64_t i = 0; i < header.count && fread(&rec, sizeof rec, 1, fp) == 1; i++) {
+        print_record(&rec, json);
+    }
+
+    fclose(fp);
+
+    return 0;
+}
+
+/**
+ * Main
+ */
+int main(int argc, char **argv)
+{
+    int json = 0;
+    int first = 1;
+    int rv = 0;
+
+    if (argc > 1 && strcmp(argv[1], "-j") == 0) {
+        json = 1;
+        first = 2;
+    }
+
+    if (first >= argc) {
+        fprintf(stderr, "usage: %s [-j] access.log...\n", argv[0]);
+        exit(1);
+    }
+
+    for (int i = first; i < argc; i++) {
+        if (decode(argv[i], json) == -1) {
+            rv = 1;
+        }
+    }
+
+    return rv;
+}
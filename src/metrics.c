@@ -0,0 +1,309 @@
+/*
+
+Request metrics in Prometheus text format
+
+Each thread counts into its own shard, so recording a request is a handful
+of uncontended stores with no locks or atomic read-modify-writes; only the
+owning thread ever writes a shard. metrics_format() sums all the shards
+when /metrics is scraped. Like the log rings, a shard is handed to the next
+new thread when its owner exits, and its counts carry on.
+
+Latencies go into HDR-style log-linear histograms, so the relative error
+is at most 25% from a microsecond up to about a minute, in a fixed number
+of buckets.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "metrics.h"
+
+struct histogram {
+    atomic_ulong buckets[METRICS_HIST_BUCKETS];
+    atomic_ulong sum_us;
+};
+
+struct metrics_shard {
+    atomic_ulong requests[METRICS_MAX_STATUS];
+    atomic_ulong bytes;
+    atomic_ulong cache_hits;
+    atomic_ulong cache_misses;
+    struct histogram first_byte; // Accept to the first response byte
+    struct histogram total; // Accept to the end of the response
+    atomic_int in_use;
+    struct metrics_shard *next; // All shards ever made
+};
+
+static _Atomic(struct metrics_shard *) shards;
+static __thread struct metrics_shard *thread_shard;
+static pthread_key_t shard_key;
+static pthread_once_t shard_key_once = PTHREAD_ONCE_INIT;
+
+static void shard_release(void *arg)
+{
+    struct metrics_shard *shard = arg;
+
+    atomic_store(&shard->in_use, 0);
+}
+
+static void make_shard_key(void)
+{
+    pthread_key_create(&shard_key, shard_release);
+}
+
+/**
+ * Return this thread's shard, reusing or making one on first use
+ */
+static struct metrics_shard *get_shard(void)
+{
+    struct metrics_shard *shard = thread_shard;
+
+    if (shard != NULL) {
+        return shard;
+    }
+
+    pthread_once(&shard_key_once, make_shard_key);
+
+    for (shard = atomic_load(&shards); shard != NULL; shard = shard->next) {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&shard->in_use, &expected, 1)) {
+            break;
+        }
+    }
+
+    if (shard == NULL) {
+        shard = calloc(1, sizeof *shard);
+        if (shard == NULL) {
+            return NULL;
+        }
+        atomic_store(&shard->in_use, 1);
+
+        shard->next = atomic_load(&shards);
+        while (!atomic_compare_exchange_weak(&shards, &shard->next, shard)) {
+            // shard->next now holds the new head; try again
+        }
+    }
+
+    pthread_setspecific(shard_key, shard);
+    thread_shard = shard;
+
+    return shard;
+}
+
+/**
+ * Add to a counter only the calling thread writes
+ *
+ * A plain load and store, no locked instruction; the scraper may read it
+ * at any time and sees either the old or the new value.
+ */
+static inline void counter_add(atomic_ulong *c, unsigned long n)
+{
+    unsigned long v = atomic_load_explicit(c, memory_order_relaxed);
+
+    atomic_store_explicit(c, v + n, memory_order_relaxed);
+}
+
+/**
+ * Bucket for a latency in microseconds
+ */
+static int hist_index(uint64_t us)
+{
+    if (us < METRICS_HIST_SUB) {
+        return us;
+    }
+
+    int e = 63 - __builtin_clzll(us); // us is in [2^e, 2^(e+1))
+    if (e >= METRICS_HIST_MAX_EXP) {
+        return METRICS_HIST_BUCKETS - 1;
+    }
+
+    return (e - 1) * METRICS_HIST_SUB + ((us >> (e - 2)) & (METRICS_HIST_SUB - 1));
+}
+
+/**
+ * Largest latency, in microseconds, that falls in bucket i
+ */
+static uint64_t hist_upper(int i)
+{
+    if (i < METRICS_HIST_SUB) {
+        return i;
+    }
+
+    int e = i / METRICS_HIST_SUB + 1;
+    uint64_t lower = (uint64_t)(METRICS_HIST_SUB + i % METRICS_HIST_SUB) << (e - 2);
+
+    return lower + ((uint64_t)1 << (e - 2)) - 1;
+}
+
+static void hist_record(struct histogram *h, uint64_t us)
+{
+    counter_add(&h->buckets[hist_index(us)], 1);
+    counter_add(&h->sum_us, us);
+}
+
+/**
+ * Count a finished request
+ *
+ * status is 0 if no response was sent; first_byte_us is ignored then.
+ */
+void metrics_request(int status, uint64_t bytes, int cache_hit, int cache_miss,
+                     uint64_t first_byte_us, uint64_t total_us)
+{
+    struct metrics_shard *shard = get_shard();
+
+    if (shard == NULL) {
+        return;
+    }
+    if (status < 0 || status >= METRICS_MAX_STATUS) {
+        status = 0;
+    }
+
+    counter_add(&shard->requests[status], 1);
+    counter_add(&shard->bytes, bytes);
+    if (cache_hit) {
+        counter_add(&shard->cache_hits, 1);
+    }
+    if (cache_miss) {
+        counter_add(&shard->cache_misses, 1);
+    }
+    if (status != 0) {
+        hist_record(&shard->first_byte, first_byte_us);
+    }
+    hist_record(&shard->total, total_us);
+}
+
+// Appends formatted text to a fixed buffer, remembering if it ran out
+struct out {
+    char *buf;
+    int size;
+    int length;
+};
+
+static void out_printf(struct out *out, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void out_printf(struct out *out, const char *fmt, ...)
+{
+    va_list ap;
+
+    if (out->length >= out->size) {
+        return;
+    }
+
+    va_start(ap, fmt);
+    out->length += vsnprintf(out->buf + out->length, out->size - out->length, fmt, ap);
+    va_end(ap);
+}
+
+/**
+ * Sum a histogram over all shards and print it
+ */
+static void format_histogram(struct out *out, const char *name, const char *help,
+                             size_t offset)
+{
+    unsigned long buckets[METRICS_HIST_BUCKETS] = {0};
+    unsigned long sum_us = 0, count = 0;
+
+    for (struct metrics_shard *s = atomic_load(&shards); s != NULL; s = s->next) {
+        struct histogram *h = (struct histogram *)((char *)s + offset);
+        for (int i = 0; i < METRICS_HIST_BUCKETS; i++) {
+            buckets[i] += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+        }
+        sum_us += atomic_load_explicit(&h->sum_us, memory_order_relaxed);
+    }
+
+    out_printf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    for (int i = 0; i < METRICS_HIST_BUCKETS - 1; i++) {
+        count += buckets[i];
+        out_printf(out, "%s_bucket{le=\"%.6f\"} %lu\n", name, hist_upper(i) / 1e6, count);
+    }
+    count += buckets[METRICS_HIST_BUCKETS - 1];
+    out_printf(out, "%s_bucket{le=\"+Inf\"} %lu\n", name, count);
+    out_printf(out, "%s_sum %.6f\n%s_count %lu\n", name, sum_us / 1e6, name, count);
+}
+
+/**
+ * Print every metric into buf in Prometheus text format
+ *
+ * Return the length, or -1 if it didn't fit.
+ */
+int metrics_format(char *buf, int size, struct metrics_gauges *gauges)
+{
+    struct out out = { buf, size, 0 };
+    unsigned long requests[METRICS_MAX_STATUS] = {0};
+    unsigned long bytes = 0, hits = 0, misses = 0;
+
+    for (struct metrics_shard *s = atomic_load(&shards); s != NULL; s = s->next) {
+        for (int i = 0; i < METRICS_MAX_STATUS; i++) {
+            requests[i] += atomic_load_explicit(&s->requests[i], memory_order_relaxed);
+        }
+        bytes += atomic_load_explicit(&s->bytes, memory_order_relaxed);
+        hits += atomic_load_explicit(&s->cache_hits, memory_order_relaxed);
+        misses += atomic_load_explicit(&s->cache_misses, memory_order_relaxed);
+    }
+
+    out_printf(&out, "# HELP webserver_requests_total Requests by response status, 0 if none was sent\n"
+                     "# TYPE webserver_requests_total counter\n");
+    for (int i = 0; i < METRICS_MAX_STATUS; i++) {
+        if (requests[i] != 0) {
+            out_printf(&out, "webserver_requests_total{status=\"%d\"} %lu\n", i, requests[i]);
+        }
+    }
+
+    out_printf(&out, "# HELP webserver_sent_bytes_total Response bytes sent, headers included\n"
+                     "# TYPE webserver_sent_bytes_total counter\n"
+                     "webserver_sent_bytes_total %lu\n", bytes);
+    out_printf(&out, "# HELP webserver_cache_hits_total File cache hits\n"
+                     "# TYPE webserver_cache_hits_total counter\n"
+                     "webserver_cache_hits_total %lu\n", hits);
+    out_printf(&out, "# HELP webserver_cache_misses_total File cache misses\n"
+                     "# TYPE webserver_cache_misses_total counter\n"
+                     "webserver_cache_misses_total %lu\n", misses);
+    out_printf(&out, "# HELP webserver_cache_evictions_total Entries evicted from the file cache\n"
+                     "# TYPE webserver_cache_evictions_total counter\n"
+                     "webserver_cache_evictions_total %ld\n", gauges->cache_evictions);
+    out_printf(&out, "# HELP webserver_cache_entries Entries in the file cache\n"
+                     "# TYPE webserver_cache_entries gauge\n"
+                     "webserver_cache_entries %ld\n", gauges->cache_entries);
+    out_printf(&out, "# HELP webserver_queue_depth Connections waiting for a worker\n"
+                     "# TYPE webserver_queue_depth gauge\n"
+                     "webserver_queue_depth %ld\n", gauges->queue_depth);
+    out_printf(&out, "# HELP webserver_busy_workers Workers handling a request\n"
+                     "# TYPE webserver_busy_workers gauge\n"
+                     "webserver_busy_workers %ld\n", gauges->busy_workers);
+    out_printf(&out, "# HELP webserver_workers Worker threads\n"
+                     "# TYPE webserver_workers gauge\n"
+                     "webserver_workers %ld\n", gauges->workers);
+    out_printf(&out, "# HELP webserver_io_queue_depth Cache misses waiting for an I/O worker\n"
+                     "# TYPE webserver_io_queue_depth gauge\n"
+                     "webserver_io_queue_depth %ld\n", gauges->io_queue_depth);
+    out_printf(&out, "# HELP webserver_io_busy_workers I/O workers loading a file\n"
+                     "# TYPE webserver_io_busy_workers gauge\n"
+                     "webserver_io_busy_workers %ld\n", gauges->io_busy_workers);
+    out_printf(&out, "# HELP webserver_io_workers I/O worker threads\n"
+                     "# TYPE webserver_io_workers gauge\n"
+                     "webserver_io_workers %ld\n", gauges->io_workers);
+    out_printf(&out, "# HELP webserver_overloaded 1 while queue wait is above target\n"
+                     "# TYPE webserver_overloaded gauge\n"
+                     "webserver_overloaded %ld\n", gauges->overloaded);
+    out_printf(&out, "# HELP webserver_shed_total Connections rejected or dropped by admission control\n"
+                     "# TYPE webserver_shed_total counter\n"
+                     "webserver_shed_total %ld\n", gauges->shed);
+
+    format_histogram(&out, "webserver_first_byte_seconds",
+                     "Time from accept to the first response byte",
+                     offsetof(struct metrics_shard, first_byte));
+    format_histogram(&out, "webserver_request_duration_seconds",
+                     "Time from accept to the end of the response",
+                     offsetof(struct metrics_shard, total));
+
+    if (out.length >= out.size) {
+        return -1;
+    }
+
+    return out.length;
+}
@@ -0,0 +1,33 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdint.h>
+
+#define METRICS_MAX_STATUS 600 // Status codes 0 (no response) to 599
+
+// HDR-style latency histogram: exact below 4us, then 4 linear sub-buckets
+// per power of two up to 2^METRICS_HIST_MAX_EXP us; the last bucket is
+// overflow
+#define METRICS_HIST_SUB 4
+#define METRICS_HIST_MAX_EXP 26 // ~67s
+#define METRICS_HIST_BUCKETS ((METRICS_HIST_MAX_EXP - 1) * METRICS_HIST_SUB + 1)
+
+// Gauges sampled by the caller at scrape time
+struct metrics_gauges {
+    long queue_depth;
+    long busy_workers;
+    long workers;
+    long io_queue_depth; // The same three for the pool loading cache misses
+    long io_busy_workers;
+    long io_workers;
+    long cache_entries;
+    long cache_evictions;
+    long overloaded; // 1 while queue wait says the pool is overloaded
+    long shed; // Connections turned away by admission control
+};
+
+extern void metrics_request(int status, uint64_t bytes, int cache_hit, int cache_miss,
+                            uint64_t first_byte_us, uint64_t total_us);
+extern int metrics_format(char *buf, int size, struct metrics_gauges *gauges);
+
+#endif
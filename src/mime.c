@@ -1,19 +1,77 @@
+/*
+
+MIME type lookup
+
+Extensions are looked up in a perfect hash table, built with "hash and
+displace": every extension hashes to a bucket, and each bucket stores the
+displacement that sends all of its extensions to distinct, otherwise unused
+slots. A lookup is one hash, one displacement read and one compare, however
+many types there are.
+
+The built-in table is generated at build time from mime.types by mkmime and
+compiled in as mime_table.h. mime_load() merges an /etc/mime.types style file
+on top of it and builds a new table at startup with the same code.
+
+Lookups are case-insensitive; the tables store extensions in lowercase.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <strings.h>
 #include <ctype.h>
 #include "mime.h"
+#include "mime_table.h"
 
 #define DEFAULT_MIME_TYPE "application/octet-stream"
+#define MAX_DISPLACEMENT 65535
+
+static const struct mime_table builtin_table = {
+    MIME_BUILTIN_SIZE, MIME_BUILTIN_BUCKETS, mime_builtin_disp, mime_builtin_slots
+};
+
+// Only replaced by mime_load(), before any lookups run on other threads
+static const struct mime_table *table = &builtin_table;
 
 /**
- * Lowercase a string
+ * 64-bit FNV-1a of the lowercased extension
+ *
+ * Stores the extension's length in *length.
  */
-char *strlower(char *s)
+static uint64_t mime_hash(const char *ext, int *length)
 {
-    for (char *p = s; *p != '\0'; p++) {
-        *p = tolower(*p);
+    uint64_t h = 14695981039346656037ULL;
+    int i;
+
+    for (i = 0; ext[i] != '\0'; i++) {
+        h ^= (unsigned char)tolower((unsigned char)ext[i]);
+        h *= 1099511628211ULL;
     }
 
-    return s;
+    *length = i;
+
+    return h;
+}
+
+static inline int mime_bucket(uint64_t h, int num_buckets)
+{
+    return (h >> 32) % num_buckets;
+}
+
+/**
+ * Slot for a hash under displacement d
+ */
+static inline int mime_slot(uint64_t h, unsigned int d, int size)
+{
+    uint64_t x = (h & 0xffffffff) ^ (d * 0x9e3779b97f4a7c15ULL);
+
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+
+    return x % size;
 }
 
 /**
@@ -22,26 +80,258 @@ char *strlower(char *s)
 char *mime_type_get(char *filename)
 {
     char *ext = strrchr(filename, '.');
+    int length;
 
-    if (ext == NULL) {
+    if (ext == NULL || strchr(ext, '/') != NULL) {
         return DEFAULT_MIME_TYPE;
     }
     
     ext++;
-    char temp[5];
-    strncpy(temp, ext, strlen(ext) + 1);
-    strlower(temp);
+    uint64_t h = mime_hash(ext, &length);
 
-    // TODO: this is O(n) and it should be O(1)
+    if (length == 0 || length >= MIME_MAX_EXT) {
+        return DEFAULT_MIME_TYPE;
+    }
 
-    if (strcmp(ext, "html") == 0 || strcmp(ext, "htm") == 0) { return "text/html"; }
-    if (strcmp(ext, "jpeg") == 0 || strcmp(ext, "jpg") == 0) { return "image/jpg"; }
-    if (strcmp(ext, "css") == 0) { return "text/css"; }
-    if (strcmp(ext, "js") == 0) { return "application/javascript"; }
-    if (strcmp(ext, "json") == 0) { return "application/json"; }
-    if (strcmp(ext, "txt") == 0) { return "text/plain"; }
-    if (strcmp(ext, "gif") == 0) { return "image/gif"; }
-    if (strcmp(ext, "png") == 0) { return "image/png"; }
+    unsigned int d = table->disp[mime_bucket(h, table->num_buckets)];
+    const struct mime_entry *e = &table->slots[mime_slot(h, d, table->size)];
+
+    if (e->ext != NULL && strcasecmp(e->ext, ext) == 0) {
+        return (char *)e->type;
+    }
 
     return DEFAULT_MIME_TYPE;
-}
\ No newline at end of file
+}
+
+/**
+ * Add or replace the mapping for ext
+ */
+static int entry_add(struct mime_entry **entries, int *count, const char *ext, const char *type)
+{
+    for (int i = 0; i < *count; i++) {
+        if (strcmp((*entries)[i].ext, ext) == 0) {
+            (*entries)[i].type = type;
+            return 0;
+        }
+    }
+
+    // Double whenever count reaches a power of two
+    if ((*count & (*count - 1)) == 0) {
+        int capacity = *count == 0 ? 64 : *count * 2;
+        struct mime_entry *grown = realloc(*entries, capacity * sizeof *grown);
+
+        if (grown == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        *entries = grown;
+    }
+
+    (*entries)[*count].ext = ext;
+    (*entries)[*count].type = type;
+    (*count)++;
+
+    return 0;
+}
+
+/**
+ * Parse an /etc/mime.types style file into entries
+ *
+ * Each line is a type followed by its extensions; # starts a comment.
+ * Mappings are added to the *count entries already in *entries, replacing
+ * any for the same extension. The strings are never freed.
+ *
+ * Return 0 on success, -1 if the file can't be read.
+ */
+int mime_parse(char *filename, struct mime_entry **entries, int *count)
+{
+    FILE *fp = fopen(filename, "r");
+    char line[1024];
+
+    if (fp == NULL) {
+        return -1;
+    }
+
+    while (fgets(line, sizeof line, fp) != NULL) {
+        char *hash = strchr(line, '#');
+        if (hash != NULL) {
+            *hash = '\0';
+        }
+
+        char *save;
+        char *word = strtok_r(line, " \t\r\n", &save);
+        if (word == NULL) {
+            continue;
+        }
+        char *type = strdup(word);
+
+        while ((word = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+            if (strlen(word) >= MIME_MAX_EXT) {
+                continue;
+            }
+            for (char *p = word; *p != '\0'; p++) {
+                *p = tolower((unsigned char)*p);
+            }
+            if (type == NULL || entry_add(entries, count, strdup(word), type) == -1) {
+                fclose(fp);
+                return -1;
+            }
+        }
+    }
+
+    fclose(fp);
+
+    return 0;
+}
+
+/**
+ * Build a perfect hash table over entries
+ *
+ * Extensions must be unique and lowercase. The slot and displacement arrays
+ * are malloc'd; the strings are shared with entries.
+ *
+ * Return 0 on success, -1 on failure.
+ */
+int mime_table_build(struct mime_entry *entries, int count, struct mime_table *t)
+{
+    int size = count + count / 4 + 1;
+    int num_buckets = count / 4 + 1;
+    uint64_t *hashes = malloc((count + 1) * sizeof *hashes);
+    int *members = malloc((count + 1) * sizeof *members); // Entry indexes, grouped by bucket
+    int *start = calloc(num_buckets + 1, sizeof *start); // Bucket b is members[start[b]..start[b+1])
+    int *order = malloc(num_buckets * sizeof *order);
+    int *placed = malloc((count + 1) * sizeof *placed); // Slots taken by the bucket being placed
+    unsigned short *disp = calloc(num_buckets, sizeof *disp);
+    struct mime_entry *slots = calloc(size, sizeof *slots);
+    int rv = -1;
+
+    if (hashes == NULL || members == NULL || start == NULL || order == NULL ||
+        placed == NULL || disp == NULL || slots == NULL) {
+        perror("malloc");
+        goto out;
+    }
+
+    // Counting sort the entries into their buckets: count, turn the counts
+    // into bucket ends, then fill each bucket back to front
+    for (int i = 0; i < count; i++) {
+        int length;
+        hashes[i] = mime_hash(entries[i].ext, &length);
+        start[mime_bucket(hashes[i], num_buckets)]++;
+    }
+    for (int b = 1; b <= num_buckets; b++) {
+        start[b] += start[b - 1];
+    }
+    for (int i = 0; i < count; i++) {
+        members[--start[mime_bucket(hashes[i], num_buckets)]] = i;
+    }
+
+    // Place the biggest buckets first, while the table is still empty
+    for (int b = 0; b < num_buckets; b++) {
+        int j = b;
+        int n = start[b + 1] - start[b];
+        while (j > 0 && start[order[j - 1] + 1] - start[order[j - 1]] < n) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = b;
+    }
+
+    for (int k = 0; k < num_buckets; k++) {
+        int b = order[k];
+        int n = start[b + 1] - start[b];
+        unsigned int d;
+
+        if (n == 0) {
+            break;
+        }
+
+        for (d = 0; d <= MAX_DISPLACEMENT; d++) {
+            int i;
+
+            for (i = 0; i < n; i++) {
+                int e = members[start[b] + i];
+                placed[i] = mime_slot(hashes[e], d, size);
+                if (slots[placed[i]].ext != NULL) {
+                    break;
+                }
+                slots[placed[i]] = entries[e];
+            }
+            if (i == n) {
+                break;
+            }
+            // Collision; take this attempt back out and try the next d
+            while (--i >= 0) {
+                slots[placed[i]].ext = NULL;
+            }
+        }
+
+        if (d > MAX_DISPLACEMENT) {
+            fprintf(stderr, "mime_table_build: no displacement for bucket %d\n", b);
+            goto out;
+        }
+        disp[b] = d;
+    }
+
+    t->size = size;
+    t->num_buckets = num_buckets;
+    t->disp = disp;
+    t->slots = slots;
+    disp = NULL;
+    slots = NULL;
+    rv = 0;
+
+out:
+    free(hashes);
+    free(members);
+    free(start);
+    free(order);
+    free(placed);
+    free(disp);
+    free(slots);
+
+    return rv;
+}
+
+/**
+ * Extend the built-in types from an /etc/mime.types style file
+ *
+ * Types from the file win over the built-in ones. Call this at startup,
+ * before any other thread looks types up; the new table is never freed, so
+ * pointers handed out by mime_type_get() stay valid.
+ *
+ * Return 0 on success, -1 on failure, in which case the old table stays.
+ */
+int mime_load(char *filename)
+{
+    struct mime_entry *entries = NULL;
+    int count = 0;
+    struct mime_table *t = malloc(sizeof *t);
+
+    if (t == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    for (int i = 0; i < table->size; i++) {
+        if (table->slots[i].ext != NULL &&
+            entry_add(&entries, &count, table->slots[i].ext, table->slots[i].type) == -1) {
+            goto fail;
+        }
+    }
+
+    if (mime_parse(filename, &entries, &count) == -1 ||
+        mime_table_build(entries, count, t) == -1) {
+        goto fail;
+    }
+
+    free(entries);
+    table = t;
+
+    return 0;
+
+fail:
+    free(entries);
+    free(t);
+
+    return -1;
+}
@@ -1,6 +1,25 @@
 #ifndef _MIME_H_
 #define _MIME_H_
 
+#define MIME_MAX_EXT 32 // Longer extensions get the default type
+
+// One extension -> type mapping; extensions are stored lowercase
+struct mime_entry {
+    const char *ext;
+    const char *type;
+};
+
+// Perfect hash table, see mime.c
+struct mime_table {
+    int size; // Number of slots
+    int num_buckets;
+    const unsigned short *disp; // Per-bucket displacement
+    const struct mime_entry *slots; // ext is NULL in empty slots
+};
+
 extern char *mime_type_get(char *filename);
+extern int mime_load(char *filename);
+extern int mime_parse(char *filename, struct mime_entry **entries, int *count);
+extern int mime_table_build(struct mime_entry *entries, int count, struct mime_table *table);
 
-#endif
\ No newline at end of file
+#endif
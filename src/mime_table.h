@@ -0,0 +1,156 @@
+/* Generated by mkmime from mime.types; do not edit */
+
+#define MIME_BUILTIN_SIZE 143
+#define MIME_BUILTIN_BUCKETS 29
+
+static const unsigned short mime_builtin_disp[MIME_BUILTIN_BUCKETS] = {
+    3, 34, 1, 3, 1, 28, 8, 0, 27, 13, 1, 4,
+    4, 8, 20, 72, 6, 8, 3, 4, 1, 2, 2, 2,
+    75, 6, 17, 31, 12,
+};
+
+static const struct mime_entry mime_builtin_slots[MIME_BUILTIN_SIZE] = {
+    { "ts", "video/mp2t" },
+    { "aac", "audio/aac" },
+    { "flac", "audio/flac" },
+    { "heic", "image/heic" },
+    { "js", "text/javascript" },
+    { NULL, NULL },
+    { NULL, NULL },
+    { "rar", "application/x-rar-compressed" },
+    { NULL, NULL },
+    { "dll", "application/octet-stream" },
+    { "odt", "application/vnd.oasis.opendocument.text" },
+    { "rtf", "application/rtf" },
+    { NULL, NULL },
+    { "map", "application/json" },
+    { "bz2", "application/x-bzip2" },
+    { "msi", "application/octet-stream" },
+    { "pptx", "application/vnd.openxmlformats-officedocument.presentationml.presentation" },
+    { "avi", "video/x-msvideo" },
+    { NULL, NULL },
+    { "svgz", "image/svg+xml" },
+    { "pdf", "application/pdf" },
+    { "bmp", "image/bmp" },
+    { "sh", "application/x-sh" },
+    { NULL, NULL },
+    { "mid", "audio/midi" },
+    { "dmg", "application/x-apple-diskimage" },
+    { "ini", "text/plain" },
+    { "mpg", "video/mpeg" },
+    { NULL, NULL },
+    { "apk", "application/vnd.android.package-archive" },
+    { NULL, NULL },
+    { NULL, NULL },
+    { "exe", "application/octet-stream" },
+    { "ai", "application/postscript" },
+    { "jpeg", "image/jpeg" },
+    { "ico", "image/x-icon" },
+    { "text", "text/plain" },
+    { "oga", "audio/ogg" },
+    { "bin", "application/octet-stream" },
+    { "jar", "application/java-archive" },
+    { NULL, NULL },
+    { "xz", "application/x-xz" },
+    { "mkv", "video/x-matroska" },
+    { "jpg", "image/jpeg" },
+    { "rpm", "application/x-redhat-package-manager" },
+    { "tar", "application/x-tar" },
+    { "png", "image/png" },
+    { "shtml", "text/html" },
+    { "docx", "application/vnd.openxmlformats-officedocument.wordprocessingml.document" },
+    { "ods", "application/vnd.oasis.opendocument.spreadsheet" },
+    { "woff", "font/woff" },
+    { NULL, NULL },
+    { "xlsx", "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet" },
+    { "wasm", "application/wasm" },
+    { "img", "application/octet-stream" },
+    { NULL, NULL },
+    { "otf", "font/otf" },
+    { "wav", "audio/wav" },
+    { "cur", "image/x-icon" },
+    { "mp4", "video/mp4" },
+    { NULL, NULL },
+    { "conf", "text/plain" },
+    { "htm", "text/html" },
+    { "ear", "application/java-archive" },
+    { "json", "application/json" },
+    { "jsonld", "application/ld+json" },
+    { "m4v", "video/mp4" },
+    { NULL, NULL },
+    { "mjs", "text/javascript" },
+    { "flv", "video/x-flv" },
+    { "ppt", "application/vnd.ms-powerpoint" },
+    { "md", "text/markdown" },
+    { "ics", "text/calendar" },
+    { "tgz", "application/gzip" },
+    { "xhtml", "application/xhtml+xml" },
+    { NULL, NULL },
+    { "iso", "application/x-iso9660-image" },
+    { "svg", "image/svg+xml" },
+    { "ogv", "video/ogg" },
+    { NULL, NULL },
+    { "deb", "application/vnd.debian.binary-package" },
+    { "xml", "text/xml" },
+    { NULL, NULL },
+    { "jpe", "image/jpeg" },
+    { NULL, NULL },
+    { "woff2", "font/woff2" },
+    { "gif", "image/gif" },
+    { "apng", "image/apng" },
+    { "vcf", "text/vcard" },
+    { NULL, NULL },
+    { "ogg", "audio/ogg" },
+    { "tif", "image/tiff" },
+    { "webm", "video/webm" },
+    { "weba", "audio/webm" },
+    { "tiff", "image/tiff" },
+    { "mpga", "audio/mpeg" },
+    { NULL, NULL },
+    { "php", "application/x-httpd-php" },
+    { "html", "text/html" },
+    { "so", "application/octet-stream" },
+    { "csv", "text/csv" },
+    { "pem", "application/x-x509-ca-cert" },
+    { NULL, NULL },
+    { "ps", "application/postscript" },
+    { "atom", "application/atom+xml" },
+    { "rss", "application/rss+xml" },
+    { NULL, NULL },
+    { "eot", "application/vnd.ms-fontobject" },
+    { "eps", "application/postscript" },
+    { NULL, NULL },
+    { "webmanifest", "application/manifest+json" },
+    { "mpeg", "video/mpeg" },
+    { NULL, NULL },
+    { NULL, NULL },
+    { "war", "application/java-archive" },
+    { "mp3", "audio/mpeg" },
+    { "zip", "application/zip" },
+    { NULL, NULL },
+    { "txt", "text/plain" },
+    { "crt", "application/x-x509-ca-cert" },
+    { "avif", "image/avif" },
+    { "log", "text/plain" },
+    { "mov", "video/quicktime" },
+    { "epub", "application/epub+zip" },
+    { "der", "application/x-x509-ca-cert" },
+    { "ttf", "font/ttf" },
+    { NULL, NULL },
+    { "doc", "application/msword" },
+    { "xls", "application/vnd.ms-excel" },
+    { "7z", "application/x-7z-compressed" },
+    { "markdown", "text/markdown" },
+    { NULL, NULL },
+    { "gz", "application/gzip" },
+    { "jfif", "image/jpeg" },
+    { "webp", "image/webp" },
+    { "midi", "audio/midi" },
+    { "css", "text/css" },
+    { "m4a", "audio/mp4" },
+    { "qt", "video/quicktime" },
+    { "3gp", "video/3gpp" },
+    { "opus", "audio/ogg" },
+    { "zst", "application/zstd" },
+    { NULL, NULL },
+};
@@ -0,0 +1,307 @@
+/**
+ * mkbundle.c -- Pack a server root into a single asset bundle
+ *
+ * Usage:
+ *
+ *    ./mkbundle ./serverroot ./serverroot.bundle
+ *
+ * Every regular file under the root is stored with its MIME type, an ETag
+ * and, when built with HAVE_ZLIB and it pays off, a gzip'd copy of the body.
+ * See bundle.h for the layout.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#include "bundle.h"
+#include "file.h"
+#include "mime.h"
+
+#define MAX_PATH 4096
+#define GZIP_MIN_SAVING 0.9 // Only keep gzip bodies at most 90% of the original
+
+struct asset {
+    char *path; // Request path, e.g. "/index.html"
+    char *mime;
+    file_data *file;
+    void *gzip;
+    int gzip_length;
+};
+
+struct asset_list {
+    struct asset *assets;
+    int count;
+    int capacity;
+};
+
+/**
+ * Append an asset, growing the list as needed
+ */
+static struct asset *asset_add(struct asset_list *list)
+{
+    if (list->count == list->capacity) {
+        int capacity = list->capacity == 0 ? 64 : list->capacity * 2;
+        struct asset *assets = realloc(list->assets, capacity * sizeof *assets);
+
+        if (assets == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+
+        list->assets = assets;
+        list->capacity = capacity;
+    }
+
+    struct asset *a = &list->assets[list->count++];
+    memset(a, 0, sizeof *a);
+
+    return a;
+}
+
+#ifdef HAVE_ZLIB
+/**
+ * gzip a body; returns NULL if it doesn't shrink enough to be worth it
+ */
+static void *gzip_body(void *data, int length, int *gzip_length)
+{
+    z_stream zs;
+
+    memset(&zs, 0, sizeof zs);
+
+    // 31 = 15 window bits + 16 for a gzip wrapper
+    if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 31, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return NULL;
+    }
+
+    uLong bound = deflateBound(&zs, length);
+    unsigned char *out = malloc(bound);
+
+    if (out == NULL) {
+        deflateEnd(&zs);
+        return NULL;
+    }
+
+    zs.next_in = data;
+    zs.avail_in = length;
+    zs.next_out = out;
+    zs.avail_out = bound;
+
+    int rv = deflate(&zs, Z_FINISH);
+    *gzip_length = zs.total_out;
+    deflateEnd(&zs);
+
+    if (rv != Z_STREAM_END || *gzip_length > length * GZIP_MIN_SAVING) {
+        free(out);
+        return NULL;
+    }
+
+    return out;
+}
+#endif
+
+/**
+ * Recursively collect the regular files under dir
+ *
+ * prefix is the request path that corresponds to dir.
+ */
+static void collect(char *dir, char *prefix, struct asset_list *list)
+{
+    DIR *d = opendir(dir);
+
+    if (d == NULL) {
+        perror(dir);
+        exit(1);
+    }
+
+    struct dirent *de;
+
+    while ((de = readdir(d)) != NULL) {
+        char fs_path[MAX_PATH], req_path[MAX_PATH];
+        struct stat buf;
+
+        if (de->d_name[0] == '.') {
+            continue;
+        }
+
+        snprintf(fs_path, sizeof fs_path, "%s/%s", dir, de->d_name);
+        snprintf(req_path, sizeof req_path, "%s/%s", prefix, de->d_name);
+
+        if (stat(fs_path, &buf) == -1) {
+            perror(fs_path);
+            continue;
+        }
+
+        if (S_ISDIR(buf.st_mode)) {
+            collect(fs_path, req_path, list);
+            continue;
+        }
+
+        if (!S_ISREG(buf.st_mode)) {
+            continue;
+        }
+
+        struct asset *a = asset_add(list);
+
+        a->path = strdup(req_path);
+        a->file = file_load(fs_path);
+
+        if (a->file == NULL) {
+            fprintf(stderr, "%s: cannot read\n", fs_path);
+            exit(1);
+        }
+        a->mime = a->file->mime_type;
+
+#ifdef HAVE_ZLIB
+        a->gzip = gzip_body(a->file->data, a->file->size, &a->gzip_length);
+#endif
+    }
+
+    closedir(d);
+}
+
+/**
+ * Write length bytes at the current position, or die
+ */
+static void write_or_die(FILE *fp, const void *data, size_t length)
+{
+    if (length > 0 && fwrite(data, 1, length, fp) != length) {
+        perror("write");
+        exit(1);
+    }
+}
+
+/**
+ * Pad the output with zeros up to the next multiple of align
+ */
+static uint64_t pad_to(FILE *fp, uint64_t offset, uint64_t align)
+{
+    static const char zeros[BUNDLE_ALIGN];
+    uint64_t aligned = (offset + align - 1) / align * align;
+
+    write_or_die(fp, zeros, aligned - offset);
+
+    return aligned;
+}
+
+int main(int argc, char *argv[])
+{
+    struct asset_list list = { NULL, 0, 0 };
+
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s rootdir bundlefile\n", argv[0]);
+        return 1;
+    }
+
+    collect(argv[1], "", &list);
+
+    // Index at most half full so probes stay short
+    uint32_t slot_count = 1;
+    while (slot_count < (uint32_t)list.count * 2) {
+        slot_count <<= 1;
+    }
+
+    struct bundle_entry *entries = calloc(list.count ? list.count : 1, sizeof *entries);
+    uint32_t *slots = calloc(slot_count, sizeof *slots);
+    uint64_t strings_length = 0;
+
+    if (entries == NULL || slots == NULL) {
+        perror("calloc");
+        return 1;
+    }
+
+    for (int i = 0; i < list.count; i++) {
+        struct asset *a = &list.assets[i];
+        struct bundle_entry *e = &entries[i];
+
+        e->path_length = strlen(a->path);
+        e->hash = bundle_hash(a->path, e->path_length);
+        e->path_offset = strings_length;
+        strings_length += e->path_length + 1;
+        e->mime_offset = strings_length;
+        strings_length += strlen(a->mime) + 1;
+        snprintf(e->etag, sizeof e->etag, "\"%016llx\"",
+                 (unsigned long long)bundle_hash(a->file->data, a->file->size));
+
+        uint32_t mask = slot_count - 1, s = e->hash & mask;
+        while (slots[s] != 0) {
+            s = (s + 1) & mask;
+        }
+        slots[s] = i + 1;
+    }
+
+    struct bundle_header header;
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, BUNDLE_MAGIC, sizeof header.magic);
+    header.version = BUNDLE_VERSION;
+    header.entry_count = list.count;
+    header.slot_count = slot_count;
+    header.entries_offset = sizeof header;
+    header.slots_offset = header.entries_offset + (uint64_t)list.count * sizeof *entries;
+    header.strings_offset = header.slots_offset + (uint64_t)slot_count * sizeof *slots;
+
+    // Lay out the payloads after the string table, each page-aligned
+    uint64_t offset = header.strings_offset + strings_length;
+    for (int i = 0; i < list.count; i++) {
+        struct asset *a = &list.assets[i];
+
+        offset = (offset + BUNDLE_ALIGN - 1) / BUNDLE_ALIGN * BUNDLE_ALIGN;
+        entries[i].data_offset = offset;
+        entries[i].data_length = a->file->size;
+        offset += a->file->size;
+
+        if (a->gzip != NULL) {
+            offset = (offset + BUNDLE_ALIGN - 1) / BUNDLE_ALIGN * BUNDLE_ALIGN;
+            entries[i].gzip_offset = offset;
+            entries[i].gzip_length = a->gzip_length;
+            offset += a->gzip_length;
+        }
+    }
+    header.file_size = offset;
+
+    // Write to a temp file and rename, so a running deploy never sees half a bundle
+    char tmp_path[MAX_PATH];
+    snprintf(tmp_path, sizeof tmp_path, "%s.tmp", argv[2]);
+    FILE *fp = fopen(tmp_path, "wb");
+
+    if (fp == NULL) {
+        perror(tmp_path);
+        return 1;
+    }
+
+    write_or_die(fp, &header, sizeof header);
+    write_or_die(fp, entries, (size_t)list.count * sizeof *entries);
+    write_or_die(fp, slots, (size_t)slot_count * sizeof *slots);
+    for (int i = 0; i < list.count; i++) {
+        write_or_die(fp, list.assets[i].path, strlen(list.assets[i].path) + 1);
+        write_or_die(fp, list.assets[i].mime, strlen(list.assets[i].mime) + 1);
+    }
+
+    offset = header.strings_offset + strings_length;
+    for (int i = 0; i < list.count; i++) {
+        struct asset *a = &list.assets[i];
+
+        offset = pad_to(fp, offset, BUNDLE_ALIGN);
+        write_or_die(fp, a->file->data, a->file->size);
+        offset += a->file->size;
+
+        if (a->gzip != NULL) {
+            offset = pad_to(fp, offset, BUNDLE_ALIGN);
+            write_or_die(fp, a->gzip, a->gzip_length);
+            offset += a->gzip_length;
+        }
+    }
+
+    if (fclose(fp) != 0 || rename(tmp_path, argv[2]) == -1) {
+        perror(argv[2]);
+        return 1;
+    }
+
+    printf("%s: %d files, %llu bytes\n", argv[2], list.count, (unsigned long long)offset);
+
+    return 0;
+}
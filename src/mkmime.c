@@ -0,0 +1,72 @@
+/**
+ * mkmime.c -- Generate the built-in MIME type table
+ *
+ * Usage:
+ *
+ *    ./mkmime ./mime.types ./mime_table.h
+ *
+ * Reads an /etc/mime.types style file and writes it out as a perfect hash
+ * table for mime.c to compile in. See mime.c for how the table works.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "mime.h"
+
+/**
+ * Main
+ */
+int main(int argc, char **argv)
+{
+    struct mime_entry *entries = NULL;
+    struct mime_table t;
+    int count = 0;
+
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s mime.types mime_table.h\n", argv[0]);
+        exit(1);
+    }
+
+    if (mime_parse(argv[1], &entries, &count) == -1) {
+        perror(argv[1]);
+        exit(1);
+    }
+    if (mime_table_build(entries, count, &t) == -1) {
+        exit(1);
+    }
+
+    FILE *fp = fopen(argv[2], "w");
+    if (fp == NULL) {
+        perror(argv[2]);
+        exit(1);
+    }
+
+    fprintf(fp, "/* Generated by mkmime from mime.types; do not edit */\n\n");
+    fprintf(fp, "#define MIME_BUILTIN_SIZE %d\n", t.size);
+    fprintf(fp, "#define MIME_BUILTIN_BUCKETS %d\n\n", t.num_buckets);
+
+    fprintf(fp, "static const unsigned short mime_builtin_disp[MIME_BUILTIN_BUCKETS] = {");
+    for (int b = 0; b < t.num_buckets; b++) {
+        fprintf(fp, "%s%u,", b % 12 == 0 ? "\n    " : " ", t.disp[b]);
+    }
+    fprintf(fp, "\n};\n\n");
+
+    fprintf(fp, "static const struct mime_entry mime_builtin_slots[MIME_BUILTIN_SIZE] = {\n");
+    for (int i = 0; i < t.size; i++) {
+        if (t.slots[i].ext == NULL) {
+            fprintf(fp, "    { NULL, NULL },\n");
+        } else {
+            fprintf(fp, "    { \"%s\", \"%s\" },\n", t.slots[i].ext, t.slots[i].type);
+        }
+    }
+    fprintf(fp, "};\n");
+
+    if (fclose(fp) != 0) {
+        perror(argv[2]);
+        exit(1);
+    }
+
+    printf("mkmime: %d extensions in %d slots\n", count, t.size);
+
+    return 0;
+}
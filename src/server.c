@@ -5,6 +5,7 @@
  * 
  *    curl -D - http://localhost:3490/
  *    curl -D - http://localhost:3490/d20
+ *    curl -D - http://localhost:3490/metrics
  *    curl -D - http://localhost:3490/date
  * 
  * You can also test the above URLs in your browser! They should work!
@@ -14,39 +15,281 @@
  *    curl -D - -X POST -H 'Content-Type: text/plain' -d 'Hello, sample data!' http://localhost:3490/save
  * 
  * (Posting data is harder to test from a browser.)
+ *
+ * Upgrading without dropping connections:
+ *
+ *    kill -USR2 <pid>
+ *
+ * execs ./server again (argv[0], so install the new binary over the old
+ * one first) on the same listening socket. Once the new process is ready
+ * it sends the old one SIGTERM, which drains and exits as usual. If the new
+ * binary fails to start the old one logs it and carries on serving.
  */
 
+#define _GNU_SOURCE // ppoll()
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <time.h>
 #include <sys/file.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/wait.h>
 #include "threadpool.h"
 #include "net.h"
 #include "file.h"
 #include "mime.h"
 #include "cache.h"
+#include "bundle.h"
+#include "arena.h"
+#include "httpdate.h"
+#include "log.h"
+#include "accesslog.h"
+#include "metrics.h"
+#include "trace.h"
+#include "timerwheel.h"
+#include "affinity.h"
+#include "slab.h"
 
 #define PORT "3490"  // the port users will be connecting to
 
 #define SERVER_FILES "./serverfiles"
 #define SERVER_ROOT "./serverroot"
 #define DEFAULT_PAGE "./serverroot/index.html"
+#define SERVER_BUNDLE "./serverroot.bundle" // Built by `make bundle`
+#define DEFAULT_BUNDLE_PAGE "/index.html"
+#define MIME_TYPES "/etc/mime.types" // Extra MIME types merged in at startup, if present
+#define ACCESS_LOG "./access.log" // Binary, read it with logdecode
+#define FILE_STREAM_THRESHOLD (64 * 1024 * 1024) // Stream files this big instead of caching them
+#define REQUEST_BUFFER_SIZE 8192 // Request line and headers
+#define MAX_HEADER_SIZE 1024
+#define METRICS_BUFFER_SIZE 65536
+#define TRACE_SAMPLE_EVERY 100 // With WEBSERVER_TRACE=<file>, trace 1 in this many requests
+#define REQUEST_POOL_SIZE 10 // Workers reading requests and serving from memory
+#define IO_POOL_SIZE 16 // Workers loading files from disk; they spend most of their time blocked
+#define MAX_QUEUED_CONNECTIONS 1024 // Accepted connections waiting for a worker
+#define MAX_QUEUED_LOADS 1024 // Cache misses waiting for an I/O worker
+#define MAX_REQUEST_POOLS SLAB_MAX_NODES // One per NUMA node with WEBSERVER_NUMA=1
+#define DRAIN_TIMEOUT_MS 30000 // How long SIGTERM waits for accepted requests to finish
+#define LISTEN_FD_ENV "WEBSERVER_LISTEN_FD" // Listener inherited from the process being upgraded
+#define UPGRADE_FROM_ENV "WEBSERVER_UPGRADE_FROM" // Its pid, to tell it to stop once we're up
+#define RETRY_AFTER_SECONDS 1 // Sent with 503s when shedding load
+#define TIMER_TICK_MS 100
+#define HEADER_TIMEOUT_MS 10000 // To receive the request once a worker is reading
+#define WRITE_STALL_TIMEOUT_MS 30000 // For a blocked send() to make any progress
+
+// Why a connection's timer is armed
+#define TIMEOUT_NONE 0
+#define TIMEOUT_HEADER 1
+#define TIMEOUT_WRITE 2
 /* 目前只处理两种请求，request和post */
 #define REQUEST_NUM 2
 
-typedef struct {
+typedef struct http_conn_t {
     int fd;
     cache *cache;
-} handle_request_args;
+    bundle *bundle; // NULL when serving straight from SERVER_ROOT
+    thread_pool *pool; // The request pool running this connection
+    thread_pool *io_pool; // Where cache misses go to be read from disk
+    struct timer_wheel *timers;
+    struct timer timeout; // Armed while blocked on the client, see arm_timeout()
+    int timeout_phase; // TIMEOUT_* the timer is armed for
+    int timed_out; // TIMEOUT_* that fired, or TIMEOUT_NONE
+    arena arena; // Everything the current request allocates; reset when it's done
+
+    // For the access log
+    int family;
+    unsigned char addr[16]; // Client address
+    int method; // ACCESS_METHOD_*
+    char *path; // Request path in the arena, NULL until parsed
+    int status; // Response status, 0 until a response header is sent
+    long bytes_sent;
+    int flags; // ACCESS_CACHE_HIT etc.
+    uint64_t accepted_ns, started_ns, parsed_ns, sent_ns; // access_clock_ns(), 0 if not reached
+
+    int traced; // Sampled for tracing; see trace.c
+    uint64_t trace_ts[TRACE_NUM_POINTS];
+} http_conn;
+
+// What every connection shares; set up by main()
+struct server_state {
+    cache *cache;
+    bundle *bundle; // NULL when serving straight from SERVER_ROOT
+    thread_pool *io_pool;
+    struct timer_wheel *timers;
+};
+
+static volatile sig_atomic_t stopping; // Set by SIGTERM or SIGINT
+static volatile sig_atomic_t stopped_by; // Pid that sent it, 0 if unknown
+static volatile sig_atomic_t upgrade_requested; // Set by SIGUSR2
+static volatile sig_atomic_t child_exited; // Set by SIGCHLD
+
+// Request pools: one, or one per NUMA node, see setup_request_pools()
+static thread_pool *request_pools[MAX_REQUEST_POOLS];
+static int num_request_pools;
+static unsigned char cpu_pool[AFFINITY_MAX_CPUS]; // Index into request_pools by CPU
+_Static_assert(MAX_REQUEST_POOLS <= UCHAR_MAX + 1, "cpu_pool can't index that many pools");
+static cpu_set_t startup_cpus; // The process's CPU mask before the acceptor was pinned
+
+/**
+ * Timestamp a trace point if this request is being traced
+ */
+static inline void trace_mark(http_conn *conn, int point)
+{
+    if (conn->traced) {
+        conn->trace_ts[point] = trace_now();
+    }
+}
+
+/**
+ * Timer callback: a connection has been stuck on its client too long
+ *
+ * Runs on the timer thread. Shutting the socket down wakes the worker
+ * blocked in recv() or send(); for a slow request the write side stays open
+ * so the worker can still answer 408.
+ */
+static void connection_timed_out(void *arg)
+{
+    http_conn *conn = arg;
+
+    conn->timed_out = conn->timeout_phase;
+    shutdown(conn->fd, conn->timeout_phase == TIMEOUT_HEADER ? SHUT_RD : SHUT_RDWR);
+}
+
+/**
+ * Start (or restart) the connection's deadline for phase
+ */
+static void arm_timeout(http_conn *conn, int phase, int timeout_ms)
+{
+    conn->timeout_phase = phase;
+    timer_wheel_arm(conn->timers, &conn->timeout, timeout_ms);
+}
+
+static void cancel_timeout(http_conn *conn)
+{
+    timer_wheel_cancel(conn->timers, &conn->timeout);
+}
+
+/**
+ * Send all len bytes of buf, retrying on short writes
+ *
+ * Gives up if the client stops reading for WRITE_STALL_TIMEOUT_MS.
+ *
+ * Return the number of bytes sent, or -1 on error.
+ */
+int send_all(http_conn *conn, const void *buf, int len)
+{
+    const char *p = buf;
+    int remaining = len;
+
+    while (remaining > 0) {
+        arm_timeout(conn, TIMEOUT_WRITE, WRITE_STALL_TIMEOUT_MS);
+        int rv = send(conn->fd, p, remaining, MSG_NOSIGNAL);
+
+        if (rv < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            cancel_timeout(conn);
+            if (conn->timed_out == TIMEOUT_WRITE) {
+                log_debug("fd %d: write stalled, giving up", conn->fd);
+            } else {
+                perror("send");
+            }
+            return -1;
+        }
+
+        p += rv;
+        remaining -= rv;
+    }
+    cancel_timeout(conn);
+
+    return len;
+}
+
+/**
+ * Build the HTTP response header block in buf
+ *
+ * extra is NULL or additional "Name: value\r\n" lines. The Date line is
+ * the cached one from http_date_get().
+ *
+ * Return the header length, or -1 if it didn't fit.
+ */
+int format_header(char *buf, int size, char *header, char *content_type, long content_length,
+                  char *extra)
+{
+    int header_length = snprintf(buf, size,
+        "%s\r\n%.*sConnection: close\r\nContent-Length: %ld\r\nContent-Type: %s\r\n%s\r\n",
+        header, HTTP_DATE_LENGTH, http_date_get(), content_length, content_type,
+        extra == NULL ? "" : extra);
+    if (header_length <= 0 || header_length >= size) {
+        return -1;
+    }
+    return header_length;
+}
+
+/**
+ * Note the status and start of a response that's about to go out
+ *
+ * header is the status line, "HTTP/1.1 200 OK" etc.
+ */
+void response_started(http_conn *conn, char *header)
+{
+    char *code = strchr(header, ' ');
+
+    conn->status = code != NULL ? atoi(code + 1) : 0;
+    conn->sent_ns = access_clock_ns();
+}
+
+/**
+ * Send an HTTP response with additional header lines
+ *
+ * extra: NULL or "Name: value\r\n" lines to add to the header.
+ *
+ * Return the number of bytes sent, or -1 on error.
+ */
+int send_response_ext(http_conn *conn, char *header, char *content_type, char *extra,
+                      const void *body, int content_length)
+{
+    char *response = arena_alloc(&conn->arena, MAX_HEADER_SIZE);
+    if (response == NULL) {
+        fprintf(stderr, "no memory for response header\n");
+        return -1;
+    }
+
+    int response_length = format_header(response, MAX_HEADER_SIZE, header, content_type,
+                                        content_length, extra);
+    if (response_length < 0) {
+        fprintf(stderr, "generate response message failed\n");
+        return -1;
+    }
+
+    // Send it all! Header first, then the body straight from where it lives
+    response_started(conn, header);
+    if (send_all(conn, response, response_length) < 0) {
+        return -1;
+    }
+    conn->bytes_sent += response_length;
+    if (content_length > 0 && send_all(conn, body, content_length) < 0) {
+        return -1;
+    }
+    conn->bytes_sent += content_length;
+
+    return response_length + content_length;
+}
+
 /**
  * Send an HTTP response
  *
@@ -54,38 +297,61 @@ typedef struct {
  * content_type: "text/plain", etc.
  * body:         the data to send.
  * 
- * Return the value from the send() function.
- */
-int send_response(int fd, char *header, char *content_type, void *body, int content_length)
-{
-    const int max_response_size = 262144;
-    char response[max_response_size];
-    const int max_date_lenth = 40;
-    // Build HTTP response and store it in response
-    char date[max_date_lenth] = {0};
-    time_t t = time(NULL);
-    struct tm tm = *localtime((const time_t *)&t);
-    (void)sprintf(date, "Date: Month:%d Day:%d %02d:%02d:%02d %d", tm.tm_mon + 1,
-                  tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, tm.tm_year + 1);
-    char connection[] = "Connection: close";
-    char content_len[20] = {0};
-    (void)sprintf(content_len, "Content-Length:%d", strlen((const char *)body) + 1);
-    int response_length = sprintf(response, "%s\n%s\n%s\n%s\n%s\n\n%s",
-        header, date, connection, content_len, content_type, (char *)body);
-    if (response_length <= 0) {
-        perror("generate response message failed");
+ * Return the number of bytes sent, or -1 on error.
+ */
+int send_response(http_conn *conn, char *header, char *content_type, void *body,
+                  int content_length)
+{
+    return send_response_ext(conn, header, content_type, NULL, body, content_length);
+}
+
+/**
+ * Stream a file response one pooled chunk at a time
+ *
+ * The header goes out before the file is read, so the client sees the first
+ * byte as soon as the first chunk is ready and memory stays at one chunk.
+ *
+ * Return the number of bytes sent, or -1 on error.
+ */
+long send_file_stream(http_conn *conn, char *header, char *content_type, file_reader *reader)
+{
+    char *response = arena_alloc(&conn->arena, MAX_HEADER_SIZE);
+    long total = 0;
+    void *chunk;
+    int chunk_length;
+
+    if (response == NULL) {
+        fprintf(stderr, "no memory for response header\n");
+        return -1;
+    }
+    int response_length = format_header(response, MAX_HEADER_SIZE, header, content_type,
+                                        (long)reader->size, NULL);
+    if (response_length < 0) {
+        fprintf(stderr, "generate response message failed\n");
+        return -1;
+    }
+    response_started(conn, header);
+    if (send_all(conn, response, response_length) < 0) {
         return -1;
     }
-    response_length += 1;
+    total += response_length;
+    conn->bytes_sent += response_length;
 
-    // Send it all!
-    int rv = send(fd, response, response_length, 0);
+    while ((chunk_length = file_reader_next(reader, &chunk)) > 0) {
+        if (send_all(conn, chunk, chunk_length) < 0) {
+            return -1;
+        }
+        total += chunk_length;
+        conn->bytes_sent += chunk_length;
+    }
 
-    if (rv < 0) {
-        perror("send");
+    if (chunk_length < 0) {
+        // Headers are gone already; all we can do is cut the connection short
+        fprintf(stderr, "read failed while streaming file\n");
+        return -1;
     }
 
-    return rv;
+    return total;
 }
 
 int itoa(int num, char *buffer, int butter_len)
@@ -111,29 +377,64 @@ int itoa(int num, char *buffer, int butter_len)
 /**
  * Send a /d20 endpoint response
  */
-void get_d20(int fd)
+void get_d20(http_conn *conn)
 {
     // Generate a random number between 1 and 20 inclusive
     srand((unsigned)time(NULL));
     int random_num = rand() % 20 + 1;
-    char random_num_str[3] = {0};
+    char random_num_str[4] = {0};
 
-    (void)itoa(random_num, random_num_str, 3);
-    send_response(fd, "HTTP/1.1 200 OK", "text/plain", random_num_str, sizeof(random_num_str));
+    (void)itoa(random_num, random_num_str, sizeof(random_num_str));
+    send_response(conn, "HTTP/1.1 200 OK", "text/plain", random_num_str, strlen(random_num_str));
     return;
 }
 
+/**
+ * Send a /metrics endpoint response
+ */
+void get_metrics(http_conn *conn)
+{
+    struct metrics_gauges gauges;
+    size_t queued, busy, shed, io_queued, io_busy;
+    bool overloaded;
+    int entries;
+
+    memset(&gauges, 0, sizeof gauges);
+    for (int i = 0; i < num_request_pools; i++) {
+        threadpool_stats(request_pools[i], &queued, &busy);
+        threadpool_admission_stats(request_pools[i], &overloaded, &shed);
+        gauges.queue_depth += queued;
+        gauges.busy_workers += busy;
+        gauges.workers += request_pools[i]->pool_size;
+        gauges.overloaded |= overloaded;
+        gauges.shed += shed;
+    }
+    threadpool_stats(conn->io_pool, &io_queued, &io_busy);
+    gauges.io_queue_depth = io_queued;
+    gauges.io_busy_workers = io_busy;
+    gauges.io_workers = conn->io_pool->pool_size;
+    cache_stats(conn->cache, &entries, &gauges.cache_evictions);
+    gauges.cache_entries = entries;
+
+    char *body = arena_alloc(&conn->arena, METRICS_BUFFER_SIZE);
+    int length = body == NULL ? -1 : metrics_format(body, METRICS_BUFFER_SIZE, &gauges);
+    if (length < 0) {
+        send_response(conn, "HTTP/1.1 500 INTERNAL SERVER ERROR", "text/plain", "", 0);
+        return;
+    }
+
+    send_response(conn, "HTTP/1.1 200 OK", "text/plain; version=0.0.4", body, length);
+}
+
 /**
  * Send a 404 response
  */
-void resp_404(int fd)
+void resp_404(http_conn *conn)
 {
-    char filepath[4096];
+    char *filepath = SERVER_FILES "/404.html";
     file_data *filedata; 
-    char *mime_type;
 
     // Fetch the 404.html file
-    snprintf(filepath, sizeof filepath, "%s/404.html", SERVER_FILES);
     filedata = file_load(filepath);
 
     if (filedata == NULL) {
@@ -142,36 +443,254 @@ void resp_404(int fd)
         exit(3);
     }
 
-    mime_type = mime_type_get(filepath);
-
-    send_response(fd, "HTTP/1.1 404 NOT FOUND", mime_type, filedata->data, filedata->size);
+    send_response(conn, "HTTP/1.1 404 NOT FOUND", filedata->mime_type, filedata->data,
+                  filedata->size);
 
     file_free(filedata);
 }
 
 /**
- * Read and return a file from disk or cache
+ * Send a file from the cache
+ *
+ * Return 0 if it was sent, -1 if it isn't cached and has to be loaded.
  */
-void get_file(int fd, cache *cache, char *request_path)
+int get_cached_file(http_conn *conn, char *request_path)
 {
-    cache_entry *entry = cache_get(cache, request_path);
-    char *real_path = request_path;
+    cache_entry *entry = cache_get(conn->cache, request_path);
+    trace_mark(conn, TRACE_CACHE);
     if (entry == NULL) {
-        file_data *file = file_load(request_path);
-        if (file == NULL) {
-            file = file_load(DEFAULT_PAGE);
-            real_path = DEFAULT_PAGE;
+        conn->flags |= ACCESS_CACHE_MISS;
+        return -1;
+    }
+
+    conn->flags |= ACCESS_CACHE_HIT;
+    send_response(conn, "HTTP/1.1 200 OK", entry->content_type, entry->content,
+                  entry->content_length);
+    cache_release(entry);
+    return 0;
+}
+
+/**
+ * Whether a request path stays under SERVER_ROOT
+ *
+ * It has to be absolute and have no ".." segment; nothing is URL-decoded,
+ * so there's no other way to spell one.
+ */
+static int path_is_safe(const char *path)
+{
+    if (path[0] != '/') {
+        return 0;
+    }
+    for (const char *p = path; (p = strstr(p, "..")) != NULL; p += 2) {
+        if (p[-1] == '/' && (p[2] == '/' || p[2] == '\0')) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Read a file from disk, send it and cache it
+ *
+ * Files of CACHE_MMAP_THRESHOLD bytes or more are cached as an mmap of the
+ * file rather than a heap copy. Files of FILE_STREAM_THRESHOLD bytes or more
+ * are streamed straight from disk and never cached. Paths with no file get
+ * DEFAULT_PAGE. Paths that would leave SERVER_ROOT get a 404.
+ */
+void load_file(http_conn *conn, char *request_path)
+{
+    cache *cache = conn->cache;
+    if (!path_is_safe(request_path)) {
+        resp_404(conn);
+        return;
+    }
+    int filepath_size = sizeof SERVER_ROOT + strlen(request_path);
+    char *filepath = arena_alloc(&conn->arena, filepath_size);
+    if (filepath == NULL) {
+        resp_404(conn);
+        return;
+    }
+    char *real_path = filepath;
+    char *cache_path = request_path;
+    snprintf(filepath, filepath_size, "%s%s", SERVER_ROOT, request_path);
+
+    file_reader *reader = file_reader_open(filepath, FILE_ADVICE_WILLNEED);
+    if (reader == NULL) {
+        // Still cached under the request path: that's what get_cached_file()
+        // looks up, and "/" is the busiest URL there is
+        real_path = DEFAULT_PAGE;
+        reader = file_reader_open(DEFAULT_PAGE, FILE_ADVICE_WILLNEED);
+        if (reader == NULL) {
+            resp_404(conn);
+            return;
         }
-        char *content_type = mime_type_get(real_path);
-        cache_put(cache, real_path, content_type, file->data, file->size);
-        send_response(fd, "HTTP/1.1 200 OK", content_type, file->data, file->size);
+    }
+    char *content_type = reader->mime_type;
+
+    if (reader->size >= FILE_STREAM_THRESHOLD) {
+        send_file_stream(conn, "HTTP/1.1 200 OK", content_type, reader);
+        file_reader_close(reader);
         return;
     }
-    send_response(fd, "HTTP/1.1 200 OK", entry->content_type, entry->content,
-                  entry->content_length);
+    off_t file_size = reader->size;
+    file_reader_close(reader);
+
+    if (file_size >= CACHE_MMAP_THRESHOLD) {
+        int map_length;
+        void *map = file_map(real_path, &map_length);
+        trace_mark(conn, TRACE_LOAD);
+        if (map != NULL) {
+            send_response(conn, "HTTP/1.1 200 OK", content_type, map, map_length);
+            cache_put_mapped(cache, cache_path, content_type, map, map_length);
+            return;
+        }
+    }
+
+    file_data *file = file_load(real_path);
+    trace_mark(conn, TRACE_LOAD);
+    if (file == NULL) {
+        resp_404(conn);
+        return;
+    }
+    cache_put(cache, cache_path, content_type, file->data, file->size);
+    send_response(conn, "HTTP/1.1 200 OK", content_type, file->data, file->size);
+    file_free(file);
     return;
 }
 
+/**
+ * Find the value of a request header
+ *
+ * Copies at most size - 1 bytes of the value into value.
+ *
+ * Return 0 if the header was found, -1 if not.
+ */
+int get_request_header(char *request, char *name, char *value, int size)
+{
+    int name_length = strlen(name);
+    char *line = strchr(request, '\n'); // Skip the request line
+
+    while (line != NULL) {
+        line++;
+        if (*line == '\r' || *line == '\n' || *line == '\0') {
+            break; // End of the header
+        }
+        if (strncasecmp(line, name, name_length) == 0 && line[name_length] == ':') {
+            char *p = line + name_length + 1;
+            int i = 0;
+            while (*p == ' ' || *p == '\t') {
+                p++;
+            }
+            while (p[i] != '\r' && p[i] != '\n' && p[i] != '\0' && i < size - 1) {
+                value[i] = p[i];
+                i++;
+            }
+            value[i] = '\0';
+            return 0;
+        }
+        line = strchr(line, '\n');
+    }
+
+    return -1;
+}
+
+/**
+ * Whether an Accept-Encoding value allows a gzip body
+ *
+ * Walks the comma-separated codings: an explicit gzip (or x-gzip) entry
+ * decides, else a * entry does, and a q of 0 in either means "not this".
+ */
+int accepts_gzip(char *value)
+{
+    int gzip = -1, any = -1;
+    char *p = value;
+
+    while (*p != '\0') {
+        while (*p == ' ' || *p == '\t' || *p == ',') {
+            p++;
+        }
+        char *token = p;
+        while (*p != '\0' && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') {
+            p++;
+        }
+        int token_length = p - token;
+
+        // Only the q parameter matters; it defaults to 1
+        double q = 1;
+        while (*p != '\0' && *p != ',') {
+            if (*p == ';') {
+                p++;
+                while (*p == ' ' || *p == '\t') {
+                    p++;
+                }
+                if ((*p == 'q' || *p == 'Q') && p[1] == '=') {
+                    q = strtod(p + 2, &p);
+                    continue;
+                }
+            }
+            p++;
+        }
+
+        int accepted = q > 0;
+        if ((token_length == 4 && strncasecmp(token, "gzip", 4) == 0) ||
+            (token_length == 6 && strncasecmp(token, "x-gzip", 6) == 0)) {
+            gzip = accepted;
+        } else if (token_length == 1 && *token == '*') {
+            any = accepted;
+        }
+    }
+
+    return gzip != -1 ? gzip : any == 1;
+}
+
+/**
+ * Serve a file out of the mmap'd asset bundle
+ *
+ * Sends the precompressed body when the client accepts gzip, and honors
+ * If-None-Match against the ETag of whichever body would be sent.
+ */
+void get_bundle_file(http_conn *conn, char *request_path, char *request)
+{
+    bundle *bundle = conn->bundle;
+    conn->flags |= ACCESS_BUNDLE;
+    bundle_file file;
+    char value[256];
+    char extra[128];
+
+    if (bundle_lookup(bundle, request_path, &file) == -1 &&
+        bundle_lookup(bundle, DEFAULT_BUNDLE_PAGE, &file) == -1) {
+        resp_404(conn);
+        return;
+    }
+    trace_mark(conn, TRACE_CACHE);
+
+    // Each body has its own ETag, so validate against the one we'd send
+    int gzip = file.gzip_data != NULL &&
+               get_request_header(request, "Accept-Encoding", value, sizeof value) == 0 &&
+               accepts_gzip(value);
+    const char *etag = gzip ? file.gzip_etag : file.etag;
+    const char *vary = file.gzip_data != NULL ? "Vary: Accept-Encoding\r\n" : "";
+
+    if (get_request_header(request, "If-None-Match", value, sizeof value) == 0 &&
+        strcmp(value, etag) == 0) {
+        snprintf(extra, sizeof extra, "ETag: %s\r\n%s", etag, vary);
+        send_response_ext(conn, "HTTP/1.1 304 NOT MODIFIED", (char *)file.content_type, extra,
+                          NULL, 0);
+        return;
+    }
+
+    if (gzip) {
+        snprintf(extra, sizeof extra, "ETag: %s\r\n%sContent-Encoding: gzip\r\n", etag, vary);
+        send_response_ext(conn, "HTTP/1.1 200 OK", (char *)file.content_type, extra,
+                          file.gzip_data, file.gzip_length);
+        return;
+    }
+
+    snprintf(extra, sizeof extra, "ETag: %s\r\n%s", etag, vary);
+    send_response_ext(conn, "HTTP/1.1 200 OK", (char *)file.content_type, extra,
+                      file.data, file.length);
+}
+
 /**
  * Search for the end of the HTTP header
  * 
@@ -185,48 +704,316 @@ char *find_start_of_body(char *header)
     ///////////////////
 }
 
+/**
+ * Queue the access log record for a finished request
+ */
+void log_access(http_conn *conn, uint64_t done_ns)
+{
+    struct access_record rec;
+
+    memset(&rec, 0, sizeof rec);
+    rec.bytes = conn->bytes_sent;
+    rec.fd = conn->fd;
+    rec.status = conn->status;
+    rec.method = conn->method;
+    rec.flags = conn->flags;
+    rec.family = conn->family;
+    memcpy(rec.addr, conn->addr, sizeof rec.addr);
+    if (conn->path != NULL) {
+        strncpy(rec.path, conn->path, sizeof rec.path - 1);
+    }
+
+    access_set_phases(&rec, conn->accepted_ns, conn->started_ns, conn->parsed_ns,
+                      conn->sent_ns, done_ns);
+
+    access_log_write(&rec);
+}
+
+/**
+ * Queue the trace span for a finished, sampled request
+ */
+void trace_request(http_conn *conn)
+{
+    struct trace_span span;
+
+    trace_mark(conn, TRACE_SEND);
+    memcpy(span.ts, conn->trace_ts, sizeof span.ts);
+    span.fd = conn->fd;
+    span.tid = trace_thread_id();
+    memset(span.path, 0, sizeof span.path);
+    if (conn->path != NULL) {
+        strncpy(span.path, conn->path, sizeof span.path - 1);
+    }
+
+    trace_write(&span);
+}
+
+/**
+ * Hand everything the request allocated back and close the connection
+ */
+void close_connection(http_conn *conn)
+{
+    uint64_t done_ns = access_clock_ns();
+
+    // Before close(): the fd mustn't be shut down after it's been reused
+    cancel_timeout(conn);
+    log_access(conn, done_ns);
+    if (conn->traced) {
+        trace_request(conn);
+    }
+    metrics_request(conn->status, conn->bytes_sent, conn->flags & ACCESS_CACHE_HIT,
+                    conn->flags & ACCESS_CACHE_MISS,
+                    access_interval_us(conn->accepted_ns, conn->sent_ns),
+                    access_interval_us(conn->accepted_ns, done_ns));
+    close(conn->fd);
+    arena_reset(&conn->arena);
+    free(conn);
+}
+
+/**
+ * Turn a connection away with a 503
+ *
+ * Runs on whichever thread failed to queue the connection, the acceptor
+ * included, so it must not block: the response is small enough to fit in
+ * an empty socket buffer.
+ */
+void reject_http_request(void *args)
+{
+    http_conn *conn = (http_conn *)args;
+    char extra[32];
+    char discard[1024];
+
+    if (conn->started_ns == 0) {
+        conn->started_ns = access_clock_ns();
+    }
+    snprintf(extra, sizeof extra, "Retry-After: %d\r\n", RETRY_AFTER_SECONDS);
+    send_response_ext(conn, "HTTP/1.1 503 SERVICE UNAVAILABLE", "text/plain", extra, "", 0);
+    // Whatever the client already sent would make close() reset the
+    // connection, and the client might never see the 503
+    shutdown(conn->fd, SHUT_WR);
+    while (recv(conn->fd, discard, sizeof discard, MSG_DONTWAIT) > 0) {
+    }
+    close_connection(conn);
+}
+
+/**
+ * Pick the admission policy from WEBSERVER_ADMISSION (pause, reject or drop)
+ */
+tpool_admission admission_policy(void)
+{
+    char *policy = getenv("WEBSERVER_ADMISSION");
+
+    if (policy == NULL || strcmp(policy, "reject") == 0) {
+        return TPOOL_ADMIT_REJECT;
+    }
+    if (strcmp(policy, "pause") == 0) {
+        return TPOOL_ADMIT_PAUSE;
+    }
+    if (strcmp(policy, "drop") == 0) {
+        return TPOOL_ADMIT_DROP_OLDEST;
+    }
+    log_warn("webserver: unknown WEBSERVER_ADMISSION \"%s\", rejecting when overloaded", policy);
+    return TPOOL_ADMIT_REJECT;
+}
+
+/**
+ * I/O pool task: serve a cache miss from disk
+ */
+void handle_file_load(void *args)
+{
+    http_conn *conn = (http_conn *)args;
+
+    load_file(conn, conn->path);
+    log_debug("close fd %d, finished loading %s", conn->fd, conn->path);
+    close_connection(conn);
+}
+
+/**
+ * Hand a cache miss to the I/O pool
+ *
+ * Request workers never wait on the disk, so hits don't queue up behind
+ * misses. The connection belongs to the I/O task from here on.
+ */
+void queue_file_load(http_conn *conn)
+{
+    tpool_task task;
+
+    task.task_routine = (void *)handle_file_load;
+    task.reject_routine = reject_http_request;
+    task.args = conn;
+    if (add_task_in_threadpool(conn->io_pool, &task) != 0) {
+        reject_http_request(conn);
+    }
+}
+
+/**
+ * Read a CPU list like "0-3,8" from an environment variable
+ *
+ * Return the number of CPUs, 0 if it's unset or malformed.
+ */
+int env_cpus(const char *name, int *cpus)
+{
+    char *list = getenv(name);
+    if (list == NULL) {
+        return 0;
+    }
+    int n = affinity_parse_cpus(list, cpus, AFFINITY_MAX_CPUS);
+    if (n <= 0) {
+        log_warn("webserver: ignoring %s=\"%s\", expected a CPU list like 0-3,8", name, list);
+        return 0;
+    }
+    return n;
+}
+
+/**
+ * Create the request pools
+ *
+ * WEBSERVER_NUMA=1 makes one pool per NUMA node, its workers pinned to that
+ * node's CPUs; connections then go to the pool on the node whose CPU took
+ * their packets (SO_INCOMING_CPU), so a request never crosses nodes.
+ * Otherwise there's a single pool, pinned to WEBSERVER_CPUS if that's set.
+ *
+ * Return 0 on success, -1 on error.
+ */
+int setup_request_pools(void)
+{
+    static int cpus[AFFINITY_MAX_CPUS];
+    char *numa = getenv("WEBSERVER_NUMA");
+    int nodes = affinity_num_nodes();
+
+    if (numa != NULL && strcmp(numa, "1") == 0 && nodes > 1) {
+        if (nodes > MAX_REQUEST_POOLS) {
+            nodes = MAX_REQUEST_POOLS;
+        }
+        for (int node = 0; node < nodes; node++) {
+            int n = affinity_node_cpus(node, cpus, AFFINITY_MAX_CPUS);
+            if (n <= 0) {
+                continue; // Memory-only node
+            }
+            for (int i = 0; i < n; i++) {
+                // CPUs past the table fall back to pool 0 in request_pool_for()
+                if (cpus[i] >= 0 && cpus[i] < AFFINITY_MAX_CPUS) {
+                    cpu_pool[cpus[i]] = num_request_pools;
+                }
+            }
+            request_pools[num_request_pools] = create_threadpool_pinned(REQUEST_POOL_SIZE, cpus, n);
+            if (request_pools[num_request_pools] == NULL) {
+                return -1;
+            }
+            num_request_pools++;
+        }
+        log_info("webserver: %d request pools, one per NUMA node", num_request_pools);
+    }
+
+    if (num_request_pools == 0) {
+        int n = env_cpus("WEBSERVER_CPUS", cpus);
+        request_pools[0] = create_threadpool_pinned(REQUEST_POOL_SIZE, n > 0 ? cpus : NULL, n);
+        if (request_pools[0] == NULL) {
+            return -1;
+        }
+        num_request_pools = 1;
+    }
+
+    for (int i = 0; i < num_request_pools; i++) {
+        threadpool_set_admission(request_pools[i], MAX_QUEUED_CONNECTIONS, admission_policy(), 0, 0);
+    }
+    return 0;
+}
+
+/**
+ * The request pool for a newly accepted connection
+ */
+thread_pool *request_pool_for(int fd)
+{
+    if (num_request_pools > 1) {
+        int cpu = affinity_incoming_cpu(fd);
+        if (cpu >= 0 && cpu < AFFINITY_MAX_CPUS) {
+            return request_pools[cpu_pool[cpu]];
+        }
+    }
+    return request_pools[0];
+}
+
 /**
  * Handle HTTP request and send response
  */
 
 void handle_http_request(void *args)
 {
-    const int request_buffer_size = 65536; // 64K
-    char request[request_buffer_size];
-    handle_request_args *args_real = (handle_request_args *)args;
-    int fd = args_real->fd;
-    cache *cache = args_real->cache;
+    http_conn *conn = (http_conn *)args;
+    int fd = conn->fd;
+    conn->started_ns = access_clock_ns();
+    if (conn->traced) {
+        conn->trace_ts[TRACE_DEQUEUE] = trace_last_dequeue();
+    }
+    char *request = arena_alloc(&conn->arena, REQUEST_BUFFER_SIZE);
+    if (request == NULL) {
+        fprintf(stderr, "no memory for request buffer\n");
+        close_connection(conn);
+        return;
+    }
     // Read request
-    int bytes_recvd = recv(fd, request, request_buffer_size - 1, 0);
-    printf("recv fd%d bytes_recvd = %d\n", fd, bytes_recvd);
+    arm_timeout(conn, TIMEOUT_HEADER, HEADER_TIMEOUT_MS);
+    int bytes_recvd = recv(fd, request, REQUEST_BUFFER_SIZE - 1, 0);
+    cancel_timeout(conn);
+    trace_mark(conn, TRACE_RECV);
+    log_debug("recv fd %d bytes_recvd = %d", fd, bytes_recvd);
+    if (conn->timed_out == TIMEOUT_HEADER) {
+        log_debug("fd %d: no request after %d ms", fd, HEADER_TIMEOUT_MS);
+        send_response(conn, "HTTP/1.1 408 REQUEST TIMEOUT", "text/plain", "", 0);
+        close_connection(conn);
+        return;
+    }
     if (bytes_recvd < 0) {
         perror("recv");
+        close_connection(conn);
+        return;
+    }
+    if (bytes_recvd == 0) {
+        // The client closed without sending anything
+        close_connection(conn);
         return;
     }
+    request[bytes_recvd] = '\0';
 
-    char request_type[5] = {0};
-    char request_file[200] = {0};
-    (void)sscanf(request, "%s %s", request_type, request_file);
+    // The path can't be longer than the request it came from
+    char request_type[8] = {0};
+    char *request_file = arena_alloc(&conn->arena, bytes_recvd + 1);
+    if (request_file == NULL) {
+        fprintf(stderr, "no memory for request path\n");
+        close_connection(conn);
+        return;
+    }
+    request_file[0] = '\0';
+    (void)sscanf(request, "%7s %s", request_type, request_file);
+    conn->path = request_file;
+    conn->method = strcmp(request_type, "GET") == 0 ? ACCESS_METHOD_GET :
+                   strcmp(request_type, "POST") == 0 ? ACCESS_METHOD_POST :
+                   strcmp(request_type, "HEAD") == 0 ? ACCESS_METHOD_HEAD : ACCESS_METHOD_OTHER;
+    conn->parsed_ns = access_clock_ns();
+    trace_mark(conn, TRACE_PARSE);
     for (int i = 0; i < REQUEST_NUM; i++) {
         if (strncmp(request_type, "GET", strlen(request_type)) == 0) {
             if ((strlen(request_file) == strlen("/d20")) &&
                 (strncmp(request_file, "/d20", strlen(request_file)) == 0)) {
-                get_d20(fd);
-                printf("--------------------------------------\n");
-                printf("close fd : %d\n", fd);
-                printf("finish task\nrequest type: %s\nrequest file: %s\n", request_type,
-                                                                            request_file);
-                printf("--------------------------------------\n");
-                close(fd);
+                get_d20(conn);
+                log_debug("close fd %d, finished %s %s", fd, request_type, request_file);
+                close_connection(conn);
+                return;
+            } else if (strcmp(request_file, "/metrics") == 0) {
+                get_metrics(conn);
+                log_debug("close fd %d, finished %s %s", fd, request_type, request_file);
+                close_connection(conn);
                 return;
             } else {
-                get_file(fd, cache, request_file);
-                printf("--------------------------------------\n");
-                printf("close fd : %d\n", fd);
-                printf("finish task\nrequest type: %s\nrequest file: %s\n", request_type,
-                                                                            request_file);
-                printf("--------------------------------------\n");
-                close(fd);
+                if (conn->bundle != NULL) {
+                    get_bundle_file(conn, request_file, request);
+                } else if (get_cached_file(conn, request_file) == -1) {
+                    queue_file_load(conn);
+                    return;
+                }
+                log_debug("close fd %d, finished %s %s", fd, request_type, request_file);
+                close_connection(conn);
                 return;
             }
         }
@@ -239,68 +1026,392 @@ void handle_http_request(void *args)
     // If GET, handle the get endpoints
 
     //    Check if it's /d20 and handle that special case
-    //    Otherwise serve the requested file by calling get_file()
+    //    Otherwise serve the requested file: get_cached_file(), else load_file()
 
 
     // (Stretch) If POST, handle the post request
+    close_connection(conn);
 }
 
 /**
- * Main
+ * Signal handler for SIGTERM and SIGINT: start a graceful shutdown
+ */
+static void handle_stop_signal(int sig, siginfo_t *info, void *context)
+{
+    (void)sig;
+    (void)context;
+    stopped_by = info->si_code == SI_USER ? info->si_pid : 0;
+    stopping = 1;
+}
+
+/**
+ * Signal handler for SIGUSR2 and SIGCHLD, acted on by the main loop
+ */
+static void handle_upgrade_signal(int sig)
+{
+    if (sig == SIGUSR2) {
+        upgrade_requested = 1;
+    } else {
+        child_exited = 1;
+    }
+}
+
+/**
+ * Start a new copy of the server on the same listening socket
+ *
+ * The new process finds the listener in LISTEN_FD_ENV and our pid in
+ * UPGRADE_FROM_ENV. Both accept until it's ready and sends us SIGTERM, so
+ * the listen queue is never left unattended.
+ *
+ * Return the new process's pid, or -1 on error.
+ */
+pid_t start_upgrade(char **argv, int listenfd, const sigset_t *orig_mask)
+{
+    extern char **environ;
+    char fd_var[64], pid_var[64];
+    int n = 0, count = 0;
+
+    while (environ[n] != NULL) {
+        n++;
+    }
+    // Built before fork(): only async-signal-safe calls are allowed after it
+    char **envp = malloc((n + 3) * sizeof *envp);
+    if (envp == NULL) {
+        perror("malloc upgrade environment");
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        if (strncmp(environ[i], LISTEN_FD_ENV "=", strlen(LISTEN_FD_ENV) + 1) != 0 &&
+            strncmp(environ[i], UPGRADE_FROM_ENV "=", strlen(UPGRADE_FROM_ENV) + 1) != 0) {
+            envp[count++] = environ[i];
+        }
+    }
+    snprintf(fd_var, sizeof fd_var, LISTEN_FD_ENV "=%d", listenfd);
+    snprintf(pid_var, sizeof pid_var, UPGRADE_FROM_ENV "=%d", (int)getpid());
+    envp[count++] = fd_var;
+    envp[count++] = pid_var;
+    envp[count] = NULL;
+
+    log_flush();
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Nothing but the listener (and stdio) survives into the new binary
+        if (listenfd > 3) {
+            close_range(3, listenfd - 1, 0);
+        }
+        close_range(listenfd + 1, ~0U, 0);
+        sigprocmask(SIG_SETMASK, orig_mask, NULL);
+        // Not the pinned acceptor's mask, or the new binary starts on one CPU
+        sched_setaffinity(0, sizeof startup_cpus, &startup_cpus);
+        execve(argv[0], argv, envp);
+        _exit(127);
+    }
+    if (pid == -1) {
+        perror("fork");
+    }
+    free(envp);
+
+    return pid;
+}
+
+/**
+ * Listening socket handed over by the process being upgraded, -1 if none
+ */
+int inherited_listener(const char *fd_var)
+{
+    int listening = 0;
+    socklen_t len = sizeof listening;
+    char *end;
+
+    if (fd_var == NULL) {
+        return -1;
+    }
+    long fd = strtol(fd_var, &end, 10);
+    if (end == fd_var || *end != '\0' || fd < 0 ||
+        getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) == -1 || !listening) {
+        log_warn("webserver: %s=%s is not a listening socket", LISTEN_FD_ENV, fd_var);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Accept one connection and queue it for a request worker
+ *
+ * Return 0 if a connection was handled, -1 if there was none to accept.
  */
-int main(void)
+int accept_connection(int listenfd, struct server_state *server)
 {
-    int newfd;  // listen on sock_fd, new connection on newfd
     struct sockaddr_storage their_addr; // connector's address information
+    socklen_t sin_size = sizeof their_addr;
     char s[INET6_ADDRSTRLEN];
 
-    cache *cache = cache_create(10, 0);
-    printf("--------------------------------------\n");
-    thread_pool *threadpool = create_threadpool(10);
-    printf("--------------------------------------\n");
-    // Get a listening socket
-    int listenfd = get_listener_socket(PORT);
+    int newfd = accept(listenfd, (struct sockaddr *)&their_addr, &sin_size);
+    if (newfd == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            perror("accept");
+        }
+        return -1;
+    }
+    // Print out a message that we got the connection
+    inet_ntop(their_addr.ss_family,
+        get_in_addr((struct sockaddr *)&their_addr),
+        s, sizeof s);
+    log_debug("fd is %d, server: got connection from %s", newfd, s);
+
+    // newfd is a new socket descriptor for the new connection.
+    // listenfd is still listening for new connections.
+    tpool_task task;
+    task.task_routine = (void *)handle_http_request;
+    task.reject_routine = reject_http_request;
+    // Owned by the task from here on; handle_http_request() frees it
+    http_conn *conn = malloc(sizeof *conn);
+    if (conn == NULL) {
+        perror("malloc connection");
+        close(newfd);
+        return 0;
+    }
+    memset(conn, 0, sizeof *conn);
+    conn->traced = trace_sample();
+    trace_mark(conn, TRACE_ACCEPT);
+    conn->accepted_ns = access_clock_ns();
+    conn->fd = newfd;
+    conn->cache = server->cache;
+    conn->bundle = server->bundle;
+    conn->pool = request_pool_for(newfd);
+    conn->io_pool = server->io_pool;
+    conn->timers = server->timers;
+    timer_init(&conn->timeout, connection_timed_out, conn);
+    arena_init(&conn->arena);
+    conn->family = their_addr.ss_family;
+    memcpy(conn->addr, get_in_addr((struct sockaddr *)&their_addr),
+           their_addr.ss_family == AF_INET ? 4 : 16);
+    task.args = (void *)conn;
+    trace_mark(conn, TRACE_ENQUEUE);
+    if (add_task_in_threadpool(conn->pool, &task) != 0) {
+        reject_http_request(conn);
+    }
+    return 0;
+}
+
+/**
+ * Connections waiting in a listening socket's accept queue, -1 if unknown
+ */
+static int accept_queue_length(int listenfd)
+{
+    struct tcp_info info;
+    socklen_t len = sizeof info;
+
+    if (getsockopt(listenfd, IPPROTO_TCP, TCP_INFO, &info, &len) == -1) {
+        return -1;
+    }
+    return info.tcpi_unacked; // What a listener reports here
+}
+
+/**
+ * Stop accepting, finish every accepted request, and release everything
+ *
+ * Connections already in the accept backlog when this is called are taken
+ * and served rather than reset; ones arriving after that aren't. After a
+ * hot upgrade (handoff) the backlog is left alone: the new process shares
+ * the listener and accepts from it. If requests are still running at the
+ * deadline the server exits anyway, without waiting for their workers.
+ *
+ * Return 0 if everything drained, -1 if the deadline cut it short.
+ */
+int shutdown_server(int listenfd, struct server_state *server, int handoff)
+{
+    uint64_t deadline_ns = access_clock_ns() + DRAIN_TIMEOUT_MS * 1000000ull;
+    int backlog = handoff ? 0 : accept_queue_length(listenfd);
+    int drained = 1;
+
+    log_info("webserver: shutting down, draining requests");
+    // Without a count, the deadline stops us if arrivals keep the queue full
+    for (int i = 0; backlog < 0 || i < backlog; i++) {
+        if (access_clock_ns() >= deadline_ns || accept_connection(listenfd, server) == -1) {
+            break;
+        }
+    }
+    close(listenfd);
+
+    // Request workers may still hand misses to the I/O pool, so it goes last
+    for (int i = 0; i <= num_request_pools && drained; i++) {
+        thread_pool *pool = i < num_request_pools ? request_pools[i] : server->io_pool;
+        uint64_t now_ns = access_clock_ns();
+        int left_ms = now_ns < deadline_ns ? (deadline_ns - now_ns) / 1000000 : 0;
+        drained = threadpool_wait_idle(pool, left_ms) == 0;
+    }
+
+    if (drained) {
+        for (int i = 0; i < num_request_pools; i++) {
+            threadpool_destroy(request_pools[i]);
+        }
+        threadpool_destroy(server->io_pool);
+        timer_wheel_destroy(server->timers);
+        cache_free(server->cache);
+        if (server->bundle != NULL) {
+            bundle_close(server->bundle);
+        }
+        log_info("webserver: all requests finished");
+    } else {
+        log_warn("webserver: requests still running after %d ms, exiting anyway", DRAIN_TIMEOUT_MS);
+    }
+
+    access_log_close();
+    trace_stop();
+    log_flush();
+
+    return drained ? 0 : -1;
+}
+
+/**
+ * Main
+ */
+int main(int argc, char **argv)
+{
+    struct server_state server;
+    sigset_t stop_signals, wait_mask;
+    struct sigaction sa;
+    pid_t upgrade_pid = 0; // New binary started by SIGUSR2 that hasn't taken over yet
+    (void)argc;
+
+    // Only the main thread takes SIGTERM/SIGINT/SIGUSR2/SIGCHLD, and only
+    // inside ppoll(), so every thread started from here on inherits them blocked
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGTERM);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGUSR2);
+    sigaddset(&stop_signals, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, &wait_mask);
+    memset(&sa, 0, sizeof sa);
+    sa.sa_sigaction = handle_stop_signal;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sa.sa_handler = handle_upgrade_signal;
+    sa.sa_flags = 0;
+    sigaction(SIGUSR2, &sa, NULL);
+    sigaction(SIGCHLD, &sa, NULL);
+
+    // Set if we're the new binary of a hot upgrade. Cleared so they don't
+    // leak into the next upgrade, before any other thread could read environ.
+    char *listen_fd_var = getenv(LISTEN_FD_ENV);
+    char *upgrade_from_var = getenv(UPGRADE_FROM_ENV);
+    listen_fd_var = listen_fd_var != NULL ? strdup(listen_fd_var) : NULL;
+    pid_t upgrade_from = upgrade_from_var != NULL ? atoi(upgrade_from_var) : 0;
+    unsetenv(LISTEN_FD_ENV);
+    unsetenv(UPGRADE_FROM_ENV);
+
+    if (log_start(STDOUT_FILENO) == -1) {
+        exit(1);
+    }
+    server.cache = cache_create(10, 0);
+    if (http_date_start() == -1) {
+        exit(1);
+    }
+    char *trace_path = getenv("WEBSERVER_TRACE");
+    if (trace_path != NULL && trace_start(trace_path, TRACE_SAMPLE_EVERY) == 0) {
+        log_info("webserver: tracing 1 in %d requests to %s", TRACE_SAMPLE_EVERY, trace_path);
+    }
+    if (access_log_open(ACCESS_LOG) == -1) {
+        log_warn("webserver: not writing an access log");
+    }
+    if (mime_load(MIME_TYPES) == 0) {
+        log_info("webserver: loaded MIME types from %s", MIME_TYPES);
+    }
+    // Serve from the packed bundle if one was deployed, else from SERVER_ROOT
+    server.bundle = bundle_open(SERVER_BUNDLE);
+    if (server.bundle != NULL) {
+        log_info("webserver: serving %u files from %s", server.bundle->header->entry_count,
+                 SERVER_BUNDLE);
+    }
+    static int cpus[AFFINITY_MAX_CPUS];
+    int num_io_cpus = env_cpus("WEBSERVER_IO_CPUS", cpus);
+    server.io_pool = create_threadpool_pinned(IO_POOL_SIZE, num_io_cpus > 0 ? cpus : NULL,
+                                              num_io_cpus);
+    if (server.io_pool == NULL || setup_request_pools() == -1) {
+        exit(1);
+    }
+    // Pausing would stall a request worker, so a backed-up disk sheds instead.
+    // Only on a full queue, though: a few slow downloads keep queue wait
+    // high long before the disk is the problem.
+    threadpool_set_admission(server.io_pool, MAX_QUEUED_LOADS, TPOOL_ADMIT_REJECT,
+                             TPOOL_NO_TARGET, 0);
+    server.timers = timer_wheel_create(TIMER_TICK_MS);
+    if (server.timers == NULL || timer_wheel_start(server.timers) == -1) {
+        exit(1);
+    }
+    // Pin the acceptor only now: threads inherit their creator's CPU mask,
+    // so pinning earlier would confine every unpinned thread to this CPU
+    sched_getaffinity(0, sizeof startup_cpus, &startup_cpus);
+    if (env_cpus("WEBSERVER_LISTENER_CPU", cpus) > 0 && affinity_pin_self(cpus[0]) == 0) {
+        slab_set_node(affinity_cpu_node(cpus[0]));
+    }
+    // Get a listening socket, or keep the one we were upgraded on
+    int listenfd = inherited_listener(listen_fd_var);
+    free(listen_fd_var);
+    if (listenfd < 0) {
+        listenfd = get_listener_socket(PORT);
+    }
 
     if (listenfd < 0) {
         fprintf(stderr, "webserver: fatal error getting listening socket\n");
         exit(1);
     }
+    // Non-blocking, so draining the backlog at shutdown stops when it's empty
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+
+    log_info("webserver: waiting for connections on port %s...", PORT);
 
-    printf("webserver: waiting for connections on port %s...\n", PORT);
+    // Ready: the process we're replacing can stop accepting and drain
+    if (upgrade_from > 0 && upgrade_from == getppid()) {
+        log_info("webserver: taking over from pid %d", (int)upgrade_from);
+        kill(upgrade_from, SIGTERM);
+    }
 
     // This is the main loop that accepts incoming connections and
-    // responds to the request. The main parent process
-    // then goes back to waiting for new connections.
-    int add_task_res = 0;
-    while(1) {
-        socklen_t sin_size = sizeof their_addr;
-
-        // Parent process will block on the accept() call until someone
-        // makes a new connection:
-        newfd = accept(listenfd, (struct sockaddr *)&their_addr, &sin_size);
-        if (newfd == -1) {
-            perror("accept");
+    // hands them to the request workers, until SIGTERM or SIGINT.
+    while (!stopping) {
+        struct pollfd pfd = { listenfd, POLLIN, 0 };
+
+        if (upgrade_requested) {
+            upgrade_requested = 0;
+            if (upgrade_pid > 0) {
+                log_warn("webserver: upgrade to pid %d already in progress", (int)upgrade_pid);
+            } else if ((upgrade_pid = start_upgrade(argv, listenfd, &wait_mask)) > 0) {
+                log_info("webserver: upgrading, started pid %d", (int)upgrade_pid);
+            } else {
+                upgrade_pid = 0;
+            }
+        }
+        if (child_exited) {
+            int status;
+
+            child_exited = 0;
+            // The new binary only exits before taking over if it failed
+            if (upgrade_pid > 0 && waitpid(upgrade_pid, &status, WNOHANG) == upgrade_pid) {
+                log_warn("webserver: upgrade failed, pid %d exited with status %d; still serving",
+                         (int)upgrade_pid, WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+                upgrade_pid = 0;
+            }
+        }
+
+        // The signals are unblocked only while waiting here, so one can't
+        // land between checking the flags and going to sleep
+        if (ppoll(&pfd, 1, NULL, &wait_mask) == -1) {
+            if (errno != EINTR) {
+                perror("ppoll");
+            }
             continue;
         }
-        printf("--------------------------------------\n");
-        // Print out a message that we got the connection
-        inet_ntop(their_addr.ss_family,
-            get_in_addr((struct sockaddr *)&their_addr),
-            s, sizeof s);
-        printf("fd is %d\nserver: got connection from %s\n", newfd, s);
-        
-        // newfd is a new socket descriptor for the new connection.
-        // listenfd is still listening for new connections.
-        tpool_task task;
-        task.task_routine = (void *)handle_http_request;
-        handle_request_args args = {
-            newfd, cache
-        };
-        task.args = (void *)&args;
-        add_task_res = add_task_in_threadpool(threadpool, &task);
-    }
-
-    // Unreachable code
+        accept_connection(listenfd, &server);
+    }
 
-    return 0;
-}
\ No newline at end of file
+    // Stopped by the new binary taking over: the listen queue is its now
+    int handoff = upgrade_pid > 0 && stopped_by == upgrade_pid;
+    if (handoff) {
+        log_info("webserver: handed over to pid %d", (int)upgrade_pid);
+    }
+    return shutdown_server(listenfd, &server, handoff) == 0 ? 0 : 1;
+}
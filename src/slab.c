@@ -0,0 +1,236 @@
+/*
+
+Size-classed slab allocator
+
+Requests up to SLAB_MAX_SIZE are rounded up to a size class (powers of two
+and the points halfway between them, so at most a third is wasted) and
+served from that class. Each thread keeps a small magazine of free objects
+per class, so the common alloc/free is a push or pop with no locking.
+Empty magazines are refilled, and full ones half drained, in batches from
+a per-class depot under that class's lock. The depot carves new objects
+out of SLAB_CHUNK_SIZE chunks, which are never returned to malloc.
+
+Each NUMA node has its own set of depots. A thread pinned to a node says so
+with slab_set_node(), and from then on only trades objects with its node's
+depots. Chunks are first touched by the thread that carves objects from
+them, so their pages end up on that node too. Threads that never call it
+use node 0.
+
+The caller passes the size back to slab_free(); that's how the class is
+found without a header on every object.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "slab.h"
+
+#define SLAB_CHUNK_SIZE (1024 * 1024)
+#define MAGAZINE_SIZE 32
+
+struct magazine {
+    int count;
+    void *objs[MAGAZINE_SIZE];
+};
+
+struct depot {
+    pthread_mutex_t lock;
+    void *free_list; // Linked through each object's first word
+    char *carve, *carve_end; // Unused part of the current chunk
+};
+
+static struct depot depots[SLAB_MAX_NODES][SLAB_NUM_CLASSES];
+static __thread struct magazine magazines[SLAB_NUM_CLASSES];
+static __thread int magazines_registered;
+static __thread int thread_node;
+
+static pthread_once_t slab_once = PTHREAD_ONCE_INIT;
+static pthread_key_t slab_key;
+
+/**
+ * Thread exit: give this thread's cached objects back to the depots
+ */
+static void thread_exit(void *arg)
+{
+    (void)arg;
+
+    slab_thread_flush();
+}
+
+static void slab_init(void)
+{
+    for (int n = 0; n < SLAB_MAX_NODES; n++) {
+        for (int i = 0; i < SLAB_NUM_CLASSES; i++) {
+            pthread_mutex_init(&depots[n][i].lock, NULL);
+            depots[n][i].free_list = NULL;
+            depots[n][i].carve = depots[n][i].carve_end = NULL;
+        }
+    }
+
+    pthread_key_create(&slab_key, thread_exit);
+}
+
+/**
+ * Size class index for a request, 0 for SLAB_MIN_SIZE and below
+ */
+static int size_class(size_t size)
+{
+    if (size <= SLAB_MIN_SIZE) {
+        return 0;
+    }
+
+    // p is the next power of two; classes are p / 2 * 1.5 and p
+    int log2 = 64 - __builtin_clzll(size - 1);
+    size_t p = (size_t)1 << log2;
+    int idx = (log2 - 5) * 2; // Index of p
+
+    return size <= p / 4 * 3 ? idx - 1 : idx;
+}
+
+/**
+ * Object size of a class
+ */
+static size_t class_size(int idx)
+{
+    size_t p = (size_t)SLAB_MIN_SIZE << ((idx + 1) / 2);
+
+    return idx % 2 == 0 ? p : p / 4 * 3;
+}
+
+/**
+ * Move up to n objects from a depot into a magazine
+ *
+ * Returns the number moved; 0 means we're out of memory.
+ */
+static int refill(struct magazine *m, int idx, int n)
+{
+    struct depot *d = &depots[thread_node][idx];
+    size_t size = class_size(idx);
+
+    pthread_mutex_lock(&d->lock);
+
+    while (m->count < n && d->free_list != NULL) {
+        void *obj = d->free_list;
+        d->free_list = *(void **)obj;
+        m->objs[m->count++] = obj;
+    }
+
+    while (m->count < n) {
+        if (d->carve == NULL || d->carve + size > d->carve_end) {
+            size_t chunk = size > SLAB_CHUNK_SIZE / 8 ? size * 8 : SLAB_CHUNK_SIZE;
+            char *p = malloc(chunk);
+
+            if (p == NULL) {
+                break;
+            }
+
+            d->carve = p;
+            d->carve_end = p + chunk;
+        }
+
+        m->objs[m->count++] = d->carve;
+        d->carve += size;
+    }
+
+    pthread_mutex_unlock(&d->lock);
+
+    return m->count;
+}
+
+/**
+ * Move the top n objects of a magazine back to its depot
+ */
+static void drain(struct magazine *m, int idx, int n)
+{
+    struct depot *d = &depots[thread_node][idx];
+
+    pthread_mutex_lock(&d->lock);
+
+    while (n-- > 0 && m->count > 0) {
+        void *obj = m->objs[--m->count];
+        *(void **)obj = d->free_list;
+        d->free_list = obj;
+    }
+
+    pthread_mutex_unlock(&d->lock);
+}
+
+/**
+ * Allocate size bytes, aligned to 16
+ */
+void *slab_alloc(size_t size)
+{
+    if (size > SLAB_MAX_SIZE) {
+        return malloc(size);
+    }
+
+    pthread_once(&slab_once, slab_init);
+
+    if (!magazines_registered) {
+        // Any non-NULL value makes the key's destructor run at thread exit
+        pthread_setspecific(slab_key, magazines);
+        magazines_registered = 1;
+    }
+
+    int idx = size_class(size);
+    struct magazine *m = &magazines[idx];
+
+    if (m->count == 0 && refill(m, idx, MAGAZINE_SIZE / 2) == 0) {
+        return NULL;
+    }
+
+    return m->objs[--m->count];
+}
+
+/**
+ * Free memory from slab_alloc(); size must be the size it was allocated with
+ */
+void slab_free(void *ptr, size_t size)
+{
+    if (ptr == NULL) {
+        return;
+    }
+
+    if (size > SLAB_MAX_SIZE) {
+        free(ptr);
+        return;
+    }
+
+    int idx = size_class(size);
+    struct magazine *m = &magazines[idx];
+
+    if (m->count == MAGAZINE_SIZE) {
+        drain(m, idx, MAGAZINE_SIZE / 2);
+    }
+
+    m->objs[m->count++] = ptr;
+}
+
+/**
+ * Return every object cached by the calling thread to the shared depots
+ */
+void slab_thread_flush(void)
+{
+    if (!magazines_registered) {
+        return;
+    }
+
+    for (int i = 0; i < SLAB_NUM_CLASSES; i++) {
+        if (magazines[i].count > 0) {
+            drain(&magazines[i], i, magazines[i].count);
+        }
+    }
+}
+
+/**
+ * Use node's depots for the calling thread from now on
+ *
+ * Whatever the thread had cached goes back to its old node first.
+ */
+void slab_set_node(int node)
+{
+    pthread_once(&slab_once, slab_init);
+    slab_thread_flush();
+    thread_node = node >= 0 && node < SLAB_MAX_NODES ? node : 0;
+}
@@ -0,0 +1,16 @@
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+#include <stddef.h>
+
+#define SLAB_MIN_SIZE 32
+#define SLAB_MAX_SIZE 65536 // Bigger requests go straight to malloc
+#define SLAB_NUM_CLASSES 23 // 32, 48, 64, 96, ... 49152, 65536
+#define SLAB_MAX_NODES 8 // NUMA nodes with depots of their own; higher ones share node 0's
+
+extern void *slab_alloc(size_t size);
+extern void slab_free(void *ptr, size_t size);
+extern void slab_thread_flush(void);
+extern void slab_set_node(int node);
+
+#endif
@@ -3,44 +3,119 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
 #include "threadpool.h"
+#include "log.h"
+#include "trace.h"
+#include "affinity.h"
+#include "slab.h"
+
+static uint64_t pool_clock_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Update the overload signal from how long a task has waited in the queue
+ *
+ * Like CoDel, a long queue alone isn't overload: a burst drains quickly.
+ * Overload is the wait staying above target for a whole interval, and it
+ * ends as soon as one task gets through faster than target.
+ *
+ * NOTE: call with the pool lock held
+ */
+static void update_overload(thread_pool *pool, uint64_t now, uint64_t enqueued_ns)
+{
+    uint64_t waited = now - enqueued_ns;
+
+    if (waited < pool->target_ns) {
+        pool->above_target_until = 0;
+        pool->overloaded = false;
+        return;
+    }
+    if (pool->above_target_until == 0) {
+        // This task has been above target since enqueued_ns + target_ns
+        pool->above_target_until = enqueued_ns + pool->target_ns + pool->interval_ns;
+    }
+    if (now >= pool->above_target_until) {
+        if (!pool->overloaded) {
+            log_warn("threadpool: overloaded, queue wait %lu us", (unsigned long)(waited / 1000));
+        }
+        pool->overloaded = true;
+    }
+}
+
+/**
+ * Pin the calling worker to its CPU and point its slab caches at that
+ * CPU's NUMA node, so per-request memory is node-local
+ */
+static void pin_worker(thread_pool *pool)
+{
+    pthread_mutex_lock(&(pool->pool_lock));
+    int index = pool->next_index++;
+    pthread_mutex_unlock(&(pool->pool_lock));
+
+    int cpu = pool->cpus[index % pool->num_cpus];
+    if (affinity_pin_self(cpu) == 0) {
+        slab_set_node(affinity_cpu_node(cpu));
+    }
+}
 
 void *task_entry(void *tpool)
 {
     thread_pool *pool = (thread_pool *)tpool;
     tpool_task task;
+    if (pool->cpus != NULL) {
+        pin_worker(pool);
+    }
     while(true) {
         pthread_mutex_lock(&(pool->pool_lock));
         while(!pool->shutdown && (pool->task_size == 0)) {
-            printf("thread id: %u is waiting\n", (unsigned int)pthread_self());
+            log_debug("thread id: %u is waiting", (unsigned int)pthread_self());
             pthread_cond_wait(&(pool->no_task), &(pool->pool_lock));
         }
-        if (pool->shutdown) {
+        /* 关闭时先把队列里剩下的任务做完再退出 */
+        if (pool->shutdown && pool->task_size == 0) {
             pthread_mutex_unlock(&(pool->pool_lock));
-            printf("thread id:0x%x is exiting\n", (unsigned int)pthread_self());
+            log_debug("thread id:0x%x is exiting", (unsigned int)pthread_self());
             pthread_exit(NULL);
         }
-        task.task_routine = pool->task_head->task_routine;
-        task.args = pool->task_head->args;
-        tpool_task *temp = pool->task_head;
-        pool->task_head = pool->task_head->next;
+        tpool_task *queued = ilist_entry(ilist_pop_head(&pool->tasks), tpool_task, link);
+        trace_dequeued();
+        uint64_t now = pool_clock_ns();
+        update_overload(pool, now, queued->enqueued_ns);
+        task.task_routine = queued->task_routine;
+        task.args = queued->args;
         pool->task_size--;
-        printf("+++++++++++\nnow task num need to be handled : %d\n+++++++++++\n", pool->task_size);
-        free(temp);
+        pthread_cond_signal(&(pool->not_full));
+        log_debug("now task num need to be handled : %zu", pool->task_size);
+        ilist_insert(&pool->free_tasks, &queued->link);
         pool->busy_thread_size++;
         pthread_mutex_unlock(&(pool->pool_lock));
         (task.task_routine)(task.args);
         pthread_mutex_lock(&(pool->pool_lock));
-        printf("thread id: %utask finished\n", (unsigned int)pthread_self());
-        pool->busy_thread_size++;
+        log_debug("thread id: %u task finished", (unsigned int)pthread_self());
+        pool->busy_thread_size--;
         task.task_routine = NULL;
         task.args = NULL;
+        if (pool->task_size == 0 && pool->busy_thread_size == 0) {
+            pthread_cond_broadcast(&(pool->pool_ready));
+        }
         pthread_mutex_unlock(&(pool->pool_lock));
     }
     pthread_exit(NULL);
 }
 
 thread_pool *create_threadpool(int num)
+{
+    return create_threadpool_pinned(num, NULL, 0);
+}
+
+/* 创建线程池，线程i绑定到cpus[i % num_cpus]上 */
+thread_pool *create_threadpool_pinned(int num, const int *cpus, int num_cpus)
 {
     thread_pool *pool = (thread_pool *)malloc(sizeof(thread_pool) * num);
     if (pool == NULL) {
@@ -52,32 +127,61 @@ thread_pool *create_threadpool(int num)
     pool->pool_size = num;
     pool->busy_thread_size = 0;
     pool->task_size = 0;
-    pool->task_head = (tpool_task *)malloc(sizeof(tpool_task));
-    pool->task_head->task_routine = NULL;
-    pool->task_head->args = NULL;
-    pool->task_head->next = NULL;
+    pool->max_tasks = 0;
+    pool->policy = TPOOL_ADMIT_PAUSE;
+    pool->target_ns = TPOOL_DEFAULT_TARGET_US * 1000ull;
+    pool->interval_ns = TPOOL_DEFAULT_INTERVAL_US * 1000ull;
+    pool->above_target_until = 0;
+    pool->overloaded = false;
+    pool->shed_count = 0;
+    pool->cpus = NULL;
+    pool->num_cpus = 0;
+    pool->next_index = 0;
+    if (cpus != NULL && num_cpus > 0) {
+        pool->cpus = malloc(sizeof(int) * num_cpus);
+        if (pool->cpus == NULL) {
+            perror("create thread pool failed in cpus mallocing");
+            free(pool);
+            return NULL;
+        }
+        memcpy(pool->cpus, cpus, sizeof(int) * num_cpus);
+        pool->num_cpus = num_cpus;
+    }
+    ilist_init(&pool->tasks);
+    ilist_init(&pool->free_tasks);
 
     pool->thread = (pthread_t *)malloc(sizeof(pthread_t) * num);
     if (pool->thread == NULL) {
         perror("create thread pool failed in thread mallocing");
+        free(pool->cpus);
         free(pool);
         return NULL;
     }
     if(pthread_mutex_init(&(pool->pool_lock), NULL) != 0) {
         perror("init pool lock failed");
         free(pool->thread);
+        free(pool->cpus);
         free(pool);
         return NULL;
     }
     if (pthread_cond_init(&(pool->pool_ready), NULL) != 0) {
         perror("init pool ready condition failed");
         free(pool->thread);
+        free(pool->cpus);
         free(pool);
         return NULL;
     }
     if (pthread_cond_init(&(pool->no_task), NULL) != 0) {
         perror("init pool no task condition failed");
         free(pool->thread);
+        free(pool->cpus);
+        free(pool);
+        return NULL;
+    }
+    if (pthread_cond_init(&(pool->not_full), NULL) != 0) {
+        perror("init pool not full condition failed");
+        free(pool->thread);
+        free(pool->cpus);
         free(pool);
         return NULL;
     }
@@ -87,30 +191,181 @@ thread_pool *create_threadpool(int num)
     return pool;
 }
 
-/* 返回0表示添加成功，添加完任务后去唤醒线程 */
+/**
+ * Bound the task queue and choose what happens when it's full or overloaded
+ *
+ * max_tasks:   queue limit, 0 for none
+ * policy:      see tpool_admission. TPOOL_ADMIT_PAUSE only looks at the
+ *              limit; the other two also shed while queue wait says the
+ *              pool is overloaded.
+ * target_us, interval_us: the queue wait overload signal, 0 for defaults.
+ *              TPOOL_NO_TARGET turns it off, for pools whose tasks are
+ *              expected to wait.
+ */
+void threadpool_set_admission(thread_pool *pool, size_t max_tasks, tpool_admission policy,
+                              unsigned int target_us, unsigned int interval_us)
+{
+    pthread_mutex_lock(&(pool->pool_lock));
+    pool->max_tasks = max_tasks;
+    pool->policy = policy;
+    if (target_us == TPOOL_NO_TARGET) {
+        pool->target_ns = UINT64_MAX; // No wait is ever above it
+    } else {
+        pool->target_ns = (target_us != 0 ? target_us : TPOOL_DEFAULT_TARGET_US) * 1000ull;
+    }
+    pool->interval_ns = (interval_us != 0 ? interval_us : TPOOL_DEFAULT_INTERVAL_US) * 1000ull;
+    pthread_mutex_unlock(&(pool->pool_lock));
+    pthread_cond_broadcast(&(pool->not_full));
+}
+
+/*
+ * 返回0表示添加成功，添加完任务后去唤醒线程
+ *
+ * TPOOL_REJECTED: the admission policy refused the task; it's still the
+ * caller's. With TPOOL_ADMIT_DROP_OLDEST the task is always queued, and the
+ * dropped one's reject_routine runs here, on the caller's thread.
+ */
 int add_task_in_threadpool(thread_pool *pool, tpool_task *task)
 {
     if (pool == NULL) {
         return -1;
     }
     pthread_mutex_lock(&(pool->pool_lock));
-    tpool_task *cur_task = pool->task_head;
-    while(cur_task->next != NULL) {
-        cur_task = cur_task->next;
+    bool full = pool->max_tasks != 0 && pool->task_size >= pool->max_tasks;
+    if (pool->task_size == 0) {
+        // Nothing is waiting, so nothing is waiting too long
+        pool->above_target_until = 0;
+        pool->overloaded = false;
+    } else {
+        // The oldest task has waited at least this long; counting it now
+        // catches overload even when every worker is stuck and nothing is
+        // being dequeued
+        tpool_task *oldest = ilist_entry(pool->tasks.head, tpool_task, link);
+        uint64_t now = pool_clock_ns();
+        update_overload(pool, now, oldest->enqueued_ns);
     }
-    cur_task->next = (tpool_task *)malloc(sizeof(tpool_task));
-    if (cur_task->next == NULL) {
-        perror("add task failed in malloc next task\n");
-        return -1;
+
+    tpool_task dropped = { NULL, NULL, NULL, 0, {NULL, NULL} };
+    if (pool->policy == TPOOL_ADMIT_PAUSE) {
+        while (!pool->shutdown && pool->max_tasks != 0 && pool->task_size >= pool->max_tasks) {
+            pthread_cond_wait(&(pool->not_full), &(pool->pool_lock));
+        }
+    } else if (full || pool->overloaded) {
+        pool->shed_count++;
+        if (pool->policy == TPOOL_ADMIT_REJECT || pool->task_size == 0) {
+            pthread_mutex_unlock(&(pool->pool_lock));
+            return TPOOL_REJECTED;
+        }
+        // Recycle the oldest task's node for the new one
+        tpool_task *oldest = ilist_entry(ilist_pop_head(&pool->tasks), tpool_task, link);
+        dropped = *oldest;
+        pool->task_size--;
+        ilist_insert(&pool->free_tasks, &oldest->link);
+    }
+
+    /* 优先复用空闲链表里的任务节点，没有才malloc */
+    tpool_task *queued;
+    struct ilist_link *link = ilist_pop_head(&pool->free_tasks);
+    if (link != NULL) {
+        queued = ilist_entry(link, tpool_task, link);
+    } else {
+        queued = (tpool_task *)malloc(sizeof(tpool_task));
+        if (queued == NULL) {
+            perror("add task failed in malloc next task\n");
+            pthread_mutex_unlock(&(pool->pool_lock));
+            return -1;
+        }
     }
-    ((tpool_task *)(cur_task->next))->task_routine = NULL;
-    ((tpool_task *)(cur_task->next))->args = NULL;
-    ((tpool_task *)(cur_task->next))->next = NULL;
-    cur_task->task_routine = task->task_routine;
-    cur_task->args = task->args;
+    queued->task_routine = task->task_routine;
+    queued->args = task->args;
+    queued->reject_routine = task->reject_routine;
+    queued->enqueued_ns = pool_clock_ns();
+    ilist_append(&pool->tasks, &queued->link);
     pool->task_size++;
-    printf("add task success!!!\n");
+    log_debug("add task success");
     pthread_mutex_unlock(&(pool->pool_lock));
     pthread_cond_signal(&(pool->no_task));
+    if (dropped.reject_routine != NULL) {
+        dropped.reject_routine(dropped.args);
+    }
     return 0;
-}
\ No newline at end of file
+}
+
+/**
+ * Wait until no task is queued or running, for at most timeout_ms
+ *
+ * Return 0 once the pool is idle, -1 if the timeout ran out first.
+ */
+int threadpool_wait_idle(thread_pool *pool, int timeout_ms)
+{
+    struct timespec deadline;
+    int rv = 0;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&(pool->pool_lock));
+    while (pool->task_size != 0 || pool->busy_thread_size != 0) {
+        if (pthread_cond_timedwait(&(pool->pool_ready), &(pool->pool_lock), &deadline) == ETIMEDOUT) {
+            rv = pool->task_size != 0 || pool->busy_thread_size != 0 ? -1 : 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&(pool->pool_lock));
+    return rv;
+}
+
+/*
+ * 关闭线程池：已排队的任务会先执行完，然后回收所有线程和内存
+ *
+ * Blocks until every worker has exited, so call threadpool_wait_idle()
+ * first if the tasks might take a while.
+ */
+void threadpool_destroy(thread_pool *pool)
+{
+    struct ilist_link *link;
+
+    pthread_mutex_lock(&(pool->pool_lock));
+    pool->shutdown = true;
+    pthread_mutex_unlock(&(pool->pool_lock));
+    pthread_cond_broadcast(&(pool->no_task));
+    pthread_cond_broadcast(&(pool->not_full));
+
+    for (size_t i = 0; i < pool->pool_size; i++) {
+        pthread_join(pool->thread[i], NULL);
+    }
+
+    while ((link = ilist_pop_head(&pool->free_tasks)) != NULL) {
+        free(ilist_entry(link, tpool_task, link));
+    }
+    pthread_cond_destroy(&(pool->not_full));
+    pthread_cond_destroy(&(pool->no_task));
+    pthread_cond_destroy(&(pool->pool_ready));
+    pthread_mutex_destroy(&(pool->pool_lock));
+    free(pool->thread);
+    free(pool->cpus);
+    free(pool);
+}
+
+/* 读取排队任务数和忙碌线程数 */
+void threadpool_stats(thread_pool *pool, size_t *queued, size_t *busy)
+{
+    pthread_mutex_lock(&(pool->pool_lock));
+    *queued = pool->task_size;
+    *busy = pool->busy_thread_size;
+    pthread_mutex_unlock(&(pool->pool_lock));
+}
+
+/* 读取过载状态和被拒绝/丢弃的任务数 */
+void threadpool_admission_stats(thread_pool *pool, bool *overloaded, size_t *shed)
+{
+    pthread_mutex_lock(&(pool->pool_lock));
+    *overloaded = pool->overloaded;
+    *shed = pool->shed_count;
+    pthread_mutex_unlock(&(pool->pool_lock));
+}
@@ -3,11 +3,27 @@
 
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include "llist.h"
+
+/* 队列满或过载时的准入策略 */
+typedef enum {
+    TPOOL_ADMIT_PAUSE,       // Block the caller until there's room; the accept backlog fills instead
+    TPOOL_ADMIT_REJECT,      // Refuse the new task; add_task_in_threadpool() returns TPOOL_REJECTED
+    TPOOL_ADMIT_DROP_OLDEST, // Queue it and drop the oldest queued task through its reject_routine
+} tpool_admission;
+
+#define TPOOL_REJECTED 1
+#define TPOOL_DEFAULT_TARGET_US 5000     // Queue wait that counts as "too long"
+#define TPOOL_DEFAULT_INTERVAL_US 100000 // How long it must stay too long to be overload
+#define TPOOL_NO_TARGET UINT32_MAX       // As target_us: shed on the queue limit alone
 
 typedef struct tpool_work{
    void *(*task_routine)(void *args);
    void *args;
-   struct tool_work *next;
+   void (*reject_routine)(void *args); // Run instead of task_routine if the task is dropped; may be NULL
+   uint64_t enqueued_ns;
+   struct ilist_link link; // 在任务队列或空闲链表中的位置
 }tpool_task;
 
 typedef enum {
@@ -26,14 +42,36 @@ typedef struct tpool{
     size_t               busy_thread_size; // count of busy threads
     size_t               task_size;        // 需要运行的任务
     pthread_t            *thread;          // a array of threads
-    tpool_task           *task_head;       // tpool_work queue
-    pthread_cond_t       pool_ready;       // 线程池操作的条件变量
+    struct ilist         tasks;            // tpool_work queue, oldest first
+    struct ilist         free_tasks;       // recycled tpool_work entries
+    pthread_cond_t       pool_ready;       // 队列空且没有线程在忙时广播, 见threadpool_wait_idle()
     pthread_cond_t       no_task;          // 没有任务 来阻塞线程池
+    pthread_cond_t       not_full;         // 队列有空位了 (TPOOL_ADMIT_PAUSE)
     pthread_mutex_t      pool_lock;        // 操作线程池的互斥量
+
+    // Admission control, see threadpool_set_admission()
+    size_t               max_tasks;        // 0: unbounded
+    tpool_admission      policy;
+    uint64_t             target_ns;
+    uint64_t             interval_ns;
+    uint64_t             above_target_until; // CoDel: overloaded if wait stays above target past this
+    bool                 overloaded;
+    size_t               shed_count;       // Tasks rejected or dropped so far
+
+    int                  *cpus;            // 线程i绑定到cpus[i % num_cpus]; NULL: 不绑定
+    int                  num_cpus;
+    int                  next_index;       // 下一个启动的线程的编号
 }thread_pool;
 
 thread_pool *create_threadpool(int num);
+thread_pool *create_threadpool_pinned(int num, const int *cpus, int num_cpus);
+void threadpool_set_admission(thread_pool *pool, size_t max_tasks, tpool_admission policy,
+                              unsigned int target_us, unsigned int interval_us);
 int add_task_in_threadpool(thread_pool *pool, tpool_task *task);
+int threadpool_wait_idle(thread_pool *pool, int timeout_ms);
+void threadpool_destroy(thread_pool *pool);
+void threadpool_stats(thread_pool *pool, size_t *queued, size_t *busy);
+void threadpool_admission_stats(thread_pool *pool, bool *overloaded, size_t *shed);
 void *task_entry(void *tpool);
 
 
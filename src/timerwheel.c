@@ -0,0 +1,204 @@
+/*
+
+Hashed timer wheel
+
+Connection timeouts are armed and cancelled several times per request but
+almost never fire, so both have to be cheap and nothing may cost a syscall
+per connection. A timer goes into the slot for the tick it expires on, a
+plain intrusive list, so arming, re-arming and cancelling are O(1). A single
+thread advances the wheel once per tick and fires whatever is due in the
+slots it passes. Timers further out than one revolution just stay in their
+slot until their round comes up.
+
+Timers fire with the wheel lock held. That makes timer_wheel_cancel() a
+guarantee: once it returns, the callback isn't running and won't run, so the
+owner can free or reuse whatever the timer points at.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "timerwheel.h"
+
+static uint64_t clock_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Create a timer wheel that ticks every tick_ms milliseconds
+ *
+ * It doesn't advance until timer_wheel_start() or timer_wheel_advance().
+ */
+struct timer_wheel *timer_wheel_create(int tick_ms)
+{
+    struct timer_wheel *wheel = malloc(sizeof *wheel);
+    if (wheel == NULL) {
+        perror("timer wheel create failed");
+        return NULL;
+    }
+    if (pthread_mutex_init(&wheel->lock, NULL) != 0) {
+        perror("init timer wheel lock failed");
+        free(wheel);
+        return NULL;
+    }
+    wheel->tick_ms = tick_ms > 0 ? tick_ms : 1;
+    wheel->now = 0;
+    wheel->start_ms = clock_ms();
+    wheel->armed_count = 0;
+    wheel->running = 0;
+    for (int i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+        ilist_init(&wheel->slots[i]);
+    }
+    return wheel;
+}
+
+/**
+ * Free a timer wheel; armed timers are forgotten, not fired
+ */
+void timer_wheel_destroy(struct timer_wheel *wheel)
+{
+    timer_wheel_stop(wheel);
+    pthread_mutex_destroy(&wheel->lock);
+    free(wheel);
+}
+
+/**
+ * Set up a timer that calls fn(arg) when it fires
+ */
+void timer_init(struct timer *timer, void (*fn)(void *arg), void *arg)
+{
+    timer->armed = 0;
+    timer->expires = 0;
+    timer->fn = fn;
+    timer->arg = arg;
+}
+
+/**
+ * Unlink an armed timer
+ *
+ * NOTE: call with the wheel lock held
+ */
+static void unlink_timer(struct timer_wheel *wheel, struct timer *timer)
+{
+    ilist_remove(&wheel->slots[timer->expires & (TIMER_WHEEL_SLOTS - 1)], &timer->link);
+    timer->armed = 0;
+    wheel->armed_count--;
+}
+
+/**
+ * Fire the timer timeout_ms from now, rounded up to a whole tick
+ *
+ * Ticks count from the last one processed, so the timer can fire up to a
+ * tick early. Re-arming an armed timer moves it.
+ */
+void timer_wheel_arm(struct timer_wheel *wheel, struct timer *timer, int timeout_ms)
+{
+    uint64_t ticks = (timeout_ms + wheel->tick_ms - 1) / wheel->tick_ms;
+
+    pthread_mutex_lock(&wheel->lock);
+    if (timer->armed) {
+        unlink_timer(wheel, timer);
+    }
+    // Never the current tick: it's already been processed
+    timer->expires = wheel->now + (ticks > 0 ? ticks : 1);
+    timer->armed = 1;
+    ilist_append(&wheel->slots[timer->expires & (TIMER_WHEEL_SLOTS - 1)], &timer->link);
+    wheel->armed_count++;
+    pthread_mutex_unlock(&wheel->lock);
+}
+
+/**
+ * Disarm a timer; a no-op if it isn't armed
+ *
+ * When this returns the timer's callback isn't running and won't be called.
+ */
+void timer_wheel_cancel(struct timer_wheel *wheel, struct timer *timer)
+{
+    pthread_mutex_lock(&wheel->lock);
+    if (timer->armed) {
+        unlink_timer(wheel, timer);
+    }
+    pthread_mutex_unlock(&wheel->lock);
+}
+
+/**
+ * Process every tick up to elapsed_ms after the wheel was created
+ *
+ * Return the number of timers fired.
+ */
+int timer_wheel_advance(struct timer_wheel *wheel, uint64_t elapsed_ms)
+{
+    uint64_t target = elapsed_ms / wheel->tick_ms;
+    int fired = 0;
+
+    pthread_mutex_lock(&wheel->lock);
+    while (wheel->now < target) {
+        wheel->now++;
+        struct ilist *slot = &wheel->slots[wheel->now & (TIMER_WHEEL_SLOTS - 1)];
+        struct ilist_link *link = slot->head;
+
+        while (link != NULL) {
+            struct ilist_link *next = link->next;
+            struct timer *timer = ilist_entry(link, struct timer, link);
+
+            // Timers a revolution or more out share the slot; skip them
+            if (timer->expires <= wheel->now) {
+                unlink_timer(wheel, timer);
+                timer->fn(timer->arg);
+                fired++;
+            }
+            link = next;
+        }
+    }
+    pthread_mutex_unlock(&wheel->lock);
+
+    return fired;
+}
+
+/**
+ * Timer thread: advance the wheel every tick
+ */
+static void *wheel_thread(void *arg)
+{
+    struct timer_wheel *wheel = arg;
+    struct timespec pause = { wheel->tick_ms / 1000, (wheel->tick_ms % 1000) * 1000000L };
+
+    while (wheel->running) {
+        nanosleep(&pause, NULL);
+        timer_wheel_advance(wheel, clock_ms() - wheel->start_ms);
+    }
+
+    return NULL;
+}
+
+/**
+ * Start the thread that drives the wheel
+ *
+ * Return 0 on success, -1 on error.
+ */
+int timer_wheel_start(struct timer_wheel *wheel)
+{
+    wheel->running = 1;
+    if (pthread_create(&wheel->thread, NULL, wheel_thread, wheel) != 0) {
+        perror("timer wheel thread");
+        wheel->running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Stop and join the timer thread, if it's running
+ */
+void timer_wheel_stop(struct timer_wheel *wheel)
+{
+    if (wheel->running) {
+        wheel->running = 0;
+        pthread_join(wheel->thread, NULL);
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef _TIMERWHEEL_H_
+#define _TIMERWHEEL_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include "llist.h"
+
+#define TIMER_WHEEL_SLOTS 1024 // Power of two; one revolution is this many ticks
+
+// A timer, usually embedded in the struct it times out
+struct timer {
+    struct ilist_link link; // In its slot while armed
+    uint64_t expires; // Tick it fires on
+    int armed;
+    void (*fn)(void *arg); // Called with the wheel lock held; must not touch the wheel
+    void *arg;
+};
+
+// Hashed timer wheel: a timer lives in slot expires % TIMER_WHEEL_SLOTS, so
+// arming and cancelling are O(1) whatever the number of timers
+struct timer_wheel {
+    pthread_mutex_t lock;
+    int tick_ms;
+    uint64_t now; // Ticks processed
+    uint64_t start_ms; // Clock at tick 0
+    long armed_count;
+    struct ilist slots[TIMER_WHEEL_SLOTS];
+
+    pthread_t thread;
+    volatile int running;
+};
+
+extern struct timer_wheel *timer_wheel_create(int tick_ms);
+extern void timer_wheel_destroy(struct timer_wheel *wheel);
+extern void timer_init(struct timer *timer, void (*fn)(void *arg), void *arg);
+extern void timer_wheel_arm(struct timer_wheel *wheel, struct timer *timer, int timeout_ms);
+extern void timer_wheel_cancel(struct timer_wheel *wheel, struct timer *timer);
+extern int timer_wheel_advance(struct timer_wheel *wheel, uint64_t elapsed_ms);
+extern int timer_wheel_start(struct timer_wheel *wheel);
+extern void timer_wheel_stop(struct timer_wheel *wheel);
+
+#endif
@@ -0,0 +1,221 @@
+/*
+
+Per-request phase tracing
+
+Off unless trace_start() is called (the server does when WEBSERVER_TRACE
+names an output file). When on, one in every sample_every requests gets a
+trace_now() timestamp at each TRACE_* point; the rest cost a branch.
+
+A finished span goes through the log ring as a binary record, and the log
+writer turns it into Chrome trace-event JSON: one async track per request,
+with a "request" event from accept to send and a nested event per phase
+(queue, recv, parse, cache lookup, file load, send), each ending at its
+point and starting at the previous point reached. Load the file in
+chrome://tracing or Perfetto.
+
+Ticks are converted to microseconds against CLOCK_MONOTONIC, calibrated
+between trace_start() and the time each span is written.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include "trace.h"
+#include "log.h"
+
+int trace_enabled;
+static int sample_every;
+static __thread unsigned int sample_count;
+static __thread uint64_t dequeued_at;
+static __thread int thread_id;
+
+// Only touched at start/stop and by the log writer
+static FILE *trace_fp;
+static int first_event = 1;
+static uint64_t start_ticks, start_ns;
+static double ticks_per_ns = 1.0;
+
+// Name of the phase that ends at each point
+static const char *phase_names[TRACE_NUM_POINTS] = {
+    "accept", "enqueue", "queue", "recv", "parse", "cache lookup", "file load", "send"
+};
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Measure the tick rate over the longest interval we have
+ */
+static void calibrate(void)
+{
+    uint64_t now_ticks = trace_now();
+    uint64_t now_ns = monotonic_ns();
+
+    if (now_ns - start_ns > 1000000) {
+        ticks_per_ns = (double)(now_ticks - start_ticks) / (now_ns - start_ns);
+    }
+}
+
+/**
+ * Microseconds since trace_start() for a tick count
+ */
+static double ticks_to_us(uint64_t ticks)
+{
+    return ((double)ticks - (double)start_ticks) / ticks_per_ns / 1000.0;
+}
+
+static void emit(const char *name, char ph, unsigned long id, int tid, double ts_us,
+                 struct trace_span *span)
+{
+    fprintf(trace_fp, "%s{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"%c\",\"id\":%lu,"
+            "\"pid\":%d,\"tid\":%d,\"ts\":%.3f", first_event ? "" : ",\n", name, ph, id,
+            (int)getpid(), tid, ts_us);
+    if (span != NULL) {
+        // Anything that would need escaping in JSON is shown as '?'
+        fprintf(trace_fp, ",\"args\":{\"fd\":%d,\"path\":\"", span->fd);
+        for (char *p = span->path; *p != '\0' && p < span->path + TRACE_PATH_SIZE; p++) {
+            if (*p == '"' || *p == '\\' || (unsigned char)*p < 0x20) {
+                fputc('?', trace_fp);
+            } else {
+                fputc(*p, trace_fp);
+            }
+        }
+        fprintf(trace_fp, "\"}");
+    }
+    fputc('}', trace_fp);
+    first_event = 0;
+}
+
+/**
+ * Log writer callback: write one span as trace events
+ */
+static void trace_sink(const void *data, int length)
+{
+    static unsigned long next_id;
+    struct trace_span span;
+
+    if (trace_fp == NULL || length != sizeof span) {
+        return;
+    }
+    memcpy(&span, data, sizeof span);
+    calibrate(); // Once per span, so its events line up exactly
+
+    unsigned long id = ++next_id;
+    int prev = TRACE_ACCEPT;
+    int last = TRACE_ACCEPT;
+
+    for (int i = TRACE_ACCEPT + 1; i < TRACE_NUM_POINTS; i++) {
+        if (span.ts[i] != 0) {
+            last = i;
+        }
+    }
+
+    emit("request", 'b', id, span.tid, ticks_to_us(span.ts[TRACE_ACCEPT]), &span);
+    for (int i = TRACE_ACCEPT + 1; i < TRACE_NUM_POINTS; i++) {
+        if (span.ts[i] == 0) {
+            continue;
+        }
+        emit(phase_names[i], 'b', id, span.tid, ticks_to_us(span.ts[prev]), NULL);
+        emit(phase_names[i], 'e', id, span.tid, ticks_to_us(span.ts[i]), NULL);
+        prev = i;
+    }
+    emit("request", 'e', id, span.tid, ticks_to_us(span.ts[last]), NULL);
+
+    fflush(trace_fp);
+}
+
+/**
+ * Start tracing one in every sample_every requests to a JSON file at path
+ *
+ * Return 0 on success, -1 on error.
+ */
+int trace_start(char *path, int sample_every_n)
+{
+    trace_fp = fopen(path, "w");
+    if (trace_fp == NULL) {
+        perror(path);
+        return -1;
+    }
+    fputs("[\n", trace_fp);
+
+    start_ticks = trace_now();
+    start_ns = monotonic_ns();
+    sample_every = sample_every_n > 0 ? sample_every_n : 1;
+    log_set_sink(LOG_CHANNEL_TRACE, trace_sink);
+    trace_enabled = 1;
+
+    return 0;
+}
+
+/**
+ * Should the calling thread's next request be traced?
+ */
+int trace_sample(void)
+{
+    return trace_enabled && sample_count++ % sample_every == 0;
+}
+
+/**
+ * Note that the calling worker just took a task off the queue
+ */
+void trace_dequeued(void)
+{
+    if (trace_enabled) {
+        dequeued_at = trace_now();
+    }
+}
+
+/**
+ * When the calling worker last took a task off the queue
+ */
+uint64_t trace_last_dequeue(void)
+{
+    return dequeued_at;
+}
+
+/**
+ * Kernel thread id of the calling thread
+ */
+int trace_thread_id(void)
+{
+    if (thread_id == 0) {
+        thread_id = syscall(SYS_gettid);
+    }
+
+    return thread_id;
+}
+
+/**
+ * Queue a finished span for the log writer; never blocks
+ */
+void trace_write(struct trace_span *span)
+{
+    (void)log_write_record(LOG_CHANNEL_TRACE, span, sizeof *span);
+}
+
+/**
+ * Write out queued spans and finish the JSON file
+ */
+void trace_stop(void)
+{
+    if (!trace_enabled) {
+        return;
+    }
+
+    trace_enabled = 0;
+    log_flush();
+    log_set_sink(LOG_CHANNEL_TRACE, NULL);
+    fputs("\n]\n", trace_fp);
+    fclose(trace_fp);
+    trace_fp = NULL;
+}
@@ -0,0 +1,58 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Points in a request's life, in order
+#define TRACE_ACCEPT 0
+#define TRACE_ENQUEUE 1
+#define TRACE_DEQUEUE 2 // Picked up by a worker in task_entry()
+#define TRACE_RECV 3
+#define TRACE_PARSE 4
+#define TRACE_CACHE 5 // Cache or bundle lookup done
+#define TRACE_LOAD 6  // File read or mapped, on a cache miss
+#define TRACE_SEND 7  // Response sent
+#define TRACE_NUM_POINTS 8
+
+#define TRACE_PATH_SIZE 64
+
+// One sampled request, handed to the log writer as a binary record
+struct trace_span {
+    uint64_t ts[TRACE_NUM_POINTS]; // trace_now() at each point, 0 if not reached
+    int32_t fd;
+    int32_t tid; // Worker thread
+    char path[TRACE_PATH_SIZE];
+};
+
+/**
+ * Cheap timestamp in trace ticks: the TSC where there is one, else the
+ * coarse monotonic clock in nanoseconds
+ */
+static inline uint64_t trace_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+extern int trace_enabled; // Read-only; set by trace_start()
+
+extern int trace_start(char *path, int sample_every);
+extern int trace_sample(void);
+extern void trace_dequeued(void);
+extern uint64_t trace_last_dequeue(void);
+extern int trace_thread_id(void);
+extern void trace_write(struct trace_span *span);
+extern void trace_stop(void);
+
+#endif